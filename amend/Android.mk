@@ -8,11 +8,13 @@ amend_src_files := \
 	lexer.l \
 	parser_y.y \
 	ast.c \
+	intern.c \
 	symtab.c \
 	commands.c \
 	execute.c
 
 amend_test_files := \
+	test_intern.c \
 	test_symtab.c \
 	test_commands.c
 
@@ -17,6 +17,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <time.h>
 #undef NDEBUG
 #include <assert.h>
 #include "ast.h"
@@ -27,6 +28,21 @@ typedef struct {
     const char **v;
 } StringList;
 
+typedef struct {
+    const AmCommand *command;
+    long long wallNs;
+    long long cpuNs;
+    long long bytes;
+} ExecProfileEntry;
+
+static struct {
+    bool enabled;
+    ExecProfileEntry *entries;
+    int count;
+    int size;
+    long long currentBytes;
+} gExecProfile;
+
 static int execBooleanValue(ExecContext *ctx,
         const AmBooleanValue *booleanValue, bool *result);
 static int execStringValue(ExecContext *ctx, const AmStringValue *stringValue,
@@ -165,7 +181,10 @@ execStringValue(ExecContext *ctx, const AmStringValue *stringValue,
 
     switch (stringValue->type) {
     case AM_SVAL_LITERAL:
-        *result = strdup(stringValue->u.literal);
+        /* Literals are interned by the parser and live as long as
+         * the AST, so hand out the AST's copy rather than a new one.
+         */
+        *result = stringValue->u.literal;
         break;
     case AM_SVAL_FUNCTION:
         ret = execFunctionCall(ctx, stringValue->u.function, result);
@@ -299,12 +318,52 @@ execCommand(ExecContext *ctx, const AmCommand *command)
     return ret;
 }
 
+static long long
+nowNs(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int
+execProfiledCommand(ExecContext *ctx, const AmCommand *command)
+{
+    if (gExecProfile.count >= gExecProfile.size) {
+        int newSize = gExecProfile.size * 2 + 64;
+        ExecProfileEntry *newEntries = (ExecProfileEntry *)realloc(
+                gExecProfile.entries, newSize * sizeof(ExecProfileEntry));
+        if (newEntries == NULL) {
+            return execCommand(ctx, command);
+        }
+        gExecProfile.entries = newEntries;
+        gExecProfile.size = newSize;
+    }
+
+    gExecProfile.currentBytes = 0;
+    long long wall = nowNs(CLOCK_MONOTONIC);
+    long long cpu = nowNs(CLOCK_PROCESS_CPUTIME_ID);
+    int ret = execCommand(ctx, command);
+
+    ExecProfileEntry *e = &gExecProfile.entries[gExecProfile.count++];
+    e->command = command;
+    e->wallNs = nowNs(CLOCK_MONOTONIC) - wall;
+    e->cpuNs = nowNs(CLOCK_PROCESS_CPUTIME_ID) - cpu;
+    e->bytes = gExecProfile.currentBytes;
+    return ret;
+}
+
 int
 execCommandList(ExecContext *ctx, const AmCommandList *commandList)
 {
     int i;
     for (i = 0; i < commandList->commandCount; i++) {
-        int ret = execCommand(ctx, commandList->commands[i]);
+        int ret;
+        if (gExecProfile.enabled) {
+            ret = execProfiledCommand(ctx, commandList->commands[i]);
+        } else {
+            ret = execCommand(ctx, commandList->commands[i]);
+        }
         if (ret != 0) {
             int line = commandList->commands[i]->line;
             return line > 0 ? line : ret;
@@ -313,3 +372,112 @@ execCommandList(ExecContext *ctx, const AmCommandList *commandList)
 
     return 0;
 }
+
+void
+setExecProfiling(bool enabled)
+{
+    gExecProfile.enabled = enabled;
+}
+
+bool
+isExecProfiling()
+{
+    return gExecProfile.enabled;
+}
+
+void
+addExecProfileBytes(long long bytes)
+{
+    if (gExecProfile.enabled) {
+        gExecProfile.currentBytes += bytes;
+    }
+}
+
+static int
+compareProfileEntries(const void *a, const void *b)
+{
+    long long wa = ((const ExecProfileEntry *)a)->wallNs;
+    long long wb = ((const ExecProfileEntry *)b)->wallNs;
+    return wa < wb ? 1 : (wa > wb ? -1 : 0);
+}
+
+void
+writeExecProfile(FILE *fp)
+{
+    int n = gExecProfile.count;
+    if (n == 0) {
+        return;
+    }
+
+    /* Totals per command name.
+     */
+    ExecProfileEntry *totals =
+            (ExecProfileEntry *)malloc(n * sizeof(ExecProfileEntry));
+    int *calls = (int *)malloc(n * sizeof(int));
+    if (totals == NULL || calls == NULL) {
+        free(totals);
+        free(calls);
+        return;
+    }
+    int numTotals = 0;
+    int i, j;
+    for (i = 0; i < n; i++) {
+        const ExecProfileEntry *e = &gExecProfile.entries[i];
+        for (j = 0; j < numTotals; j++) {
+            if (!strcmp(totals[j].command->name, e->command->name)) break;
+        }
+        if (j == numTotals) {
+            totals[j] = *e;
+            calls[j] = 1;
+            numTotals++;
+        } else {
+            totals[j].wallNs += e->wallNs;
+            totals[j].cpuNs += e->cpuNs;
+            totals[j].bytes += e->bytes;
+            calls[j]++;
+        }
+    }
+
+    /* The same layout as edify's WriteProfile(), so both can be read the
+     * same way.  Commands don't nest, so self time is all of it, and
+     * there are no byte offsets into the script.
+     */
+    fprintf(fp, "# function calls wall_ms self_ms cpu_ms bytes name\n");
+    for (i = 0; i < numTotals; i++) {
+        /* Selection sort keeps calls[] in step with totals[]. */
+        int best = i;
+        for (j = i + 1; j < numTotals; j++) {
+            if (totals[j].wallNs > totals[best].wallNs) best = j;
+        }
+        ExecProfileEntry te = totals[i];
+        totals[i] = totals[best];
+        totals[best] = te;
+        int tc = calls[i];
+        calls[i] = calls[best];
+        calls[best] = tc;
+
+        fprintf(fp, "function %d %.3f %.3f %.3f %lld %s\n", calls[i],
+                totals[i].wallNs / 1e6, totals[i].wallNs / 1e6,
+                totals[i].cpuNs / 1e6, totals[i].bytes,
+                totals[i].command->name);
+    }
+    free(totals);
+    free(calls);
+
+    ExecProfileEntry *sorted =
+            (ExecProfileEntry *)malloc(n * sizeof(ExecProfileEntry));
+    if (sorted == NULL) {
+        return;
+    }
+    memcpy(sorted, gExecProfile.entries, n * sizeof(ExecProfileEntry));
+    qsort(sorted, n, sizeof(ExecProfileEntry), compareProfileEntries);
+    fprintf(fp, "# site calls wall_ms self_ms cpu_ms bytes "
+                "line start-end name\n");
+    for (i = 0; i < n; i++) {
+        fprintf(fp, "site 1 %.3f %.3f %.3f %lld %u 0-0 %s\n",
+                sorted[i].wallNs / 1e6, sorted[i].wallNs / 1e6,
+                sorted[i].cpuNs / 1e6, sorted[i].bytes,
+                sorted[i].command->line, sorted[i].command->name);
+    }
+    free(sorted);
+}
@@ -17,9 +17,29 @@
 #ifndef AMEND_EXECUTE_H_
 #define AMEND_EXECUTE_H_
 
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "ast.h"
+
 typedef struct ExecContext ExecContext;
 
 /* Returns 0 on success, otherwise the line number that failed. */
 int execCommandList(ExecContext *ctx, const AmCommandList *commandList);
 
+/* When profiling is enabled, execCommandList() records the wall-clock
+ * and CPU time each command takes, and writeExecProfile() writes one
+ * "function" line per command name and one "site" line per command
+ * executed, slowest first, in the layout edify's WriteProfile() uses.
+ */
+void setExecProfiling(bool enabled);
+bool isExecProfiling(void);
+
+/* Charges "bytes" written to the command currently executing.
+ * Does nothing unless profiling is enabled.
+ */
+void addExecProfileBytes(long long bytes);
+
+void writeExecProfile(FILE *fp);
+
 #endif  // AMEND_EXECUTE_H_
@@ -0,0 +1,176 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "intern.h"
+
+#define DEFAULT_BUCKET_COUNT 256    /* must be a power of two */
+#define ARENA_CHUNK_SIZE (16 * 1024)
+
+/* Strings are packed back-to-back into large arena chunks, so
+ * interning a script's worth of tokens costs a handful of mallocs
+ * rather than one per token.
+ */
+typedef struct InternEntry InternEntry;
+struct InternEntry {
+    InternEntry *next;
+    unsigned int hash;
+    unsigned int len;
+    char str[1];
+};
+
+typedef struct InternChunk InternChunk;
+struct InternChunk {
+    InternChunk *next;
+    size_t used;
+    size_t size;
+    char data[1];
+};
+
+static struct {
+    InternEntry **buckets;
+    unsigned int bucketCount;
+    int count;
+    InternChunk *chunks;
+} gPool;
+
+static unsigned int
+hashBytes(const char *str, size_t len)
+{
+    /* FNV-1a */
+    unsigned int hash = 2166136261u;
+    while (len-- > 0) {
+        hash ^= (unsigned char)*str++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static void *
+arenaAlloc(size_t size)
+{
+    /* Keep entries pointer-aligned.
+     */
+    size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+
+    InternChunk *chunk = gPool.chunks;
+    if (chunk == NULL || chunk->size - chunk->used < size) {
+        size_t chunkSize = ARENA_CHUNK_SIZE;
+        if (chunkSize < size) {
+            chunkSize = size;
+        }
+        chunk = (InternChunk *)malloc(sizeof(InternChunk) + chunkSize);
+        if (chunk == NULL) {
+            return NULL;
+        }
+        chunk->used = 0;
+        chunk->size = chunkSize;
+        chunk->next = gPool.chunks;
+        gPool.chunks = chunk;
+    }
+    void *p = chunk->data + chunk->used;
+    chunk->used += size;
+    return p;
+}
+
+static int
+growBuckets(void)
+{
+    unsigned int newCount = gPool.bucketCount * 2;
+    if (newCount < DEFAULT_BUCKET_COUNT) {
+        newCount = DEFAULT_BUCKET_COUNT;
+    }
+    InternEntry **newBuckets =
+            (InternEntry **)calloc(newCount, sizeof(InternEntry *));
+    if (newBuckets == NULL) {
+        return -1;
+    }
+
+    unsigned int i;
+    for (i = 0; i < gPool.bucketCount; i++) {
+        InternEntry *e = gPool.buckets[i];
+        while (e != NULL) {
+            InternEntry *next = e->next;
+            InternEntry **b = &newBuckets[e->hash & (newCount - 1)];
+            e->next = *b;
+            *b = e;
+            e = next;
+        }
+    }
+    free(gPool.buckets);
+    gPool.buckets = newBuckets;
+    gPool.bucketCount = newCount;
+    return 0;
+}
+
+const char *
+internString(const char *str, size_t len)
+{
+    if (str == NULL) {
+        return NULL;
+    }
+    if ((unsigned int)gPool.count >= gPool.bucketCount) {
+        if (growBuckets() != 0) {
+            return NULL;
+        }
+    }
+
+    unsigned int hash = hashBytes(str, len);
+    InternEntry **bucket = &gPool.buckets[hash & (gPool.bucketCount - 1)];
+    InternEntry *e;
+    for (e = *bucket; e != NULL; e = e->next) {
+        if (e->hash == hash && e->len == len &&
+                memcmp(e->str, str, len) == 0)
+        {
+            return e->str;
+        }
+    }
+
+    e = (InternEntry *)arenaAlloc(sizeof(InternEntry) + len);
+    if (e == NULL) {
+        return NULL;
+    }
+    e->hash = hash;
+    e->len = len;
+    memcpy(e->str, str, len);
+    e->str[len] = '\0';
+    e->next = *bucket;
+    *bucket = e;
+    gPool.count++;
+
+    return e->str;
+}
+
+int
+internCount()
+{
+    return gPool.count;
+}
+
+void
+internCleanup()
+{
+    while (gPool.chunks != NULL) {
+        InternChunk *next = gPool.chunks->next;
+        free(gPool.chunks);
+        gPool.chunks = next;
+    }
+    free(gPool.buckets);
+    gPool.buckets = NULL;
+    gPool.bucketCount = 0;
+    gPool.count = 0;
+}
@@ -0,0 +1,41 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef AMEND_INTERN_H_
+#define AMEND_INTERN_H_
+
+#include <stddef.h>
+
+/* Return a NUL-terminated copy of the first "len" bytes of "str",
+ * shared with every other caller that interns the same bytes.
+ * "str" need not be NUL-terminated; it is typically a slice of the
+ * script buffer.
+ *
+ * Interned strings live until internCleanup() is called, and must
+ * not be modified or freed.  Returns NULL on allocation failure.
+ */
+const char *internString(const char *str, size_t len);
+
+/* Returns the number of distinct strings in the pool.
+ */
+int internCount(void);
+
+/* Frees every interned string.  Any pointer previously returned
+ * by internString() becomes invalid.
+ */
+void internCleanup(void);
+
+#endif  // AMEND_INTERN_H_
@@ -31,6 +31,18 @@ void yyset_in(FILE *in_str);
 
 const char *tokenToString(int token);
 
+/* The value of a TOK_STRING, TOK_IDENTIFIER or TOK_WORD token.
+ * "offset" and "length" locate the token's source text in the script
+ * (for quoted strings, the text between the quotes); "string" is the
+ * token's unescaped value, interned so that it stays valid after the
+ * lexer moves on and is shared by every occurrence of the same text.
+ */
+typedef struct {
+    unsigned int offset;
+    unsigned int length;
+    const char *string;
+} AmLiteral;
+
 typedef enum {
     AM_UNKNOWN_ARGS,
     AM_WORD_ARGS,
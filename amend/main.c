@@ -37,7 +37,7 @@ lexTest()
             printf(" %s", tokenToString(token));
             fflush(stdout);
             if (token == TOK_IDENTIFIER) {
-                if (strcmp(yylval.literalString, "assert") == 0) {
+                if (strcmp(yylval.literal.string, "assert") == 0) {
                     setLexerArgumentType(AM_BOOLEAN_ARGS);
                 } else {
                     setLexerArgumentType(AM_WORD_ARGS);
@@ -86,6 +86,12 @@ main(int argc, char *argv[])
         fprintf(stderr, "test_cmd_fn() failed: %d\n", ret);
         exit(ret);
     }
+    extern int test_intern(void);
+    ret = test_intern();
+    if (ret != 0) {
+        fprintf(stderr, "test_intern() failed: %d\n", ret);
+        exit(ret);
+    }
 #endif
 
     argc--;
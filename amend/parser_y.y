@@ -57,7 +57,7 @@ AmCommandList *gCommands = NULL;
 %start  lines
 
 %union  {
-        char *literalString;
+        AmLiteral literal;
         AmFunctionArgumentBuilder *functionArgumentBuilder;
         AmFunctionArguments *functionArguments;
         AmFunctionCall *functionCall;
@@ -70,14 +70,13 @@ AmCommandList *gCommands = NULL;
     }
 
 %token  TOK_AND TOK_OR TOK_EQ TOK_NE TOK_GE TOK_LE TOK_EOF TOK_EOL TOK_ERROR
-%token  <literalString> TOK_STRING TOK_IDENTIFIER TOK_WORD
+%token  <literal> TOK_STRING TOK_IDENTIFIER TOK_WORD
 
 %type   <commandList> lines
 %type   <command> command line
 %type   <functionArgumentBuilder> function_arguments
 %type   <functionArguments> function_arguments_or_empty
 %type   <functionCall> function_call
-%type   <literalString> function_name
 %type   <stringValue> string_value
 %type   <booleanValue> boolean_expression
 %type   <wordListBuilder> word_list
@@ -142,9 +141,10 @@ line :      line_ending
 
 command :   TOK_IDENTIFIER
                 {
-                    Command *cmd = findCommand($1);
+                    Command *cmd = findCommand($1.string);
                     if (cmd == NULL) {
-                        fprintf(stderr, "Unknown command \"%s\"\n", $1);
+                        fprintf(stderr, "Unknown command \"%s\"\n",
+                                $1.string);
                         YYABORT;
                     }
                     $$ = (AmCommand *)malloc(sizeof(AmCommand));
@@ -152,10 +152,7 @@ command :   TOK_IDENTIFIER
                         YYABORT;
                     }
                     $$->line = getLexerLineNumber();
-                    $$->name = strdup($1);
-                    if ($$->name == NULL) {
-                        YYABORT;
-                    }
+                    $$->name = $1.string;
                     $$->args = NULL;
                     CommandArgumentType argType = getCommandArgumentType(cmd);
                     if (argType == CMD_ARGS_BOOLEAN) {
@@ -245,10 +242,7 @@ word_list : /* empty */
                         $$->next = $1;
                         $$->wordCount = $$->next->wordCount + 1;
                     }
-                    $$->word = strdup($2);
-                    if ($$->word == NULL) {
-                        YYABORT;
-                    }
+                    $$->word = $2.string;
                 }
         ;
 
@@ -298,10 +292,7 @@ string_value :
                         YYABORT;
                     }
                     $$->type = AM_SVAL_LITERAL;
-                    $$->u.literal = strdup($1);
-                    if ($$->u.literal == NULL) {
-                        YYABORT;
-                    }
+                    $$->u.literal = $1.string;
                 }
         |   TOK_STRING
                 {
@@ -310,10 +301,7 @@ string_value :
                         YYABORT;
                     }
                     $$->type = AM_SVAL_LITERAL;
-                    $$->u.literal = strdup($1);
-                    if ($$->u.literal == NULL) {
-                        YYABORT;
-                    }
+                    $$->u.literal = $1.string;
                 }
         |   function_call
                 {
@@ -326,39 +314,28 @@ string_value :
                 }
         ;
 
-        /* We can't just say
-         *  TOK_IDENTIFIER '(' function_arguments_or_empty ')'
-         * because parsing function_arguments_or_empty will clobber
-         * the underlying string that yylval.literalString points to.
+        /* Token strings are interned by the lexer, so parsing
+         * function_arguments_or_empty can't clobber the name.
          */
 function_call :
-            function_name '(' function_arguments_or_empty ')'
+            TOK_IDENTIFIER '(' function_arguments_or_empty ')'
                 {
-                    Function *fn = findFunction($1);
+                    Function *fn = findFunction($1.string);
                     if (fn == NULL) {
-                        fprintf(stderr, "Unknown function \"%s\"\n", $1);
+                        fprintf(stderr, "Unknown function \"%s\"\n",
+                                $1.string);
                         YYABORT;
                     }
                     $$ = (AmFunctionCall *)malloc(sizeof(AmFunctionCall));
                     if ($$ == NULL) {
                         YYABORT;
                     }
-                    $$->name = $1;
-                    if ($$->name == NULL) {
-                        YYABORT;
-                    }
+                    $$->name = $1.string;
                     $$->fn = fn;
                     $$->args = $3;
                 }
         ;
 
-function_name :
-            TOK_IDENTIFIER
-                {
-                    $$ = strdup($1);
-                }
-        ;
-
 function_arguments_or_empty :
             /* empty */
                 {
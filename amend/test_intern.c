@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#undef NDEBUG
+#include <assert.h>
+#include "intern.h"
+
+int
+test_intern()
+{
+    const char *s1, *s2, *s3;
+    int count;
+
+    /* Start from an empty pool.
+     */
+    internCleanup();
+    assert(internCount() == 0);
+
+    /* str must be non-NULL.
+     */
+    s1 = internString(NULL, 0);
+    assert(s1 == NULL);
+
+    /* Interned strings are NUL-terminated copies of the slice.
+     */
+    s1 = internString("system_partition", 6);
+    assert(s1 != NULL);
+    assert(strcmp(s1, "system") == 0);
+    assert(internCount() == 1);
+
+    /* The same bytes, from a different buffer, return the same pointer.
+     */
+    s2 = internString("system", 6);
+    assert(s2 == s1);
+    assert(internCount() == 1);
+
+    /* A prefix is a different string.
+     */
+    s3 = internString("system", 3);
+    assert(s3 != NULL && s3 != s1);
+    assert(strcmp(s3, "sys") == 0);
+    assert(internCount() == 2);
+
+    /* The empty string can be interned.
+     */
+    s3 = internString("", 0);
+    assert(s3 != NULL && s3[0] == '\0');
+    assert(internCount() == 3);
+
+    /* Insert enough strings to force the table and the arena to grow,
+     * and make sure earlier strings survive.
+     */
+    int i;
+    char buf[32];
+    for (i = 0; i < 5000; i++) {
+        snprintf(buf, sizeof(buf), "word%d", i);
+        assert(internString(buf, strlen(buf)) != NULL);
+    }
+    count = internCount();
+    assert(count == 5003);
+    assert(internString("system", 6) == s1);
+    snprintf(buf, sizeof(buf), "word%d", 1234);
+    s2 = internString(buf, strlen(buf));
+    assert(strcmp(s2, "word1234") == 0);
+    assert(internCount() == count);
+
+    internCleanup();
+    assert(internCount() == 0);
+
+    return 0;
+}
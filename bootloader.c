@@ -21,6 +21,7 @@
 
 #include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 static const char *CACHE_NAME = "CACHE:";
@@ -41,13 +42,35 @@ static void dump_data(const char *data, int len) {
 }
 #endif
 
-int get_bootloader_message(struct bootloader_message *out) {
-    size_t write_size;
+/* A copy of the first MISC_PAGES pages of misc, read the first time
+ * anyone asks.  Nothing else writes misc while recovery is running, so
+ * after that a get is a memcpy, a set that wouldn't change anything is
+ * skipped, and a real set only has to write.  Writes still go straight
+ * to flash: callers rely on the message being there if we're interrupted.
+ */
+static char *misc_data = NULL;
+static size_t misc_page_size = 0;
+
+static void drop_misc_cache() {
+    free(misc_data);
+    misc_data = NULL;
+}
+
+static const MtdPartition *find_misc_partition(size_t *write_size) {
     const MtdPartition *part = get_root_mtd_partition(MISC_NAME);
-    if (part == NULL || mtd_partition_info(part, NULL, NULL, &write_size)) {
+    if (part == NULL || mtd_partition_info(part, NULL, NULL, write_size)) {
         LOGE("Can't find %s\n", MISC_NAME);
-        return -1;
+        return NULL;
     }
+    return part;
+}
+
+static int load_misc_cache() {
+    if (misc_data != NULL) return 0;
+
+    size_t write_size;
+    const MtdPartition *part = find_misc_partition(&write_size);
+    if (part == NULL) return -1;
 
     MtdReadContext *read = mtd_read_partition(part);
     if (read == NULL) {
@@ -56,11 +79,19 @@ int get_bootloader_message(struct bootloader_message *out) {
     }
 
     const ssize_t size = write_size * MISC_PAGES;
-    char data[size];
+    char *data = malloc(size);
+    if (data == NULL) {
+        LOGE("Can't allocate %d bytes for %s\n", (int) size, MISC_NAME);
+        mtd_read_close(read);
+        return -1;
+    }
     ssize_t r = mtd_read_data(read, data, size);
     if (r != size) LOGE("Can't read %s\n(%s)\n", MISC_NAME, strerror(errno));
     mtd_read_close(read);
-    if (r != size) return -1;
+    if (r != size) {
+        free(data);
+        return -1;
+    }
 
 #ifdef LOG_VERBOSE
     printf("\n--- get_bootloader_message ---\n");
@@ -68,51 +99,57 @@ int get_bootloader_message(struct bootloader_message *out) {
     printf("\n");
 #endif
 
-    memcpy(out, &data[write_size * MISC_COMMAND_PAGE], sizeof(*out));
+    misc_data = data;
+    misc_page_size = write_size;
+    return 0;
+}
+
+int get_bootloader_message(struct bootloader_message *out) {
+    if (load_misc_cache()) return -1;
+    memcpy(out, &misc_data[misc_page_size * MISC_COMMAND_PAGE], sizeof(*out));
     return 0;
 }
 
 int set_bootloader_message(const struct bootloader_message *in) {
-    size_t write_size;
-    const MtdPartition *part = get_root_mtd_partition(MISC_NAME);
-    if (part == NULL || mtd_partition_info(part, NULL, NULL, &write_size)) {
-        LOGE("Can't find %s\n", MISC_NAME);
-        return -1;
-    }
+    if (load_misc_cache()) return -1;
 
-    MtdReadContext *read = mtd_read_partition(part);
-    if (read == NULL) {
-        LOGE("Can't open %s\n(%s)\n", MISC_NAME, strerror(errno));
-        return -1;
+    char *command = &misc_data[misc_page_size * MISC_COMMAND_PAGE];
+    if (!memcmp(command, in, sizeof(*in))) {
+        LOGI("Boot command \"%s\" already set\n",
+             in->command[0] != 255 ? in->command : "");
+        return 0;
     }
 
-    ssize_t size = write_size * MISC_PAGES;
-    char data[size];
-    ssize_t r = mtd_read_data(read, data, size);
-    if (r != size) LOGE("Can't read %s\n(%s)\n", MISC_NAME, strerror(errno));
-    mtd_read_close(read);
-    if (r != size) return -1;
+    size_t write_size;
+    const MtdPartition *part = find_misc_partition(&write_size);
+    if (part == NULL) return -1;
 
-    memcpy(&data[write_size * MISC_COMMAND_PAGE], in, sizeof(*in));
+    memcpy(command, in, sizeof(*in));
+    const ssize_t size = misc_page_size * MISC_PAGES;
 
 #ifdef LOG_VERBOSE
     printf("\n--- set_bootloader_message ---\n");
-    dump_data(data, size);
+    dump_data(misc_data, size);
     printf("\n");
 #endif
 
+    // If anything below fails, we no longer know what's on flash;
+    // forget the copy so the next call reads it again.
     MtdWriteContext *write = mtd_write_partition(part);
     if (write == NULL) {
         LOGE("Can't open %s\n(%s)\n", MISC_NAME, strerror(errno));
+        drop_misc_cache();
         return -1;
     }
-    if (mtd_write_data(write, data, size) != size) {
+    if (mtd_write_data(write, misc_data, size) != size) {
         LOGE("Can't write %s\n(%s)\n", MISC_NAME, strerror(errno));
         mtd_write_close(write);
+        drop_misc_cache();
         return -1;
     }
     if (mtd_write_close(write)) {
         LOGE("Can't finish %s\n(%s)\n", MISC_NAME, strerror(errno));
+        drop_misc_cache();
         return -1;
     }
 
@@ -155,8 +192,35 @@ struct update_header {
     unsigned fail_bitmap_length;
 };
 
+struct update_writer {
+    MtdWriteContext *write;
+    int remaining;
+};
+
+static int write_update_data(const char *data, int length, void *cookie) {
+    struct update_writer *writer = (struct update_writer *) cookie;
+    if (length > writer->remaining) {
+        LOGE("Update is longer than expected\n");
+        return -1;
+    }
+    if (mtd_write_data(writer->write, data, length) != length) return -1;
+    writer->remaining -= length;
+    return 0;
+}
+
+// Pad the current section out to a block boundary, and check that the
+// next one starts where it was expected to.  Returns its actual start.
+static off_t finish_section(MtdWriteContext *write, off_t expected) {
+    off_t pos = mtd_erase_blocks(write, 0);
+    if (pos != (off_t) -1 && pos != expected) {
+        LOGW("Bad block in %s; next section moved to 0x%08lx\n",
+             CACHE_NAME, (unsigned long) pos);
+    }
+    return pos;
+}
+
 int write_update_for_bootloader(
-        const char *update, int update_length,
+        update_source_fn update_source, void *update_cookie, int update_length,
         int bitmap_width, int bitmap_height, int bitmap_bpp,
         const char *busy_bitmap, const char *fail_bitmap) {
     if (ensure_root_path_unmounted(CACHE_NAME)) {
@@ -165,101 +229,118 @@ int write_update_for_bootloader(
     }
 
     const MtdPartition *part = get_root_mtd_partition(CACHE_NAME);
-    if (part == NULL) {
+    size_t total_size, block_size;
+    if (part == NULL ||
+        mtd_partition_info(part, &total_size, &block_size, NULL)) {
         LOGE("Can't find %s\n", CACHE_NAME);
         return -1;
     }
 
-    MtdWriteContext *write = mtd_write_partition(part);
-    if (write == NULL) {
-        LOGE("Can't open %s\n(%s)\n", CACHE_NAME, strerror(errno));
-        return -1;
-    }
-
-    /* Write an invalid (zero) header first, to disable any previous
-     * update and any other structured contents (like a filesystem),
-     * and as a placeholder for the amount of space required.
+    /* Lay out the header block and each section, block-aligned, so we can
+     * write each block independently without complicated buffering.
+     * Everything is known up front, so check it fits before touching
+     * anything.
      */
 
     struct update_header header;
     memset(&header, 0, sizeof(header));
     const ssize_t header_size = sizeof(header);
-    if (mtd_write_data(write, (char*) &header, header_size) != header_size) {
-        LOGE("Can't write header to %s\n(%s)\n", CACHE_NAME, strerror(errno));
-        mtd_write_close(write);
-        return -1;
-    }
-
-    /* Write each section individually block-aligned, so we can write
-     * each block independently without complicated buffering.
-     */
-
     memcpy(&header.MAGIC, UPDATE_MAGIC, UPDATE_MAGIC_SIZE);
     header.version = UPDATE_VERSION;
     header.size = header_size;
 
-    header.image_offset = mtd_erase_blocks(write, 0);
-    header.image_length = update_length;
-    if ((int) header.image_offset == -1 ||
-        mtd_write_data(write, update, update_length) != update_length) {
-        LOGE("Can't write update to %s\n(%s)\n", CACHE_NAME, strerror(errno));
-        mtd_write_close(write);
-        return -1;
-    }
-
     header.bitmap_width = bitmap_width;
     header.bitmap_height = bitmap_height;
     header.bitmap_bpp = bitmap_bpp;
-
     int bitmap_length = (bitmap_bpp + 7) / 8 * bitmap_width * bitmap_height;
 
-    header.busy_bitmap_offset = mtd_erase_blocks(write, 0);
+#define BLOCKS(len) (((len) + block_size - 1) / block_size * block_size)
+    header.image_offset = block_size;
+    header.image_length = update_length;
+    header.busy_bitmap_offset = header.image_offset + BLOCKS(update_length);
     header.busy_bitmap_length = busy_bitmap != NULL ? bitmap_length : 0;
-    if ((int) header.busy_bitmap_offset == -1 ||
-        mtd_write_data(write, busy_bitmap, bitmap_length) != bitmap_length) {
-        LOGE("Can't write bitmap to %s\n(%s)\n", CACHE_NAME, strerror(errno));
-        mtd_write_close(write);
+    header.fail_bitmap_offset =
+            header.busy_bitmap_offset + BLOCKS(header.busy_bitmap_length);
+    header.fail_bitmap_length = fail_bitmap != NULL ? bitmap_length : 0;
+    size_t end = header.fail_bitmap_offset + BLOCKS(header.fail_bitmap_length);
+#undef BLOCKS
+
+    if (end > total_size) {
+        LOGE("Update (%lu bytes) doesn't fit in %s (%lu bytes)\n",
+             (unsigned long) end, CACHE_NAME, (unsigned long) total_size);
+        errno = ENOSPC;
         return -1;
     }
 
-    header.fail_bitmap_offset = mtd_erase_blocks(write, 0);
-    header.fail_bitmap_length = fail_bitmap != NULL ? bitmap_length : 0;
-    if ((int) header.fail_bitmap_offset == -1 ||
-        mtd_write_data(write, fail_bitmap, bitmap_length) != bitmap_length) {
-        LOGE("Can't write bitmap to %s\n(%s)\n", CACHE_NAME, strerror(errno));
-        mtd_write_close(write);
+    MtdWriteContext *write = mtd_write_partition(part);
+    if (write == NULL) {
+        LOGE("Can't open %s\n(%s)\n", CACHE_NAME, strerror(errno));
         return -1;
     }
 
-    /* Write the header last, after all the blocks it refers to, so that
-     * when the magic number is installed everything is valid.
+    /* Write an invalid (zero) header block first, to disable any previous
+     * update and any other structured contents (like a filesystem).  The
+     * real one replaces it at the end, once everything it refers to is
+     * valid.
      */
 
-    if (mtd_write_close(write)) {
-        LOGE("Can't finish writing %s\n(%s)\n", CACHE_NAME, strerror(errno));
+    struct update_header zero;
+    memset(&zero, 0, sizeof(zero));
+    off_t pos = -1;
+    if (mtd_write_data(write, (char*) &zero, header_size) != header_size ||
+        (pos = mtd_erase_blocks(write, 0)) != (off_t) header.image_offset) {
+        if (pos != (off_t) -1) errno = EIO;  // The header block is bad.
+        LOGE("Can't write header to %s\n(%s)\n", CACHE_NAME, strerror(errno));
+        mtd_write_close(write);
         return -1;
     }
 
-    write = mtd_write_partition(part);
-    if (write == NULL) {
-        LOGE("Can't reopen %s\n(%s)\n", CACHE_NAME, strerror(errno));
+    // The sections stream straight from their sources; only a partial
+    // last block of each is copied, to be padded.  A bad block moves
+    // everything after it along.
+    off_t moved = 0;
+    struct update_writer writer = { write, update_length };
+    if (update_source(write_update_data, &writer, update_cookie) != 0 ||
+        writer.remaining != 0 ||
+        (pos = finish_section(write, header.busy_bitmap_offset)) == -1) {
+        LOGE("Can't write update to %s\n(%s)\n", CACHE_NAME, strerror(errno));
+        mtd_write_close(write);
         return -1;
     }
+    moved = pos - header.busy_bitmap_offset;
+    header.busy_bitmap_offset = pos;
 
-    if (mtd_write_data(write, (char*) &header, header_size) != header_size) {
-        LOGE("Can't rewrite header to %s\n(%s)\n", CACHE_NAME, strerror(errno));
+    if ((header.busy_bitmap_length > 0 &&
+         mtd_write_data(write, busy_bitmap, bitmap_length) != bitmap_length) ||
+        (pos = finish_section(write,
+                header.fail_bitmap_offset + moved)) == -1) {
+        LOGE("Can't write bitmap to %s\n(%s)\n", CACHE_NAME, strerror(errno));
+        mtd_write_close(write);
+        return -1;
+    }
+    moved = pos - header.fail_bitmap_offset;
+    header.fail_bitmap_offset = pos;
+
+    if ((header.fail_bitmap_length > 0 &&
+         mtd_write_data(write, fail_bitmap, bitmap_length) != bitmap_length) ||
+        finish_section(write, end + moved) == -1) {
+        LOGE("Can't write bitmap to %s\n(%s)\n", CACHE_NAME, strerror(errno));
         mtd_write_close(write);
         return -1;
     }
 
-    if (mtd_erase_blocks(write, 0) != (off_t) header.image_offset) {
-        LOGE("Misalignment rewriting %s\n(%s)\n", CACHE_NAME, strerror(errno));
+    /* Write the header last, after all the blocks it refers to, so that
+     * when the magic number is installed everything is valid.
+     */
+
+    if (mtd_rewrite_block(write, 0, (char*) &header, header_size)) {
+        LOGE("Can't rewrite header to %s\n(%s)\n", CACHE_NAME, strerror(errno));
         mtd_write_close(write);
         return -1;
     }
 
     if (mtd_write_close(write)) {
-        LOGE("Can't finish header of %s\n(%s)\n", CACHE_NAME, strerror(errno));
+        LOGE("Can't finish writing %s\n(%s)\n", CACHE_NAME, strerror(errno));
         return -1;
     }
 
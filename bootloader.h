@@ -42,17 +42,27 @@ struct bootloader_message {
 };
 
 /* Read and write the bootloader command from the "misc" partition.
- * These return zero on success.
+ * These return zero on success.  Misc is read once and kept in memory;
+ * setting the message it already holds doesn't touch the flash.
  */
 int get_bootloader_message(struct bootloader_message *out);
 int set_bootloader_message(const struct bootloader_message *in);
 
+/* Supplies the update image to write_update_for_bootloader(), by calling
+ * write() with each piece of it in order.  Both return 0 on success.
+ */
+typedef int (*update_write_fn)(const char *data, int length, void *cookie);
+typedef int (*update_source_fn)(update_write_fn write, void *write_cookie,
+        void *source_cookie);
+
 /* Write an update to the cache partition for update-radio or update-hboot.
+ * The image (update_length bytes) is streamed from update_source; if it
+ * fails, the update is left disabled.
  * Note, this destroys any filesystem on the cache partition!
  * The expected bitmap format is 240x320, 16bpp (2Bpp), RGB 5:6:5.
  */
 int write_update_for_bootloader(
-        const char *update, int update_len,
+        update_source_fn update_source, void *update_cookie, int update_len,
         int bitmap_width, int bitmap_height, int bitmap_bpp,
         const char *busy_bitmap, const char *error_bitmap);
 
@@ -30,6 +30,7 @@
 #include <unistd.h>
 
 #include "amend/commands.h"
+#include "amend/execute.h"
 #include "commands.h"
 #include "common.h"
 #include "cutils/misc.h"
@@ -187,6 +188,10 @@ static void extract_cb(const char *fn, void *cookie)
     // minzip writes the filename to the log, so we don't need to
     ExtractContext *ctx = (ExtractContext*) cookie;
     ui_set_progress((float) ++ctx->num_done / ctx->num_total);
+    if (isExecProfiling()) {
+        struct stat st;
+        if (lstat(fn, &st) == 0) addExecProfileBytes(st.st_size);
+    }
 }
 
 /* copy_dir <src-dir> <dst-dir> [<timestamp>]
@@ -492,25 +497,6 @@ cmd_symlink(const char *name, void *cookie, int argc, const char *argv[])
     return 0;
 }
 
-struct FirmwareContext {
-    size_t total_bytes, done_bytes;
-    char *data;
-};
-
-static bool firmware_fn(const unsigned char *data, int data_len, void *cookie)
-{
-    struct FirmwareContext *context = (struct FirmwareContext*) cookie;
-    if (context->done_bytes + data_len > context->total_bytes) {
-        LOGE("Data overrun in firmware\n");
-        return false;  // Should not happen, but let's be safe.
-    }
-
-    memcpy(context->data + context->done_bytes, data, data_len);
-    context->done_bytes += data_len;
-    ui_set_progress(context->done_bytes * 1.0 / context->total_bytes);
-    return true;
-}
-
 /* write_radio_image <src-image>
  * write_hboot_image <src-image>
  * Doesn't actually take effect until the rest of installation finishes.
@@ -543,7 +529,6 @@ cmd_write_firmware_image(const char *name, void *cookie,
         return 1;
     }
 
-    ui_print("Extracting %s image...\n", type);
     char path[PATH_MAX];
     const ZipArchive *package;
     if (!translate_package_root_path(argv[0], path, sizeof(path), &package)) {
@@ -557,26 +542,10 @@ cmd_write_firmware_image(const char *name, void *cookie,
         return 1;
     }
 
-    // Load the update image into RAM.
-    struct FirmwareContext context;
-    context.total_bytes = mzGetZipEntryUncompLen(entry);
-    context.done_bytes = 0;
-    context.data = malloc(context.total_bytes);
-    if (context.data == NULL) {
-        LOGE("Can't allocate %d bytes for %s\n", context.total_bytes, argv[0]);
-        return 1;
-    }
-
-    if (!mzProcessZipEntryContents(package, entry, firmware_fn, &context) ||
-        context.done_bytes != context.total_bytes) {
-        LOGE("Can't read %s\n", argv[0]);
-        free(context.data);
-        return 1;
-    }
-
-    if (remember_firmware_update(type, context.data, context.total_bytes)) {
+    // Just note where the image is; it's read when it's installed.
+    if (remember_firmware_update(type, get_package_root_file(),
+            package, entry)) {
         LOGE("Can't store %s image\n", type);
-        free(context.data);
         return 1;
     }
 
@@ -588,6 +557,7 @@ static bool write_raw_image_process_fn(
         int data_len, void *ctx)
 {
     int r = mtd_write_data((MtdWriteContext*)ctx, (const char *)data, data_len);
+    if (r > 0) addExecProfileBytes(r);
     if (r == data_len) return true;
     LOGE("%s\n", strerror(errno));
     return false;
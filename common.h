@@ -19,9 +19,16 @@
 
 #include <stdio.h>
 
+#include "logger.h"
+
 // Initialize the graphics system.
 void ui_init();
 
+// Bring up just enough to show a plain progress bar, for commands run
+// without anyone watching; no bitmaps are decoded and keys are ignored.
+// ui_init() completes the job later.
+void ui_init_minimal();
+
 // Use KEY_* codes from <linux/input.h> or KEY_DREAM_* from "minui/minui.h".
 int ui_wait_key();            // waits for a key/button press, returns the code
 int ui_key_pressed(int key);  // returns >0 if the code is currently pressed
@@ -80,8 +87,8 @@ void ui_show_indeterminate_progress();
 void ui_reset_progress();
 
 #define LOGE(...) ui_print("E:" __VA_ARGS__)
-#define LOGW(...) fprintf(stderr, "W:" __VA_ARGS__)
-#define LOGI(...) fprintf(stderr, "I:" __VA_ARGS__)
+#define LOGW(...) log_write("W:" __VA_ARGS__)
+#define LOGI(...) log_write("I:" __VA_ARGS__)
 
 #if 0
 #define LOGV(...) fprintf(stderr, "V:" __VA_ARGS__)
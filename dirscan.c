@@ -0,0 +1,201 @@
+/*
+ * Copyright (C) 2009 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "common.h"
+#include "dirscan.h"
+#include "roots.h"
+
+typedef struct {
+    char *path;             /* NULL if the slot is unused */
+    char *extension;
+    dev_t dev;
+    ino_t ino;
+    time_t mtime;
+    time_t ctime;
+    unsigned int generation;    /* get_mount_generation(path) when scanned */
+    int settled;            /* mtime is old enough to be trusted */
+    unsigned int last_used;
+    DirListing listing;
+    char *pool;             /* all the names, back to back */
+} DirCacheEntry;
+
+static DirCacheEntry cache[DIRSCAN_CACHE_SIZE];
+static unsigned int use_counter;
+
+static int same_string(const char *a, const char *b) {
+    if (a == NULL || b == NULL) return a == b;
+    return strcmp(a, b) == 0;
+}
+
+static void free_entry(DirCacheEntry *e) {
+    free(e->path);
+    free(e->extension);
+    free(e->listing.names);
+    free(e->pool);
+    memset(e, 0, sizeof(*e));
+}
+
+static int compare_names(const void *a, const void *b) {
+    const char *x = *(const char **) a;
+    const char *y = *(const char **) b;
+    int c = strcasecmp(x, y);
+    return c != 0 ? c : strcmp(x, y);
+}
+
+/* Read the directory in a single pass into e->pool and build the
+ * sorted name array over it.
+ */
+static int read_listing(DirCacheEntry *e, const char *path,
+                        const char *extension) {
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        LOGE("Couldn't open directory %s\n(%s)\n", path, strerror(errno));
+        return -1;
+    }
+
+    // Names go into one growing buffer, with their offsets alongside;
+    // the pointers can only be made once the buffer stops moving.
+    char *pool = NULL;
+    size_t pool_len = 0, pool_size = 0;
+    size_t *offsets = NULL;
+    int count = 0, offsets_size = 0;
+    int result = 0;
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        if (de->d_name[0] == '.') continue;
+        if (extension != NULL) {
+            const char *dot = strrchr(de->d_name, '.');
+            if (dot == NULL || strcasecmp(dot, extension) != 0) continue;
+        }
+
+        size_t len = strlen(de->d_name) + 1;
+        if (pool_len + len > pool_size) {
+            size_t size = pool_size * 2 + 1;
+            if (size < pool_len + len) size = pool_len + len;
+            char *p = (char *) realloc(pool, size);
+            if (p == NULL) {
+                result = -1;
+                break;
+            }
+            pool = p;
+            pool_size = size;
+        }
+        if (count == offsets_size) {
+            int size = offsets_size * 2 + 1;
+            size_t *o = (size_t *) realloc(offsets, size * sizeof(*o));
+            if (o == NULL) {
+                result = -1;
+                break;
+            }
+            offsets = o;
+            offsets_size = size;
+        }
+        memcpy(pool + pool_len, de->d_name, len);
+        offsets[count++] = pool_len;
+        pool_len += len;
+    }
+    closedir(dir);
+
+    char **names = NULL;
+    if (result == 0) {
+        names = (char **) malloc((count + 1) * sizeof(*names));
+        if (names == NULL) result = -1;
+    }
+    if (result != 0) {
+        LOGE("Out of memory reading %s\n", path);
+        free(pool);
+        free(offsets);
+        return -1;
+    }
+
+    int i;
+    for (i = 0; i < count; ++i) {
+        names[i] = pool + offsets[i];
+    }
+    names[count] = NULL;
+    free(offsets);
+    qsort(names, count, sizeof(*names), compare_names);
+
+    e->pool = pool;
+    e->listing.names = names;
+    e->listing.count = count;
+    return 0;
+}
+
+const DirListing *scan_directory(const char *path, const char *extension) {
+    struct stat st;
+    if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        LOGE("Couldn't open directory %s\n", path);
+        return NULL;
+    }
+
+    // Reuse the cached listing if this is the same directory (not
+    // just the same path -- the card may have been swapped), its root
+    // hasn't been mounted or unmounted since, and it hasn't changed.
+    // Otherwise scan into the matching slot, or else the least
+    // recently used one.
+    const unsigned int generation = get_mount_generation(path);
+    DirCacheEntry *slot = NULL;
+    int i;
+    for (i = 0; i < DIRSCAN_CACHE_SIZE; ++i) {
+        DirCacheEntry *e = &cache[i];
+        if (e->path != NULL && strcmp(e->path, path) == 0 &&
+            same_string(e->extension, extension)) {
+            if (e->settled && e->generation == generation &&
+                e->dev == st.st_dev && e->ino == st.st_ino &&
+                e->mtime == st.st_mtime && e->ctime == st.st_ctime) {
+                e->last_used = ++use_counter;
+                return &e->listing;
+            }
+            slot = e;
+            break;
+        }
+        if (slot == NULL || (slot->path != NULL &&
+            (e->path == NULL || e->last_used < slot->last_used))) {
+            slot = e;
+        }
+    }
+    free_entry(slot);
+
+    if (read_listing(slot, path, extension) != 0) return NULL;
+    slot->path = strdup(path);
+    slot->extension = extension != NULL ? strdup(extension) : NULL;
+    if (slot->path == NULL || (extension != NULL && slot->extension == NULL)) {
+        free_entry(slot);
+        return NULL;
+    }
+    slot->dev = st.st_dev;
+    slot->ino = st.st_ino;
+    slot->mtime = st.st_mtime;
+    slot->ctime = st.st_ctime;
+    slot->generation = generation;
+    // FAT keeps times to two seconds, so a file added just after a
+    // scan in the same tick wouldn't change the mtime.  Don't trust a
+    // directory modified that recently, or one with no times at all
+    // (the root of a FAT filesystem).
+    slot->settled = st.st_mtime != 0 && time(NULL) - st.st_mtime > 2;
+    slot->last_used = ++use_counter;
+    return &slot->listing;
+}
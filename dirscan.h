@@ -0,0 +1,43 @@
+/*
+ * Copyright (C) 2009 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _RECOVERY_DIRSCAN_H
+#define _RECOVERY_DIRSCAN_H
+
+typedef struct {
+    char **names;       /* sorted, NULL-terminated */
+    int count;
+} DirListing;
+
+/* List the entries of the directory at 'path' (a filesystem path, not
+ * a root path) whose names don't start with '.' and, if 'extension' is
+ * non-NULL, end with it (ignoring case).  Names are sorted.
+ *
+ * The listing is cached, and a later call for the same directory and
+ * extension returns it again without reading the directory as long as
+ * the directory hasn't been modified since and the root it's on hasn't
+ * been mounted or unmounted (see get_mount_generation()).  The listing
+ * belongs to the cache; it stays valid until the next call that scans
+ * the same directory, or until the directory falls out of the cache (it
+ * holds the last DIRSCAN_CACHE_SIZE directories).
+ *
+ * Returns NULL if the directory can't be read.
+ */
+const DirListing *scan_directory(const char *path, const char *extension);
+
+#define DIRSCAN_CACHE_SIZE 8
+
+#endif
@@ -19,6 +19,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "expr.h"
@@ -32,7 +34,13 @@ int BooleanString(const char* s) {
     return s[0] != '\0';
 }
 
+static char* ProfiledEvaluate(State* state, Expr* expr);
+static int profiling = 0;
+
 char* Evaluate(State* state, Expr* expr) {
+    if (profiling && expr->fn != Literal) {
+        return ProfiledEvaluate(state, expr);
+    }
     return expr->fn(expr->name, state, expr->argc, expr->argv);
 }
 
@@ -323,6 +331,7 @@ Expr* Build(Function fn, YYLTYPE loc, int count, ...) {
 static int fn_entries = 0;
 static int fn_size = 0;
 NamedFunction* fn_table = NULL;
+static Function default_fn = NULL;
 
 void RegisterFunction(const char* name, Function fn) {
     if (fn_entries >= fn_size) {
@@ -350,11 +359,15 @@ Function FindFunction(const char* name) {
     NamedFunction* nf = bsearch(&key, fn_table, fn_entries,
                                 sizeof(NamedFunction), fn_entry_compare);
     if (nf == NULL) {
-        return NULL;
+        return default_fn;
     }
     return nf->fn;
 }
 
+void SetDefaultFunction(Function fn) {
+    default_fn = fn;
+}
+
 void RegisterBuiltins() {
     RegisterFunction("ifelse", IfElseFn);
     RegisterFunction("abort", AbortFn);
@@ -430,3 +443,239 @@ char* ErrorAbort(State* state, char* format, ...) {
     state->errmsg = buffer;
     return NULL;
 }
+
+
+// -----------------------------------------------------------------
+//   profiling
+// -----------------------------------------------------------------
+
+typedef struct {
+    Expr* expr;
+    int calls;
+    long long wall_ns;
+    long long self_ns;
+    long long cpu_ns;
+    long long bytes;
+    // Inclusive times of just the calls not made inside another call
+    // to the same function, so per-function totals don't count nested
+    // calls (ifelse within ifelse) twice.
+    long long outer_wall_ns;
+    long long outer_cpu_ns;
+} ProfileSite;
+
+// Open-addressed on the Expr pointer; profile_size is a power of two.
+static ProfileSite* profile_sites = NULL;
+static int profile_size = 0;
+static int profile_count = 0;
+
+// Calls in progress.  Nesting deeper than this is charged to the
+// innermost recorded call rather than recorded separately.
+#define MAX_PROFILE_DEPTH 64
+static struct {
+    const char* name;
+    long long child_ns;
+    long long bytes;
+} profile_stack[MAX_PROFILE_DEPTH];
+static int profile_depth = 0;
+
+static long long NowNs(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static ProfileSite* FindProfileSite(Expr* expr) {
+    if (profile_count * 2 >= profile_size) {
+        int new_size = profile_size ? profile_size * 2 : 256;
+        ProfileSite* sites = calloc(new_size, sizeof(ProfileSite));
+        if (sites == NULL) return NULL;
+        int i;
+        for (i = 0; i < profile_size; ++i) {
+            if (profile_sites[i].expr == NULL) continue;
+            unsigned int h = ((uintptr_t)profile_sites[i].expr >> 4) &
+                             (new_size-1);
+            while (sites[h].expr != NULL) h = (h + 1) & (new_size-1);
+            sites[h] = profile_sites[i];
+        }
+        free(profile_sites);
+        profile_sites = sites;
+        profile_size = new_size;
+    }
+
+    unsigned int h = ((uintptr_t)expr >> 4) & (profile_size-1);
+    while (profile_sites[h].expr != NULL && profile_sites[h].expr != expr) {
+        h = (h + 1) & (profile_size-1);
+    }
+    if (profile_sites[h].expr == NULL) {
+        profile_sites[h].expr = expr;
+        ++profile_count;
+    }
+    return profile_sites + h;
+}
+
+static char* ProfiledEvaluate(State* state, Expr* expr) {
+    if (strcmp(expr->name, "(operator)") == 0 ||
+        profile_depth >= MAX_PROFILE_DEPTH) {
+        return expr->fn(expr->name, state, expr->argc, expr->argv);
+    }
+
+    int depth = profile_depth++;
+    profile_stack[depth].name = expr->name;
+    profile_stack[depth].child_ns = 0;
+    profile_stack[depth].bytes = 0;
+
+    long long wall = NowNs(CLOCK_MONOTONIC);
+    long long cpu = NowNs(CLOCK_PROCESS_CPUTIME_ID);
+    char* result = expr->fn(expr->name, state, expr->argc, expr->argv);
+    wall = NowNs(CLOCK_MONOTONIC) - wall;
+    cpu = NowNs(CLOCK_PROCESS_CPUTIME_ID) - cpu;
+
+    profile_depth = depth;
+    if (depth > 0) {
+        profile_stack[depth-1].child_ns += wall;
+    }
+
+    ProfileSite* site = FindProfileSite(expr);
+    if (site != NULL) {
+        ++site->calls;
+        site->wall_ns += wall;
+        site->self_ns += wall - profile_stack[depth].child_ns;
+        site->cpu_ns += cpu;
+        site->bytes += profile_stack[depth].bytes;
+
+        int outer;
+        for (outer = 0; outer < depth; ++outer) {
+            if (strcmp(profile_stack[outer].name, expr->name) == 0) break;
+        }
+        if (outer == depth) {
+            site->outer_wall_ns += wall;
+            site->outer_cpu_ns += cpu;
+        }
+    }
+    return result;
+}
+
+void EnableProfiling() {
+    profiling = 1;
+}
+
+int ProfilingEnabled() {
+    return profiling;
+}
+
+void ProfileAddBytes(long long bytes) {
+    if (profiling && profile_depth > 0) {
+        profile_stack[profile_depth-1].bytes += bytes;
+    }
+}
+
+static int profile_site_compare(const void* a, const void* b) {
+    long long wa = (*(const ProfileSite**)a)->wall_ns;
+    long long wb = (*(const ProfileSite**)b)->wall_ns;
+    return wa < wb ? 1 : (wa > wb ? -1 : 0);
+}
+
+// Return the 1-based line containing 'offset', given the offsets at
+// which each of 'count' lines start.
+static int LineOf(const int* line_starts, int count, int offset) {
+    int lo = 0, hi = count - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (line_starts[mid] <= offset) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return lo + 1;
+}
+
+void WriteProfile(FILE* f, const char* script) {
+    ProfileSite** sorted = malloc((profile_count ? profile_count : 1) *
+                                  sizeof(ProfileSite*));
+    if (sorted == NULL) return;
+    int i, n = 0;
+    for (i = 0; i < profile_size; ++i) {
+        if (profile_sites[i].expr != NULL) sorted[n++] = profile_sites + i;
+    }
+    qsort(sorted, n, sizeof(ProfileSite*), profile_site_compare);
+
+    int* line_starts = NULL;
+    int line_count = 0;
+    if (script != NULL) {
+        const char* p;
+        line_count = 1;
+        for (p = script; *p; ++p) {
+            if (*p == '\n') ++line_count;
+        }
+        line_starts = malloc(line_count * sizeof(int));
+        if (line_starts != NULL) {
+            line_count = 0;
+            line_starts[line_count++] = 0;
+            for (p = script; *p; ++p) {
+                if (*p == '\n') line_starts[line_count++] = p - script + 1;
+            }
+        }
+    }
+
+    // Totals per function, in the same order (slowest site first) to
+    // start with.  There are few enough distinct functions that a
+    // linear search is fine.  Wall and CPU time come from the outermost
+    // calls only (see ProfileSite), so a function's total never exceeds
+    // the time the script ran; self time and bytes are exclusive and
+    // simply add up.
+    ProfileSite* totals = malloc((n ? n : 1) * sizeof(ProfileSite));
+    ProfileSite** sorted_totals = malloc((n ? n : 1) * sizeof(ProfileSite*));
+    int total_count = 0;
+    if (totals != NULL && sorted_totals != NULL) {
+        for (i = 0; i < n; ++i) {
+            ProfileSite* s = sorted[i];
+            int j;
+            for (j = 0; j < total_count; ++j) {
+                if (strcmp(totals[j].expr->name, s->expr->name) == 0) break;
+            }
+            if (j == total_count) {
+                totals[j] = *s;
+                totals[j].wall_ns = s->outer_wall_ns;
+                totals[j].cpu_ns = s->outer_cpu_ns;
+                sorted_totals[j] = totals + j;
+                ++total_count;
+            } else {
+                totals[j].calls += s->calls;
+                totals[j].wall_ns += s->outer_wall_ns;
+                totals[j].self_ns += s->self_ns;
+                totals[j].cpu_ns += s->outer_cpu_ns;
+                totals[j].bytes += s->bytes;
+            }
+        }
+        qsort(sorted_totals, total_count, sizeof(ProfileSite*),
+              profile_site_compare);
+    }
+
+    // The same layout as amend's writeExecProfile(), so both can be
+    // read the same way.
+    fprintf(f, "# function calls wall_ms self_ms cpu_ms bytes name\n");
+    for (i = 0; i < total_count; ++i) {
+        ProfileSite* s = sorted_totals[i];
+        fprintf(f, "function %d %.3f %.3f %.3f %lld %s\n",
+                s->calls, s->wall_ns / 1e6, s->self_ns / 1e6, s->cpu_ns / 1e6,
+                s->bytes, s->expr->name);
+    }
+    free(totals);
+    free(sorted_totals);
+
+    fprintf(f, "# site calls wall_ms self_ms cpu_ms bytes "
+               "line start-end name\n");
+    for (i = 0; i < n; ++i) {
+        ProfileSite* s = sorted[i];
+        fprintf(f, "site %d %.3f %.3f %.3f %lld %d %d-%d %s\n",
+                s->calls, s->wall_ns / 1e6, s->self_ns / 1e6, s->cpu_ns / 1e6,
+                s->bytes,
+                line_starts ? LineOf(line_starts, line_count, s->expr->start)
+                            : 0,
+                s->expr->start, s->expr->end, s->expr->name);
+    }
+
+    free(line_starts);
+    free(sorted);
+}
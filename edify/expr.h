@@ -17,6 +17,8 @@
 #ifndef _EXPRESSION_H
 #define _EXPRESSION_H
 
+#include <stdio.h>
+
 #include "yydefs.h"
 
 #define MAX_STRING_LEN 1024
@@ -101,9 +103,15 @@ void RegisterBuiltins();
 void FinishRegistration();
 
 // Find the Function for a given name; return NULL if no such function
-// exists.
+// exists (and no default has been set).
 Function FindFunction(const char* name);
 
+// Make FindFunction() return 'fn' for names that haven't been
+// registered, so that scripts calling functions this program doesn't
+// implement still parse.  'fn' can tell which function was meant from
+// the name it is passed.  Pass NULL to go back to rejecting them.
+void SetDefaultFunction(Function fn);
+
 
 // --- convenience functions for use in functions ---
 
@@ -123,4 +131,28 @@ char** ReadVarArgs(State* state, int argc, Expr* argv[]);
 char* ErrorAbort(State* state, char* format, ...);
 
 
+// --- profiling ---
+
+// Once profiling is enabled, Evaluate() records for every function
+// call site how many times it ran and how much wall-clock and CPU time
+// it took (including the arguments it evaluated).  Literals and
+// operators are not recorded; their cost is charged to the enclosing
+// call.
+void EnableProfiling();
+int ProfilingEnabled();
+
+// Charge 'bytes' written to the function call currently running.
+// Does nothing unless profiling is enabled.
+void ProfileAddBytes(long long bytes);
+
+// Write one "function" line per function name and then one "site"
+// line per call site to 'f', most expensive first in each table, in
+// the layout amend's writeExecProfile() also uses.  A function's wall
+// and CPU time cover only its outermost calls, so calls nested inside
+// another call to the same function aren't counted twice.  'script' is the
+// source the tree was parsed from, used to turn offsets into line
+// numbers; it may be NULL.
+void WriteProfile(FILE* f, const char* script);
+
+
 #endif  // _EXPRESSION_H
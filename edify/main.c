@@ -17,12 +17,19 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "expr.h"
 #include "parser.h"
+#include "program.h"
 
 extern int yyparse(Expr** root, int* error_count);
 
+// Stands in for unregistered functions in test(): returns its name.
+char* NameFn(const char* name, State* state, int argc, Expr* argv[]) {
+    return strdup(name);
+}
+
 int expect(const char* expr_str, const char* expected, int* errors) {
     Expr* e;
     int error;
@@ -66,9 +73,130 @@ int expect(const char* expr_str, const char* expected, int* errors) {
     }
 
     free(result);
+
+    // Compiling the tree and instantiating it again must not change
+    // the result.
+    size_t size;
+    void* image = CompileProgram(e, &size);
+    Program program;
+    if (image == NULL || LoadProgram(image, size, &program) != 0) {
+        fprintf(stderr, "error compiling \"%s\"\n", expr_str);
+        ++*errors;
+        free(image);
+        return 0;
+    }
+    char* errmsg = NULL;
+    Expr* compiled = InstantiateProgram(&program, &errmsg);
+    if (compiled == NULL) {
+        fprintf(stderr, "error instantiating \"%s\": %s\n", expr_str,
+                errmsg == NULL ? "(NULL)" : errmsg);
+        free(errmsg);
+        ++*errors;
+        free(image);
+        return 0;
+    }
+    state.errmsg = NULL;
+    result = Evaluate(&state, compiled);
+    free(state.errmsg);
+    if (result == NULL || strcmp(result, expected) != 0) {
+        fprintf(stderr, "evaluating compiled \"%s\": expected \"%s\", "
+                "got \"%s\"\n", expr_str, expected,
+                result == NULL ? "(NULL)" : result);
+        ++*errors;
+        free(result);
+        free(compiled);
+        free(image);
+        return 0;
+    }
+    free(result);
+    free(compiled);
+    free(image);
     return 1;
 }
 
+// Stands in for a slow updater function in test_profile(): sleeps long
+// enough that its time is well above the clock's resolution.
+char* NapFn(const char* name, State* state, int argc, Expr* argv[]) {
+    char** args = ReadVarArgs(state, argc, argv);
+    if (args == NULL) return NULL;
+    int i;
+    for (i = 0; i < argc; ++i) {
+        free(args[i]);
+    }
+    free(args);
+    usleep(2000);
+    return strdup("t");
+}
+
+// Profile a script that calls ifelse() inside ifelse(), and check that
+// the per-function totals count the nested call's time only once: the
+// function's wall time must be that of the outermost call site.
+void test_profile(int* errors) {
+    const char* script = "ifelse(ifelse(nap(), nap(), x), nap(), y)";
+
+    printf(".");
+    SetDefaultFunction(NapFn);
+    EnableProfiling();
+
+    Expr* e;
+    int error_count = 0;
+    yy_scan_string(script);
+    if (yyparse(&e, &error_count) != 0 || error_count > 0) {
+        fprintf(stderr, "error parsing \"%s\"\n", script);
+        ++*errors;
+        return;
+    }
+    State state;
+    state.cookie = NULL;
+    state.script = script;
+    state.errmsg = NULL;
+    free(Evaluate(&state, e));
+    free(state.errmsg);
+    SetDefaultFunction(NULL);
+
+    FILE* f = tmpfile();
+    if (f == NULL) {
+        fprintf(stderr, "profile: can't create a temporary file\n");
+        ++*errors;
+        return;
+    }
+    WriteProfile(f, script);
+    rewind(f);
+
+    // Sites come out slowest first, so the first ifelse site is the
+    // outermost call.
+    int ifelse_calls = -1, nap_calls = -1;
+    char ifelse_wall[32] = "", outer_wall[32] = "";
+    char line[256];
+    while (fgets(line, sizeof(line), f) != NULL) {
+        int calls;
+        char wall[32], name[64];
+        if (sscanf(line, "function %d %31s %*s %*s %*s %63s",
+                   &calls, wall, name) == 3) {
+            if (strcmp(name, "ifelse") == 0) {
+                ifelse_calls = calls;
+                strcpy(ifelse_wall, wall);
+            } else if (strcmp(name, "nap") == 0) {
+                nap_calls = calls;
+            }
+        } else if (sscanf(line, "site %d %31s %*s %*s %*s %*s %*s %63s",
+                          &calls, wall, name) == 3) {
+            if (strcmp(name, "ifelse") == 0 && outer_wall[0] == '\0') {
+                strcpy(outer_wall, wall);
+            }
+        }
+    }
+    fclose(f);
+
+    if (ifelse_calls != 2 || nap_calls != 3 ||
+        strcmp(ifelse_wall, outer_wall) != 0) {
+        fprintf(stderr, "profile: expected 2 ifelse calls taking %s ms "
+                "and 3 nap calls, got %d taking %s ms and %d\n",
+                outer_wall, ifelse_calls, ifelse_wall, nap_calls);
+        ++*errors;
+    }
+}
+
 int test() {
     int errors = 0;
 
@@ -153,6 +281,15 @@ int test() {
     expect("greater_than_int(x, 3)", "", &errors);
     expect("greater_than_int(3, x)", "", &errors);
 
+    // unregistered functions, with a default set
+    SetDefaultFunction(NameFn);
+    expect("frob(a, b)", "frob", &errors);
+    expect("concat(frob(), twiddle())", "frobtwiddle", &errors);
+    SetDefaultFunction(NULL);
+
+    // Last, since it leaves profiling on.
+    test_profile(&errors);
+
     printf("\n");
 
     return errors;
@@ -172,6 +309,55 @@ void ExprDump(int depth, Expr* n, char* script) {
     }
 }
 
+// In --plan mode every function the host doesn't implement (i.e.,
+// everything the updater provides) lands here.  Nothing is done; the
+// call is printed with its evaluated arguments and counted, and
+// treated as successful so the rest of the script runs.
+
+typedef struct {
+    const char* name;
+    int calls;
+} PlanCount;
+
+static PlanCount* plan_counts = NULL;
+static int plan_count_entries = 0;
+static int plan_count_size = 0;
+
+char* PlanFn(const char* name, State* state, int argc, Expr* argv[]) {
+    char** args = ReadVarArgs(state, argc, argv);
+    if (args == NULL) return NULL;
+
+    printf("  %s(", name);
+    int i;
+    for (i = 0; i < argc; ++i) {
+        printf("%s\"%s\"", i > 0 ? ", " : "", args[i]);
+        free(args[i]);
+    }
+    printf(")\n");
+    free(args);
+
+    for (i = 0; i < plan_count_entries; ++i) {
+        if (strcmp(plan_counts[i].name, name) == 0) break;
+    }
+    if (i == plan_count_entries) {
+        if (plan_count_entries >= plan_count_size) {
+            int size = plan_count_size*2 + 1;
+            PlanCount* counts = realloc(plan_counts, size * sizeof(PlanCount));
+            if (counts == NULL) {
+                return ErrorAbort(state, "%s: out of memory", name);
+            }
+            plan_counts = counts;
+            plan_count_size = size;
+        }
+        plan_counts[i].name = name;
+        plan_counts[i].calls = 0;
+        ++plan_count_entries;
+    }
+    ++plan_counts[i].calls;
+
+    return strdup("t");
+}
+
 int main(int argc, char** argv) {
     RegisterBuiltins();
     FinishRegistration();
@@ -180,7 +366,18 @@ int main(int argc, char** argv) {
         return test() != 0;
     }
 
+    // "edify --plan <script>" dry-runs an updater-script on the host.
+    int plan = argc == 3 && strcmp(argv[1], "--plan") == 0;
+    if (plan) {
+        SetDefaultFunction(PlanFn);
+        ++argv;
+    }
+
     FILE* f = fopen(argv[1], "r");
+    if (f == NULL) {
+        fprintf(stderr, "can't open %s\n", argv[1]);
+        return 1;
+    }
     char buffer[8192];
     int size = fread(buffer, 1, 8191, f);
     fclose(f);
@@ -193,7 +390,7 @@ int main(int argc, char** argv) {
     printf("parse returned %d; %d errors encountered\n", error, error_count);
     if (error == 0 || error_count > 0) {
 
-        ExprDump(0, root, buffer);
+        if (!plan) ExprDump(0, root, buffer);
 
         State state;
         state.cookie = NULL;
@@ -208,6 +405,13 @@ int main(int argc, char** argv) {
         } else {
             printf("result is [%s]\n", result);
         }
+
+        if (plan) {
+            int i;
+            for (i = 0; i < plan_count_entries; ++i) {
+                printf("%6d  %s\n", plan_counts[i].calls, plan_counts[i].name);
+            }
+        }
     }
     return 0;
 }
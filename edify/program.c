@@ -0,0 +1,390 @@
+/*
+ * Copyright (C) 2009 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "expr.h"
+#include "program.h"
+
+// The syntactic-sugar operators are built by the parser with the
+// name "(operator)", so they can't be found by name at load time.
+// Refer to them by their position in this table instead; new entries
+// must only ever be appended.
+static const struct {
+    const char* name;
+    Function fn;
+} kOperators[] = {
+    { ";",  SequenceFn },
+    { "+",  ConcatFn },
+    { "==", EqualityFn },
+    { "!=", InequalityFn },
+    { "&&", LogicalAndFn },
+    { "||", LogicalOrFn },
+    { "!",  LogicalNotFn },
+    { "if", IfElseFn },
+};
+#define NUM_OPERATORS (sizeof(kOperators) / sizeof(kOperators[0]))
+
+static const char* kOperatorName = "(operator)";
+
+// -----------------------------------------------------------------
+//   compiling
+// -----------------------------------------------------------------
+
+typedef struct {
+    ProgramNode* nodes;
+    int node_count;
+    uint32_t* args;
+    int arg_count;
+
+    uint32_t* fns;
+    int fn_count;
+    int fn_size;
+
+    uint32_t* consts;
+    int const_count;
+    int const_size;
+
+    char* blob;
+    int blob_size;
+    int blob_alloc;
+
+    // Open-addressed table of constant indices (plus one; zero is
+    // empty), used to store each distinct string only once.
+    int* const_hash;
+    int hash_size;
+} Builder;
+
+static void CountNodes(Expr* e, int* nodes, int* args) {
+    ++*nodes;
+    *args += e->argc;
+    int i;
+    for (i = 0; i < e->argc; ++i) {
+        CountNodes(e->argv[i], nodes, args);
+    }
+}
+
+static unsigned int HashString(const char* s) {
+    unsigned int h = 2166136261u;
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static int GrowConstHash(Builder* b) {
+    int new_size = b->hash_size ? b->hash_size * 2 : 256;
+    int* table = calloc(new_size, sizeof(int));
+    if (table == NULL) return -1;
+    int i;
+    for (i = 0; i < b->const_count; ++i) {
+        unsigned int h = HashString(b->blob + b->consts[i]) & (new_size-1);
+        while (table[h] != 0) h = (h + 1) & (new_size-1);
+        table[h] = i + 1;
+    }
+    free(b->const_hash);
+    b->const_hash = table;
+    b->hash_size = new_size;
+    return 0;
+}
+
+// Return the index of 's' in the constant pool, adding it if
+// necessary, or -1 on allocation failure.
+static int AddConstant(Builder* b, const char* s) {
+    if (b->const_count * 2 >= b->hash_size) {
+        if (GrowConstHash(b) < 0) return -1;
+    }
+    unsigned int h = HashString(s) & (b->hash_size-1);
+    while (b->const_hash[h] != 0) {
+        int i = b->const_hash[h] - 1;
+        if (strcmp(b->blob + b->consts[i], s) == 0) return i;
+        h = (h + 1) & (b->hash_size-1);
+    }
+
+    int len = strlen(s) + 1;
+    if (b->blob_size + len > b->blob_alloc) {
+        int new_alloc = b->blob_alloc * 2 + len;
+        char* blob = realloc(b->blob, new_alloc);
+        if (blob == NULL) return -1;
+        b->blob = blob;
+        b->blob_alloc = new_alloc;
+    }
+    if (b->const_count >= b->const_size) {
+        int new_size = b->const_size * 2 + 16;
+        uint32_t* consts = realloc(b->consts, new_size * sizeof(uint32_t));
+        if (consts == NULL) return -1;
+        b->consts = consts;
+        b->const_size = new_size;
+    }
+    memcpy(b->blob + b->blob_size, s, len);
+    b->consts[b->const_count] = b->blob_size;
+    b->blob_size += len;
+    b->const_hash[h] = b->const_count + 1;
+    return b->const_count++;
+}
+
+// Return the index of the function named 's' in the function table,
+// adding it if necessary, or -1 on allocation failure.
+static int AddFunction(Builder* b, const char* name) {
+    int c = AddConstant(b, name);
+    if (c < 0) return -1;
+    int i;
+    for (i = 0; i < b->fn_count; ++i) {
+        if (b->fns[i] == (uint32_t)c) return i;
+    }
+    if (b->fn_count >= b->fn_size) {
+        int new_size = b->fn_size * 2 + 16;
+        uint32_t* fns = realloc(b->fns, new_size * sizeof(uint32_t));
+        if (fns == NULL) return -1;
+        b->fns = fns;
+        b->fn_size = new_size;
+    }
+    b->fns[b->fn_count] = c;
+    return b->fn_count++;
+}
+
+// Emit 'e' and its arguments in preorder, so that every argument has
+// a larger index than the node that uses it.  Returns the node's
+// index, or -1 on error.
+static int EmitNode(Builder* b, Expr* e) {
+    int index = b->node_count++;
+    ProgramNode* n = b->nodes + index;
+    n->argc = e->argc;
+    n->start = e->start;
+    n->end = e->end;
+
+    int value;
+    if (e->fn == Literal) {
+        n->kind = NODE_LITERAL;
+        value = AddConstant(b, e->name);
+    } else if (strcmp(e->name, kOperatorName) == 0) {
+        n->kind = NODE_OPERATOR;
+        for (value = 0; value < (int)NUM_OPERATORS; ++value) {
+            if (kOperators[value].fn == e->fn) break;
+        }
+        if (value == (int)NUM_OPERATORS) {
+            fprintf(stderr, "can't compile unknown operator at %d-%d\n",
+                    e->start, e->end);
+            return -1;
+        }
+    } else {
+        n->kind = NODE_CALL;
+        value = AddFunction(b, e->name);
+    }
+    if (value < 0) return -1;
+    n->value = value;
+
+    n->args = b->arg_count;
+    b->arg_count += e->argc;
+
+    int i;
+    for (i = 0; i < e->argc; ++i) {
+        int child = EmitNode(b, e->argv[i]);
+        if (child < 0) return -1;
+        b->args[n->args + i] = child;
+    }
+    return index;
+}
+
+void* CompileProgram(Expr* root, size_t* size) {
+    int node_total = 0, arg_total = 0;
+    CountNodes(root, &node_total, &arg_total);
+
+    Builder b;
+    memset(&b, 0, sizeof(b));
+    b.nodes = malloc(node_total * sizeof(ProgramNode));
+    b.args = malloc((arg_total ? arg_total : 1) * sizeof(uint32_t));
+
+    void* image = NULL;
+    if (b.nodes == NULL || b.args == NULL) goto done;
+    if (EmitNode(&b, root) != 0) goto done;
+
+    ProgramHeader h;
+    h.magic = PROGRAM_MAGIC;
+    h.version = PROGRAM_VERSION;
+    h.node_count = b.node_count;
+    h.arg_count = b.arg_count;
+    h.fn_count = b.fn_count;
+    h.const_count = b.const_count;
+    h.blob_size = b.blob_size;
+    h.root = 0;
+
+    size_t total = sizeof(h) +
+        b.node_count * sizeof(ProgramNode) +
+        (b.arg_count + b.fn_count + b.const_count) * sizeof(uint32_t) +
+        b.blob_size;
+    image = malloc(total);
+    if (image == NULL) goto done;
+
+    char* p = image;
+    memcpy(p, &h, sizeof(h));
+    p += sizeof(h);
+    memcpy(p, b.nodes, b.node_count * sizeof(ProgramNode));
+    p += b.node_count * sizeof(ProgramNode);
+    memcpy(p, b.args, b.arg_count * sizeof(uint32_t));
+    p += b.arg_count * sizeof(uint32_t);
+    memcpy(p, b.fns, b.fn_count * sizeof(uint32_t));
+    p += b.fn_count * sizeof(uint32_t);
+    memcpy(p, b.consts, b.const_count * sizeof(uint32_t));
+    p += b.const_count * sizeof(uint32_t);
+    memcpy(p, b.blob, b.blob_size);
+    *size = total;
+
+  done:
+    free(b.nodes);
+    free(b.args);
+    free(b.fns);
+    free(b.consts);
+    free(b.blob);
+    free(b.const_hash);
+    return image;
+}
+
+// -----------------------------------------------------------------
+//   loading
+// -----------------------------------------------------------------
+
+int LoadProgram(const void* data, size_t size, Program* program) {
+    const ProgramHeader* h = data;
+    if (size < sizeof(*h) || ((uintptr_t)data & 3) != 0) return -1;
+    if (h->magic != PROGRAM_MAGIC || h->version != PROGRAM_VERSION) return -1;
+    if (h->node_count == 0 || h->root != 0) return -1;
+
+    // Do the size arithmetic in 64 bits so a corrupt header can't
+    // wrap it around.
+    uint64_t need = sizeof(*h) +
+        (uint64_t)h->node_count * sizeof(ProgramNode) +
+        ((uint64_t)h->arg_count + h->fn_count + h->const_count) *
+            sizeof(uint32_t) +
+        h->blob_size;
+    if (need != size) return -1;
+
+    const char* p = (const char*)data + sizeof(*h);
+    program->header = h;
+    program->nodes = (const ProgramNode*)p;
+    p += h->node_count * sizeof(ProgramNode);
+    program->args = (const uint32_t*)p;
+    p += h->arg_count * sizeof(uint32_t);
+    program->fns = (const uint32_t*)p;
+    p += h->fn_count * sizeof(uint32_t);
+    program->consts = (const uint32_t*)p;
+    p += h->const_count * sizeof(uint32_t);
+    program->blob = p;
+
+    // Every string must be NUL-terminated inside the blob.
+    if (h->const_count > 0 &&
+        (h->blob_size == 0 || program->blob[h->blob_size-1] != '\0')) {
+        return -1;
+    }
+    uint32_t i;
+    for (i = 0; i < h->const_count; ++i) {
+        if (program->consts[i] >= h->blob_size) return -1;
+    }
+    for (i = 0; i < h->fn_count; ++i) {
+        if (program->fns[i] >= h->const_count) return -1;
+    }
+
+    // Arguments must come after their parent, which rules out cycles.
+    for (i = 0; i < h->node_count; ++i) {
+        const ProgramNode* n = program->nodes + i;
+        switch (n->kind) {
+            case NODE_LITERAL:
+                if (n->value >= h->const_count) return -1;
+                break;
+            case NODE_OPERATOR:
+                if (n->value >= NUM_OPERATORS) return -1;
+                break;
+            case NODE_CALL:
+                if (n->value >= h->fn_count) return -1;
+                break;
+            default:
+                return -1;
+        }
+        if ((uint64_t)n->args + n->argc > h->arg_count) return -1;
+        int j;
+        for (j = 0; j < n->argc; ++j) {
+            uint32_t child = program->args[n->args + j];
+            if (child <= i || child >= h->node_count) return -1;
+        }
+    }
+    return 0;
+}
+
+const char* ProgramConstant(const Program* program, uint32_t i) {
+    return program->blob + program->consts[i];
+}
+
+Expr* InstantiateProgram(const Program* program, char** errmsg) {
+    const ProgramHeader* h = program->header;
+
+    Function* fns = malloc((h->fn_count ? h->fn_count : 1) * sizeof(Function));
+    if (fns == NULL) return NULL;
+    uint32_t i;
+    for (i = 0; i < h->fn_count; ++i) {
+        const char* name = ProgramConstant(program, program->fns[i]);
+        fns[i] = FindFunction(name);
+        if (fns[i] == NULL) {
+            char buffer[256];
+            snprintf(buffer, sizeof(buffer), "unknown function \"%s\"", name);
+            *errmsg = strdup(buffer);
+            free(fns);
+            return NULL;
+        }
+    }
+
+    Expr* exprs = malloc(h->node_count * sizeof(Expr) +
+                         h->arg_count * sizeof(Expr*));
+    if (exprs == NULL) {
+        free(fns);
+        return NULL;
+    }
+    Expr** argv = (Expr**)(exprs + h->node_count);
+
+    for (i = 0; i < h->arg_count; ++i) {
+        argv[i] = exprs + program->args[i];
+    }
+    for (i = 0; i < h->node_count; ++i) {
+        const ProgramNode* n = program->nodes + i;
+        Expr* e = exprs + i;
+        switch (n->kind) {
+            case NODE_LITERAL:
+                e->fn = Literal;
+                e->name = (char*)ProgramConstant(program, n->value);
+                break;
+            case NODE_OPERATOR:
+                e->fn = kOperators[n->value].fn;
+                e->name = (char*)kOperatorName;
+                break;
+            case NODE_CALL:
+                e->fn = fns[n->value];
+                e->name = (char*)ProgramConstant(program,
+                                                 program->fns[n->value]);
+                break;
+        }
+        e->argc = n->argc;
+        e->argv = n->argc ? argv + n->args : NULL;
+        e->start = n->start;
+        e->end = n->end;
+    }
+
+    free(fns);
+    // The root is always node 0, so it is also the start of the
+    // allocation.
+    return exprs;
+}
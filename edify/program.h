@@ -0,0 +1,109 @@
+/*
+ * Copyright (C) 2009 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _EDIFY_PROGRAM_H
+#define _EDIFY_PROGRAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "expr.h"
+
+// A compiled edify program is a flat, pointer-free image of a parsed
+// script: a table of nodes that refer to each other by index, a
+// constant pool holding every distinct literal and function name
+// once, and a table of the functions the script calls.  Because it
+// contains no pointers it can be written to disk and mapped back in
+// later without going through the lexer and parser again.
+//
+// It is a storage format, not an interpreter.  InstantiateProgram()
+// turns an image back into an ordinary Expr tree, and Evaluate() runs
+// that exactly as it runs a freshly parsed one; edify functions take
+// their arguments unevaluated, as Exprs, so they couldn't be run any
+// other way without rewriting them all.  What it saves is the lexer,
+// the parser and a FindFunction() per call site, which is what the
+// updater's cache of compiled scripts is for.  Evaluation itself is
+// no faster, and amend scripts aren't compiled into it at all.
+//
+// Layout (all fields in host byte order):
+//
+//    ProgramHeader
+//    ProgramNode    nodes[node_count]
+//    uint32_t       args[arg_count]      node index of each argument
+//    uint32_t       fns[fn_count]        constant index of each name
+//    uint32_t       consts[const_count]  offset of each string in blob
+//    char           blob[blob_size]      NUL-terminated strings
+
+#define PROGRAM_MAGIC    0x59464445   // "EDFY"
+#define PROGRAM_VERSION  1
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t node_count;
+    uint32_t arg_count;
+    uint32_t fn_count;
+    uint32_t const_count;
+    uint32_t blob_size;
+    uint32_t root;    // always 0; nodes are stored in preorder
+} ProgramHeader;
+
+enum {
+    NODE_LITERAL,     // value is a constant index
+    NODE_OPERATOR,    // value is an index into the builtin operator table
+    NODE_CALL,        // value is an index into fns[]
+};
+
+typedef struct {
+    uint16_t kind;
+    uint16_t argc;
+    uint32_t value;
+    uint32_t args;    // index of the first argument in args[]
+    int32_t start, end;
+} ProgramNode;
+
+typedef struct {
+    const ProgramHeader* header;
+    const ProgramNode* nodes;
+    const uint32_t* args;
+    const uint32_t* fns;
+    const uint32_t* consts;
+    const char* blob;
+} Program;
+
+// Compile the tree rooted at 'root' into a program image.  Returns a
+// malloc'd buffer and sets *size to its length, or returns NULL on
+// error (e.g., if the tree uses a Function this file doesn't know).
+void* CompileProgram(Expr* root, size_t* size);
+
+// Check that 'data' holds a well-formed program image and fill in
+// 'program' with pointers into it.  No copy is made; 'data' must
+// outlive 'program'.  Returns 0 on success, -1 if the image is
+// truncated, from a different version, or internally inconsistent.
+int LoadProgram(const void* data, size_t size, Program* program);
+
+// Build an Expr tree from a loaded program, resolving each function
+// name with FindFunction() once rather than once per call site.  The
+// whole tree is a single allocation: free() the returned root when
+// done.  Strings in the tree point into the program's data, which
+// must outlive it.  Returns NULL (and sets *errmsg to a malloc'd
+// message) if the program calls a function that isn't registered.
+Expr* InstantiateProgram(const Program* program, char** errmsg);
+
+// Return the i'th string in the program's constant pool.
+const char* ProgramConstant(const Program* program, uint32_t i);
+
+#endif  // _EDIFY_PROGRAM_H
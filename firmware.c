@@ -17,31 +17,247 @@
 #include "bootloader.h"
 #include "common.h"
 #include "firmware.h"
+#include "logger.h"
+#include "mincrypt/sha.h"
 #include "roots.h"
 
 #include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/reboot.h>
+#include <sys/stat.h>
 
 static const char *update_type = NULL;
-static const char *update_data = NULL;
+static char *update_path = NULL;   // the image file, or the package holding it
+static char *update_entry = NULL;  // the image's name in the package, if any
 static int update_length = 0;
+static uint8_t update_digest[SHA_DIGEST_SIZE];  // as verified at install
+static struct stat update_stat;     // of update_path, to notice it changing
+static char *update_data = NULL;   // the image itself, if kept in RAM
 
-int remember_firmware_update(const char *type, const char *data, int length) {
-    if (update_type != NULL || update_data != NULL) {
+// Returns true if the file is on the (mounted) cache partition.
+static int is_on_cache(const struct stat *st) {
+    char cache[PATH_MAX];
+    struct stat cache_st;
+    return is_root_path_mounted("CACHE:") > 0 &&
+           translate_root_path("CACHE:", cache, sizeof(cache)) != NULL &&
+           stat(cache, &cache_st) == 0 &&
+           cache_st.st_dev == st->st_dev;
+}
+
+// Read the whole file, calling fn with each piece.  Returns 0 on success.
+static int read_file(FILE *f, int (*fn)(const char *, int, void *),
+        void *cookie) {
+    char buf[32768];
+    size_t len;
+    rewind(f);
+    while ((len = fread(buf, 1, sizeof(buf), f)) > 0) {
+        if (fn(buf, len, cookie)) return -1;
+    }
+    return ferror(f) ? -1 : 0;
+}
+
+static int sha_fn(const char *data, int length, void *cookie) {
+    SHA_update((SHA_CTX *) cookie, data, length);
+    return 0;
+}
+
+static bool sha_zip_fn(const unsigned char *data, int length, void *cookie) {
+    return sha_fn((const char *) data, length, cookie) == 0;
+}
+
+struct copy_context {
+    char *data;
+    int done, total;
+};
+
+static int copy_fn(const char *data, int length, void *cookie) {
+    struct copy_context *copy = (struct copy_context *) cookie;
+    if (length > copy->total - copy->done) return -1;
+    memcpy(copy->data + copy->done, data, length);
+    copy->done += length;
+    return 0;
+}
+
+int remember_firmware_update(const char *type, const char *path,
+        const ZipArchive *package, const ZipEntry *entry) {
+    if (update_type != NULL) {
         LOGE("Multiple firmware images\n");
         return -1;
     }
 
+    struct stat st;
+    if (stat(path, &st) < 0) {
+        LOGE("Can't stat %s\n(%s)\n", path, strerror(errno));
+        return -1;
+    }
+
+    /* The image is read again when it's installed, by which time the
+     * sdcard may have been exported over USB and changed.  Take its digest
+     * now, from the package that was just verified, to check it against.
+     */
+    FILE *f = NULL;
+    int length;
+    SHA_CTX sha;
+    SHA_init(&sha);
+    if (entry != NULL) {
+        length = mzGetZipEntryUncompLen(entry);
+        if (!mzProcessZipEntryContents(package, entry, sha_zip_fn, &sha)) {
+            LOGE("Can't read %s image\n", type);
+            return -1;
+        }
+    } else {
+        f = fopen(path, "rb");
+        if (f == NULL) {
+            LOGE("Can't open %s\n(%s)\n", path, strerror(errno));
+            return -1;
+        }
+        length = st.st_size;
+        if (read_file(f, sha_fn, &sha)) {
+            LOGE("Can't read %s\n(%s)\n", path, strerror(errno));
+            fclose(f);
+            return -1;
+        }
+    }
+
+    /* Installing the image wipes the cache partition, so it can't be
+     * read from there at that point; keep a copy now instead.
+     */
+    char *data = NULL;
+    if (is_on_cache(&st)) {
+        LOGI("Loading %s image from cache into memory\n", type);
+        data = malloc(length);
+        bool ok = data != NULL;
+        if (ok && entry != NULL) {
+            ok = mzReadZipEntry(package, entry, data, length);
+        } else if (ok) {
+            struct copy_context copy = { data, 0, length };
+            ok = read_file(f, copy_fn, &copy) == 0 && copy.done == length;
+        }
+        if (!ok) {
+            LOGE("Can't load %s image\n", type);
+            free(data);
+            if (f != NULL) fclose(f);
+            return -1;
+        }
+    }
+    if (f != NULL) fclose(f);
+
+    update_path = strdup(path);
+    update_entry = entry != NULL ?
+            strndup(entry->fileName, entry->fileNameLen) : NULL;
+    if (update_path == NULL || (entry != NULL && update_entry == NULL)) {
+        LOGE("Can't store %s image\n", type);
+        free(update_path);
+        free(update_entry);
+        free(data);
+        update_path = update_entry = NULL;
+        return -1;
+    }
+
     update_type = type;
-    update_data = data;
     update_length = length;
+    memcpy(update_digest, SHA_final(&sha), SHA_DIGEST_SIZE);
+    update_stat = st;
+    update_data = data;
     return 0;
 }
 
 // Return true if there is a firmware update pending.
 int firmware_update_pending() {
-  return update_data != NULL && update_length > 0;
+  return update_type != NULL && update_length > 0;
+}
+
+/* Where the image comes from while it is being written.  Everything is
+ * opened, and checked against what was remembered, before the cache
+ * partition is touched.
+ */
+struct update_source {
+    FILE *file;
+    ZipArchive zip;
+    const ZipEntry *entry;
+    update_write_fn write;
+    void *write_cookie;
+    SHA_CTX sha;
+};
+
+static int open_update_source(struct update_source *source) {
+    memset(source, 0, sizeof(*source));
+    if (update_data != NULL) return 0;
+
+    struct stat st;
+    if (stat(update_path, &st) < 0 ||
+        st.st_size != update_stat.st_size ||
+        st.st_mtime != update_stat.st_mtime) {
+        LOGE("%s has changed\n", update_path);
+        return -1;
+    }
+
+    if (update_entry != NULL) {
+        int err = mzOpenZipArchive(update_path, &source->zip);
+        if (err != 0) {
+            LOGE("Can't open %s\n(%s)\n", update_path,
+                 err != -1 ? strerror(err) : "bad");
+            return -1;
+        }
+        source->entry = mzFindZipEntry(&source->zip, update_entry);
+        if (source->entry == NULL ||
+            mzGetZipEntryUncompLen(source->entry) != update_length) {
+            LOGE("Can't find %s in %s\n", update_entry, update_path);
+            mzCloseZipArchive(&source->zip);
+            return -1;
+        }
+    } else {
+        source->file = fopen(update_path, "rb");
+        if (source->file == NULL) {
+            LOGE("Can't open %s\n(%s)\n", update_path, strerror(errno));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void close_update_source(struct update_source *source) {
+    if (source->entry != NULL) mzCloseZipArchive(&source->zip);
+    if (source->file != NULL) fclose(source->file);
+}
+
+static int checked_write_fn(const char *data, int length, void *cookie) {
+    struct update_source *source = (struct update_source *) cookie;
+    SHA_update(&source->sha, data, length);
+    return source->write(data, length, source->write_cookie);
+}
+
+static bool zip_write_fn(const unsigned char *data, int length, void *cookie) {
+    return checked_write_fn((const char *) data, length, cookie) == 0;
+}
+
+// An update_source_fn: copies the image to the cache partition.
+static int write_update_source(update_write_fn write, void *write_cookie,
+        void *cookie) {
+    struct update_source *source = (struct update_source *) cookie;
+    if (update_data != NULL) {
+        return write(update_data, update_length, write_cookie);
+    }
+
+    source->write = write;
+    source->write_cookie = write_cookie;
+    SHA_init(&source->sha);
+    if (source->entry != NULL) {
+        if (!mzProcessZipEntryContents(&source->zip, source->entry,
+                zip_write_fn, source)) return -1;
+    } else {
+        if (read_file(source->file, checked_write_fn, source)) return -1;
+    }
+
+    // The header isn't written yet, so failing here disables the update.
+    if (memcmp(SHA_final(&source->sha), update_digest, SHA_DIGEST_SIZE) != 0) {
+        LOGE("%s image has changed since it was verified\n", update_type);
+        return -1;
+    }
+    return 0;
 }
 
 /* Bootloader / Recovery Flow
@@ -77,7 +293,10 @@ int firmware_update_pending() {
  */
 
 int maybe_install_firmware_update(const char *send_intent) {
-    if (update_data == NULL || update_length == 0) return 0;
+    if (!firmware_update_pending()) return 0;
+
+    struct update_source source;
+    if (open_update_source(&source)) return -1;
 
     /* We destroy the cache partition to pass the update image to the
      * bootloader, so all we can really do afterwards is wipe cache and reboot.
@@ -93,7 +312,10 @@ int maybe_install_firmware_update(const char *send_intent) {
         strlcat(boot.recovery, send_intent, sizeof(boot.recovery));
         strlcat(boot.recovery, "\n", sizeof(boot.recovery));
     }
-    if (set_bootloader_message(&boot)) return -1;
+    if (set_bootloader_message(&boot)) {
+        close_update_source(&source);
+        return -1;
+    }
 
     int width = 0, height = 0, bpp = 0;
     char *busy_image = ui_copy_image(
@@ -102,9 +324,11 @@ int maybe_install_firmware_update(const char *send_intent) {
         BACKGROUND_ICON_FIRMWARE_ERROR, &width, &height, &bpp);
 
     ui_print("Writing %s image...\n", update_type);
-    if (write_update_for_bootloader(
-            update_data, update_length,
-            width, height, bpp, busy_image, fail_image)) {
+    int result = write_update_for_bootloader(
+            write_update_source, &source, update_length,
+            width, height, bpp, busy_image, fail_image);
+    close_update_source(&source);
+    if (result) {
         LOGE("Can't write %s image\n(%s)\n", update_type, strerror(errno));
         format_root_device("CACHE:");  // Attempt to clean cache up, at least.
         return -1;
@@ -123,6 +347,7 @@ int maybe_install_firmware_update(const char *send_intent) {
         return -1;
     }
 
+    log_sync();
     reboot(RB_AUTOBOOT);
 
     // Can't reboot?  WTF?
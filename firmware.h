@@ -17,11 +17,19 @@
 #ifndef _RECOVERY_FIRMWARE_H
 #define _RECOVERY_FIRMWARE_H
 
+#include "minzip/Zip.h"
+
 /* Save a radio or bootloader update image for later installation.
- * The type should be one of "hboot" or "radio".
- * Takes ownership of type and data.  Returns nonzero on error.
+ * The type should be one of "hboot" or "radio", and is kept (not copied).
+ * The image is the given entry of the package at path, or if entry is
+ * NULL, the whole file at path.  Only its location and SHA-1 digest are
+ * remembered; it is read again (and must still match) when it is installed,
+ * unless it lives on the cache partition (which installing it destroys),
+ * in which case it is loaded into RAM now.
+ * Returns nonzero on error.
  */
-int remember_firmware_update(const char *type, const char *data, int length);
+int remember_firmware_update(const char *type, const char *path,
+        const ZipArchive *package, const ZipEntry *entry);
 
 /* Returns true if a firmware update has been saved. */
 int firmware_update_pending();
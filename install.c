@@ -18,6 +18,8 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <unistd.h>
@@ -32,6 +34,7 @@
 #include "mtdutils/mounts.h"
 #include "mtdutils/mtdutils.h"
 #include "roots.h"
+#include "trace/trace.h"
 #include "verifier.h"
 #include "firmware.h"
 
@@ -43,6 +46,26 @@ static const RSAPublicKey keys[] = {
 #define ASSUMED_UPDATE_SCRIPT_NAME  "META-INF/com/google/android/update-script"
 #define ASSUMED_UPDATE_BINARY_NAME  "META-INF/com/google/android/update-binary"
 
+// The updater binary profiles its script if this names a file.
+#define UPDATER_PROFILE_ENV "UPDATER_PROFILE"
+
+// The updater binary writes its trace spans (script commands, and the
+// extracting and flashing under them) to the file this names; they're
+// merged into recovery's own trace once it exits.
+#define UPDATER_TRACE_ENV "UPDATER_TRACE"
+#define UPDATER_TRACE_FILE "/tmp/updater-trace.json"
+
+void
+set_install_profiling(int enable)
+{
+    setExecProfiling(enable != 0);
+    if (enable) {
+        setenv(UPDATER_PROFILE_ENV, PROFILE_FILE, 1);
+    } else {
+        unsetenv(UPDATER_PROFILE_ENV);
+    }
+}
+
 static const ZipEntry *
 find_update_script(ZipArchive *zip)
 {
@@ -102,6 +125,17 @@ handle_update_script(ZipArchive *zip, const ZipEntry *update_script_entry)
     /* Execute the script.
      */
     int ret = execCommandList((ExecContext *)1, commands);
+    if (isExecProfiling()) {
+        FILE *fp = fopen(PROFILE_FILE, "a");
+        if (fp == NULL) {
+            LOGW("Can't write %s\n", PROFILE_FILE);
+        } else {
+            UnterminatedString name = mzGetZipEntryFileName(update_script_entry);
+            fprintf(fp, "# %.*s\n", name.len, name.str);
+            writeExecProfile(fp);
+            fclose(fp);
+        }
+    }
     if (ret != 0) {
         int num = ret;
         char *line = NULL, *next = script_data;
@@ -121,9 +155,10 @@ handle_update_script(ZipArchive *zip, const ZipEntry *update_script_entry)
 // The update binary ask us to install a firmware file on reboot.  Set
 // that up.  Takes ownership of type and filename.
 static int
-handle_firmware_update(char* type, char* filename, ZipArchive* zip) {
-    unsigned int data_size;
+handle_firmware_update(char* type, char* filename,
+                       const char* path, ZipArchive* zip) {
     const ZipEntry* entry = NULL;
+    const char* file = filename;
 
     if (strncmp(filename, "PACKAGE:", 8) == 0) {
         entry = mzFindZipEntry(zip, filename+8);
@@ -131,46 +166,14 @@ handle_firmware_update(char* type, char* filename, ZipArchive* zip) {
             LOGE("Failed to find \"%s\" in package", filename+8);
             return INSTALL_ERROR;
         }
-        data_size = entry->uncompLen;
-    } else {
-        struct stat st_data;
-        if (stat(filename, &st_data) < 0) {
-            LOGE("Error stat'ing %s: %s\n", filename, strerror(errno));
-            return INSTALL_ERROR;
-        }
-        data_size = st_data.st_size;
+        file = path;
     }
 
-    LOGI("type is %s; size is %d; file is %s\n",
-         type, data_size, filename);
-
-    char* data = malloc(data_size);
-    if (data == NULL) {
-        LOGI("Can't allocate %d bytes for firmware data\n", data_size);
-        return INSTALL_ERROR;
-    }
-
-    if (entry) {
-        if (mzReadZipEntry(zip, entry, data, data_size) == false) {
-            LOGE("Failed to read \"%s\" from package", filename+8);
-            return INSTALL_ERROR;
-        }
-    } else {
-        FILE* f = fopen(filename, "rb");
-        if (f == NULL) {
-            LOGE("Failed to open %s: %s\n", filename, strerror(errno));
-            return INSTALL_ERROR;
-        }
-        if (fread(data, 1, data_size, f) != data_size) {
-            LOGE("Failed to read firmware data: %s\n", strerror(errno));
-            return INSTALL_ERROR;
-        }
-        fclose(f);
-    }
+    LOGI("type is %s; file is %s\n", type, filename);
 
-    if (remember_firmware_update(type, data, data_size)) {
+    // Only where the image is gets remembered; it's read when it's written.
+    if (remember_firmware_update(type, file, zip, entry)) {
         LOGE("Can't store %s image\n", type);
-        free(data);
         return INSTALL_ERROR;
     }
     free(filename);
@@ -244,9 +247,11 @@ try_update_binary(const char *path, ZipArchive *zip) {
     args[3] = (char*)path;
     args[4] = NULL;
 
+    unlink(UPDATER_TRACE_FILE);
     pid_t pid = fork();
     if (pid == 0) {
         close(pipefd[0]);
+        setenv(UPDATER_TRACE_ENV, UPDATER_TRACE_FILE, 1);
         execv(binary, args);
         fprintf(stderr, "E:Can't run %s (%s)\n", binary, strerror(errno));
         _exit(-1);
@@ -304,36 +309,27 @@ try_update_binary(const char *path, ZipArchive *zip) {
 
     int status;
     waitpid(pid, &status, 0);
+    trace_import(UPDATER_TRACE_FILE);  // if it got that far
+    unlink(UPDATER_TRACE_FILE);
     if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
         LOGE("Error in %s\n(Status %d)\n", path, WEXITSTATUS(status));
         return INSTALL_ERROR;
     }
 
     if (firmware_type != NULL) {
-        return handle_firmware_update(firmware_type, firmware_filename, zip);
+        return handle_firmware_update(firmware_type, firmware_filename,
+                                      path, zip);
     } else {
         return INSTALL_SUCCESS;
     }
 }
 
 static int
-handle_update_package(const char *path, ZipArchive *zip)
+install_verified_package(const char *path, ZipArchive *zip)
 {
-    // Give verification half the progress bar...
-    ui_print("Verifying update package...\n");
-    ui_show_progress(
-            VERIFICATION_PROGRESS_FRACTION,
-            VERIFICATION_PROGRESS_TIME);
-
-    if (!verify_jar_signature(zip, keys, sizeof(keys) / sizeof(keys[0]))) {
-        LOGE("Verification failed\n");
-        return INSTALL_CORRUPT;
-    }
-
-    // Update should take the rest of the progress bar.
-    ui_print("Installing update...\n");
-
+    int span = trace_begin("update_binary", NULL);
     int result = try_update_binary(path, zip);
+    trace_end(span, 0);
     if (result == INSTALL_SUCCESS || result == INSTALL_ERROR) {
         register_package_root(NULL, NULL);  // Unregister package root
         return result;
@@ -355,13 +351,34 @@ handle_update_package(const char *path, ZipArchive *zip)
         return INSTALL_ERROR;
     }
 
+    span = trace_begin("update_script", NULL);
     int ret = handle_update_script(zip, script_entry);
+    trace_end(span, 0);
     register_package_root(NULL, NULL);  // Unregister package root
     return ret;
 }
 
-int
-install_package(const char *root_path)
+static int
+handle_update_package(const char *path, ZipArchive *zip)
+{
+    // Give verification half the progress bar...
+    ui_print("Verifying update package...\n");
+    ui_show_progress(
+            VERIFICATION_PROGRESS_FRACTION,
+            VERIFICATION_PROGRESS_TIME);
+
+    if (!verify_jar_signature(zip, keys, sizeof(keys) / sizeof(keys[0]))) {
+        LOGE("Verification failed\n");
+        return INSTALL_CORRUPT;
+    }
+
+    // Update should take the rest of the progress bar.
+    ui_print("Installing update...\n");
+    return install_verified_package(path, zip);
+}
+
+static int
+traced_install_package(const char *root_path)
 {
     ui_set_background(BACKGROUND_ICON_INSTALLING);
     ui_print("Finding update package...\n");
@@ -397,3 +414,114 @@ install_package(const char *root_path)
     mzCloseZipArchive(&zip);
     return status;
 }
+
+int
+install_package(const char *root_path)
+{
+    int span = trace_begin("install_package", root_path);
+    int status = traced_install_package(root_path);
+    trace_end(span, 0);
+    return status;
+}
+
+typedef struct {
+    const char *root_path;
+    char path[PATH_MAX];
+    ZipArchive zip;
+    int opened;
+    int status;
+} QueuedPackage;
+
+static void *
+verify_queued_package(void *cookie)
+{
+    QueuedPackage *package = (QueuedPackage *) cookie;
+    int span = trace_begin("verify_queued_package", package->root_path);
+    int err = mzOpenZipArchive(package->path, &package->zip);
+    if (err != 0) {
+        LOGE("Can't open %s\n(%s)\n", package->path,
+                err != -1 ? strerror(err) : "bad");
+        package->status = INSTALL_CORRUPT;
+        trace_end(span, 0);
+        return NULL;
+    }
+    package->opened = 1;
+
+    if (!verify_jar_signature(&package->zip,
+            keys, sizeof(keys) / sizeof(keys[0]))) {
+        LOGE("Verification failed:\n  %s\n", package->root_path);
+        package->status = INSTALL_CORRUPT;
+        trace_end(span, 0);
+        return NULL;
+    }
+    LOGI("Verified %s\n", package->root_path);
+    package->status = INSTALL_SUCCESS;
+    trace_end(span, 0);
+    return NULL;
+}
+
+int
+install_packages(const char * const *root_paths, int count)
+{
+    if (count <= 0 || count > MAX_QUEUED_PACKAGES) {
+        LOGE("Can't queue %d packages\n", count);
+        return INSTALL_ERROR;
+    }
+
+    ui_set_background(BACKGROUND_ICON_INSTALLING);
+    ui_print("Finding %d update packages...\n", count);
+    // Verifications running side by side would fight over the bar.
+    ui_show_indeterminate_progress();
+
+    QueuedPackage packages[MAX_QUEUED_PACKAGES];
+    memset(packages, 0, sizeof(packages));
+    int status = INSTALL_SUCCESS;
+    int i;
+    for (i = 0; i < count; ++i) {
+        QueuedPackage *package = &packages[i];
+        package->root_path = root_paths[i];
+        LOGI("Update location: %s\n", root_paths[i]);
+        if (ensure_root_path_mounted(root_paths[i]) != 0) {
+            LOGE("Can't mount %s\n", root_paths[i]);
+            return INSTALL_CORRUPT;
+        }
+        if (translate_root_path(root_paths[i], package->path,
+                sizeof(package->path)) == NULL) {
+            LOGE("Bad path %s\n", root_paths[i]);
+            return INSTALL_CORRUPT;
+        }
+    }
+
+    // Verify everything before installing anything, so that a bad
+    // package at the end of the queue doesn't leave the device
+    // half-updated.
+    ui_print("Verifying %d update packages...\n", count);
+    pthread_t threads[MAX_QUEUED_PACKAGES];
+    int started[MAX_QUEUED_PACKAGES];
+    for (i = 0; i < count; ++i) {
+        started[i] = pthread_create(&threads[i], NULL,
+                verify_queued_package, &packages[i]) == 0;
+        if (!started[i]) verify_queued_package(&packages[i]);
+    }
+    for (i = 0; i < count; ++i) {
+        if (started[i]) pthread_join(threads[i], NULL);
+        if (packages[i].status != INSTALL_SUCCESS) status = INSTALL_CORRUPT;
+    }
+
+    for (i = 0; status == INSTALL_SUCCESS && i < count; ++i) {
+        ui_print("Installing %s (%d of %d)...\n",
+                packages[i].root_path, i + 1, count);
+        ui_reset_progress();
+        int span = trace_begin("install_queued_package", packages[i].root_path);
+        status = install_verified_package(packages[i].path, &packages[i].zip);
+        trace_end(span, 0);
+        if (status != INSTALL_SUCCESS) {
+            LOGE("Installing %s failed\n", packages[i].root_path);
+        }
+    }
+
+    for (i = 0; i < count; ++i) {
+        if (packages[i].opened) mzCloseZipArchive(&packages[i].zip);
+    }
+    return status;
+}
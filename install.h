@@ -22,4 +22,17 @@
 enum { INSTALL_SUCCESS, INSTALL_ERROR, INSTALL_CORRUPT };
 int install_package(const char *root_path);
 
+// Install several packages in order.  All of them are verified first,
+// concurrently, and nothing is installed unless every one passes;
+// installation stops at the first package that fails.
+#define MAX_QUEUED_PACKAGES 16
+int install_packages(const char * const *root_paths, int count);
+
+// Where script profiles are written when profiling is enabled.
+#define PROFILE_FILE "/tmp/recovery.profile"
+
+// Profile the commands run by update scripts (amend and, through the
+// environment, the updater binary's edify script).
+void set_install_profiling(int enable);
+
 #endif  // RECOVERY_INSTALL_H_
@@ -0,0 +1,192 @@
+/*
+ * Copyright (C) 2009 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "logger.h"
+
+#define LOG_BUFFER_SIZE (64 * 1024)
+
+static const char *log_path = NULL;
+
+/* Lines from log_write() wait here until the flusher, log_flush() or a
+ * full buffer writes them out.  Everything below is guarded by log_lock.
+ */
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static char log_buffer[LOG_BUFFER_SIZE];
+static size_t log_used = 0;
+static int log_fd = STDERR_FILENO;
+static int log_buffered = 0;  // only once the flusher is running
+
+static void write_all(const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(log_fd, data, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return;  // nowhere to complain; drop it
+        data += n;
+        len -= n;
+    }
+}
+
+static void drain_locked() {
+    write_all(log_buffer, log_used);
+    log_used = 0;
+}
+
+static void *flush_thread(void *cookie) {
+    for (;;) {
+        usleep(LOG_FLUSH_INTERVAL_MS * 1000);
+        pthread_mutex_lock(&log_lock);
+        drain_locked();
+        pthread_mutex_unlock(&log_lock);
+    }
+    return NULL;
+}
+
+/* Empty the streams and the buffer before fork(), so the child doesn't
+ * inherit (and repeat) buffered lines and its output lands after ours,
+ * and hold the lock so the child doesn't inherit it held by another
+ * thread.  The child has no flusher, so it writes lines straight out.
+ */
+static void before_fork() {
+    fflush(stdout);
+    fflush(stderr);
+    pthread_mutex_lock(&log_lock);
+    drain_locked();
+}
+
+static void after_fork_parent() {
+    pthread_mutex_unlock(&log_lock);
+}
+
+static void after_fork_child() {
+    log_buffered = 0;
+    pthread_mutex_unlock(&log_lock);
+}
+
+void log_init(const char *path) {
+    log_path = path;
+
+    // If these fail, there's not really anywhere to complain...
+    freopen(path, "a", stdout); setvbuf(stdout, NULL, _IOLBF, BUFSIZ);
+    freopen(path, "a", stderr); setvbuf(stderr, NULL, _IOLBF, BUFSIZ);
+
+    pthread_atfork(before_fork, after_fork_parent, after_fork_child);
+    atexit(log_flush);
+
+    pthread_mutex_lock(&log_lock);
+    log_fd = fileno(stderr);
+    pthread_t t;
+    // Without a flusher, fall back to writing every line as it comes.
+    log_buffered = pthread_create(&t, NULL, flush_thread, NULL) == 0;
+    pthread_mutex_unlock(&log_lock);
+}
+
+void log_write(const char *fmt, ...) {
+    char line[512];
+    char *text = line;
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    if (len < 0) return;
+    if ((size_t) len >= sizeof(line)) {
+        text = malloc(len + 1);
+        if (text == NULL) {
+            text = line;
+            len = sizeof(line) - 1;
+        } else {
+            va_start(ap, fmt);
+            vsnprintf(text, len + 1, fmt, ap);
+            va_end(ap);
+        }
+    }
+
+    pthread_mutex_lock(&log_lock);
+    if (!log_buffered || log_used + len > sizeof(log_buffer)) {
+        drain_locked();
+    }
+    if (!log_buffered || (size_t) len > sizeof(log_buffer)) {
+        write_all(text, len);
+    } else {
+        memcpy(log_buffer + log_used, text, len);
+        log_used += len;
+    }
+    pthread_mutex_unlock(&log_lock);
+
+    if (text != line) free(text);
+}
+
+void log_flush() {
+    pthread_mutex_lock(&log_lock);
+    drain_locked();
+    pthread_mutex_unlock(&log_lock);
+    fflush(stdout);
+    fflush(stderr);
+}
+
+void log_sync() {
+    log_flush();
+    fsync(fileno(stderr));
+}
+
+int log_copy(int fd, off_t *offset) {
+    if (log_path == NULL) return -1;
+    log_flush();
+    int in = open(log_path, O_RDONLY);
+    if (in < 0) return -1;
+
+    int result = 0;
+    struct stat st;
+    if (fstat(in, &st) != 0) {
+        result = -1;
+    } else {
+        while (*offset < st.st_size) {
+            ssize_t n = sendfile(fd, in, offset, st.st_size - *offset);
+            if (n > 0) continue;
+            if (n < 0 && errno == EINTR) continue;
+            if (n == 0) break;
+            if (errno != EINVAL && errno != ENOSYS) {
+                result = -1;
+                break;
+            }
+
+            // Older kernels can only sendfile() to a socket.
+            char buf[4096];
+            ssize_t r;
+            while ((r = pread(in, buf, sizeof(buf), *offset)) > 0) {
+                if (write(fd, buf, r) != r) {
+                    result = -1;
+                    break;
+                }
+                *offset += r;
+            }
+            if (r < 0) result = -1;
+            break;
+        }
+    }
+    close(in);
+    return result;
+}
@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2009 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _RECOVERY_LOGGER_H
+#define _RECOVERY_LOGGER_H
+
+#include <sys/types.h>
+
+/* How long a log line can sit in memory before it reaches the file. */
+#define LOG_FLUSH_INTERVAL_MS 250
+
+/* Point stdout and stderr at the log file at 'path' (appending), and
+ * start the thread that writes out log_write()'s buffer every
+ * LOG_FLUSH_INTERVAL_MS.  stdout and stderr themselves stay
+ * line-buffered and are never flushed from another thread, since
+ * bionic's stdio doesn't lock its streams.  Everything is flushed
+ * before every fork(), so a child's output lands after everything
+ * logged before it.
+ */
+void log_init(const char *path);
+
+/* Format a message into the log buffer; LOGI, LOGW and ui_print() all
+ * come through here.  Safe to call from any thread.  Until log_init()
+ * (and in a forked child) the message is written out at once.  Output
+ * that goes to stdout or stderr directly isn't buffered, and can land
+ * ahead of lines logged just before it; call log_flush() first where
+ * the order matters.
+ */
+void log_write(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+/* Write out the log buffer, then stdout and stderr. */
+void log_flush();
+
+/* log_flush(), then fsync() the log file.  Call this at points after
+ * which a crash or reboot must not lose what has been logged.
+ */
+void log_sync();
+
+/* Append the log file, from *offset on, to the file open on 'fd', and
+ * advance *offset past what was copied.  Returns 0 on success.
+ */
+int log_copy(int fd, off_t *offset);
+
+#endif
@@ -10,10 +10,26 @@ LOCAL_SRC_FILES := \
 
 LOCAL_C_INCLUDES += \
 	external/zlib \
-	external/safe-iop/include
+	external/safe-iop/include \
+	$(LOCAL_PATH)/..
 	
 LOCAL_MODULE := libminzip
 
 LOCAL_CFLAGS += -Wall
 
 include $(BUILD_STATIC_LIBRARY)
+
+#
+# Build the host-side hash table check and benchmark
+#
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := \
+	Hash.c \
+	test_hash.c
+
+LOCAL_MODULE := test_minzip_hash
+
+LOCAL_CFLAGS += -Wall -O2
+
+include $(BUILD_HOST_EXECUTABLE)
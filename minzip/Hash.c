@@ -2,8 +2,13 @@
  * Copyright 2006 The Android Open Source Project
  *
  * Hash table.  The dominant calls are add and lookup, with removals
- * happening very infrequently.  We use probing, and don't worry much
- * about tombstone removal.
+ * happening very infrequently.  We use linear probing with Robin Hood
+ * insertion: an entry that is further from its home slot than the one
+ * sitting in the slot it wants takes that slot, and the displaced entry
+ * and the ones behind it shift along.  This keeps every entry close to home, and lets a lookup
+ * stop as soon as it reaches an entry closer to home than it would be,
+ * which matters for misses.  Removal shifts the following entries back,
+ * so no tombstones are needed.
  */
 #include <stdlib.h>
 #include <assert.h>
@@ -59,10 +64,10 @@ HashTable* mzHashTableCreate(size_t initialSize, HashFreeFunc freeFunc)
         return NULL;
 
     pHashTable->tableSize = roundUpPower2(initialSize);
-    pHashTable->numEntries = pHashTable->numDeadEntries = 0;
+    pHashTable->numEntries = 0;
     pHashTable->freeFunc = freeFunc;
     pHashTable->pEntries =
-        (HashEntry*) calloc((size_t)pHashTable->tableSize, sizeof(HashTable));
+        (HashEntry*) calloc((size_t)pHashTable->tableSize, sizeof(HashEntry));
     if (pHashTable->pEntries == NULL) {
         free(pHashTable);
         return NULL;
@@ -81,10 +86,7 @@ void mzHashTableClear(HashTable* pHashTable)
 
     pEnt = pHashTable->pEntries;
     for (i = 0; i < pHashTable->tableSize; i++, pEnt++) {
-        if (pEnt->data == HASH_TOMBSTONE) {
-            // nuke entry
-            pEnt->data = NULL;
-        } else if (pEnt->data != NULL) {
+        if (pEnt->data != NULL) {
             // call free func then nuke entry
             if (pHashTable->freeFunc != NULL)
                 (*pHashTable->freeFunc)(pEnt->data);
@@ -93,7 +95,6 @@ void mzHashTableClear(HashTable* pHashTable)
     }
 
     pHashTable->numEntries = 0;
-    pHashTable->numDeadEntries = 0;
 }
 
 /*
@@ -108,21 +109,50 @@ void mzHashTableFree(HashTable* pHashTable)
     free(pHashTable);
 }
 
-#ifndef NDEBUG
 /*
- * Count up the number of tombstone entries in the hash table.
+ * How far the entry in slot "idx" is from the slot its hash maps to.
  */
-static int countTombStones(HashTable* pHashTable)
+static inline int probeDistance(const HashTable* pHashTable, int idx)
 {
-    int i, count;
+    int mask = pHashTable->tableSize - 1;
+    return (idx - (int) (pHashTable->pEntries[idx].hashValue & mask)) & mask;
+}
 
-    for (count = i = 0; i < pHashTable->tableSize; i++) {
-        if (pHashTable->pEntries[i].data == HASH_TOMBSTONE)
-            count++;
+/*
+ * Put an entry into the table, starting at slot "idx" where it is
+ * "dist" slots from home.  It goes in the first slot whose occupant is
+ * closer to home than it would be, and that occupant and the rest of
+ * the run behind it shift right one slot.  Shifting keeps entries that
+ * share a home slot in the order they were added; swapping the
+ * displaced entry forward instead would carry it past the ones that
+ * followed it.  The entry must not already be in the table, and there
+ * must be room.
+ */
+static void robinHoodInsert(HashTable* pHashTable, int idx, int dist,
+    unsigned int hashValue, void* data)
+{
+    int mask = pHashTable->tableSize - 1;
+    HashEntry* pEntries = pHashTable->pEntries;
+    int end;
+
+    while (pEntries[idx].data != NULL &&
+        probeDistance(pHashTable, idx) >= dist)
+    {
+        idx = (idx + 1) & mask;
+        dist++;
     }
-    return count;
+
+    for (end = idx; pEntries[end].data != NULL; end = (end + 1) & mask)
+        ;
+    while (end != idx) {
+        int prev = (end - 1) & mask;
+        pEntries[end] = pEntries[prev];
+        end = prev;
+    }
+
+    pEntries[idx].hashValue = hashValue;
+    pEntries[idx].data = data;
 }
-#endif
 
 /*
  * Resize a hash table.  We do this when adding an entry increased the
@@ -136,41 +166,84 @@ static int countTombStones(HashTable* pHashTable)
  */
 static bool resizeHash(HashTable* pHashTable, int newSize)
 {
-    HashEntry* pNewEntries;
-    int i;
-
-    assert(countTombStones(pHashTable) == pHashTable->numDeadEntries);
-    //LOGI("before: dead=%d\n", pHashTable->numDeadEntries);
+    HashEntry* pOldEntries = pHashTable->pEntries;
+    int oldSize = pHashTable->tableSize;
+    int start, i;
 
-    pNewEntries = (HashEntry*) calloc(newSize, sizeof(HashTable));
+    HashEntry* pNewEntries = (HashEntry*) calloc(newSize, sizeof(HashEntry));
     if (pNewEntries == NULL)
         return false;
 
-    for (i = 0; i < pHashTable->tableSize; i++) {
-        void* data = pHashTable->pEntries[i].data;
-        if (data != NULL && data != HASH_TOMBSTONE) {
-            int hashValue = pHashTable->pEntries[i].hashValue;
-            int newIdx;
-
-            /* probe for new spot, wrapping around */
-            newIdx = hashValue & (newSize-1);
-            while (pNewEntries[newIdx].data != NULL)
-                newIdx = (newIdx + 1) & (newSize-1);
-
-            pNewEntries[newIdx].hashValue = hashValue;
-            pNewEntries[newIdx].data = data;
-        }
+    /*
+     * Start where a run starts -- at an empty slot, or an entry sitting
+     * in its home slot -- so a run that wraps past the end of the old
+     * table is re-added front to back and keeps its order.  (Small
+     * tables can be full by the time they grow.)
+     */
+    for (start = 0; start < oldSize; start++) {
+        if (pOldEntries[start].data == NULL ||
+            probeDistance(pHashTable, start) == 0)
+            break;
     }
 
-    free(pHashTable->pEntries);
     pHashTable->pEntries = pNewEntries;
     pHashTable->tableSize = newSize;
-    pHashTable->numDeadEntries = 0;
+    for (i = 0; i < oldSize; i++) {
+        int slot = (start + i) & (oldSize - 1);
+        void* data = pOldEntries[slot].data;
+        if (data != NULL) {
+            unsigned int hashValue = pOldEntries[slot].hashValue;
+            robinHoodInsert(pHashTable, hashValue & (newSize-1), 0,
+                hashValue, data);
+        }
+    }
 
-    assert(countTombStones(pHashTable) == 0);
+    free(pOldEntries);
     return true;
 }
 
+/*
+ * Find the slot holding "item", or -1.  If "pInsertIdx" is non-NULL, it's
+ * set to where the item would be inserted, and "*pInsertDist" to its
+ * distance from home there.  "pProbes" (if non-NULL) counts the slots
+ * looked at beyond the first.
+ */
+static int findSlot(const HashTable* pHashTable, unsigned int itemHash,
+    const void* item, HashCompareFunc cmpFunc, bool matchPointer,
+    int* pInsertIdx, int* pInsertDist, int* pProbes)
+{
+    int mask = pHashTable->tableSize - 1;
+    const HashEntry* pEntries = pHashTable->pEntries;
+    int idx = itemHash & mask;
+    int dist;
+
+    for (dist = 0; dist < pHashTable->tableSize; dist++) {
+        const HashEntry* pEntry = &pEntries[idx];
+        if (pEntry->data == NULL ||
+            probeDistance(pHashTable, idx) < dist)
+        {
+            break;      /* it would have been here or earlier */
+        }
+        if (pEntry->hashValue == itemHash &&
+            (matchPointer ? pEntry->data == item
+                          : (*cmpFunc)(pEntry->data, item) == 0))
+        {
+            if (pProbes != NULL)
+                *pProbes = dist;
+            return idx;
+        }
+        idx = (idx + 1) & mask;
+    }
+
+    if (pInsertIdx != NULL) {
+        *pInsertIdx = idx;
+        *pInsertDist = dist;
+    }
+    if (pProbes != NULL)
+        *pProbes = dist;
+    return -1;
+}
+
 /*
  * Look up an entry.
  *
@@ -179,72 +252,93 @@ static bool resizeHash(HashTable* pHashTable, int newSize)
 void* mzHashTableLookup(HashTable* pHashTable, unsigned int itemHash, void* item,
     HashCompareFunc cmpFunc, bool doAdd)
 {
-    HashEntry* pEntry;
-    HashEntry* pEnd;
-    void* result = NULL;
+    int idx, insertIdx, insertDist;
 
     assert(pHashTable->tableSize > 0);
-    assert(item != HASH_TOMBSTONE);
     assert(item != NULL);
 
-    /* jump to the first entry and probe for a match */
-    pEntry = &pHashTable->pEntries[itemHash & (pHashTable->tableSize-1)];
-    pEnd = &pHashTable->pEntries[pHashTable->tableSize];
-    while (pEntry->data != NULL) {
-        if (pEntry->data != HASH_TOMBSTONE &&
-            pEntry->hashValue == itemHash &&
-            (*cmpFunc)(pEntry->data, item) == 0)
-        {
-            /* match */
-            //LOGD("+++ match on entry %d\n", pEntry - pHashTable->pEntries);
-            break;
-        }
+    idx = findSlot(pHashTable, itemHash, item, cmpFunc, false,
+        &insertIdx, &insertDist, NULL);
+    if (idx >= 0)
+        return pHashTable->pEntries[idx].data;
+    if (!doAdd)
+        return NULL;
 
-        pEntry++;
-        if (pEntry == pEnd) {     /* wrap around to start */
-            if (pHashTable->tableSize == 1)
-                break;      /* edge case - single-entry table */
-            pEntry = pHashTable->pEntries;
-        }
+    robinHoodInsert(pHashTable, insertIdx, insertDist, itemHash, item);
+    pHashTable->numEntries++;
 
-        //LOGI("+++ look probing %d...\n", pEntry - pHashTable->pEntries);
+    /*
+     * We've added an entry.  See if this brings us too close to full.
+     */
+    if (pHashTable->numEntries * LOAD_DENOM
+        > pHashTable->tableSize * LOAD_NUMER)
+    {
+        if (!resizeHash(pHashTable, pHashTable->tableSize * 2)) {
+            /* don't really have a way to indicate failure */
+            LOGE("Dalvik hash resize failure\n");
+            abort();
+        }
     }
 
-    if (pEntry->data == NULL) {
-        if (doAdd) {
-            pEntry->hashValue = itemHash;
-            pEntry->data = item;
-            pHashTable->numEntries++;
-
-            /*
-             * We've added an entry.  See if this brings us too close to full.
-             */
-            if ((pHashTable->numEntries+pHashTable->numDeadEntries) * LOAD_DENOM
-                > pHashTable->tableSize * LOAD_NUMER)
+    /* full table is bad -- insertion could never halt */
+    assert(pHashTable->numEntries < pHashTable->tableSize);
+    return item;
+}
+
+/*
+ * Add an entry the caller knows isn't there, to a table with room for it.
+ */
+void mzHashTableAddUnique(HashTable* pHashTable, unsigned int itemHash,
+    void* item)
+{
+    assert(item != NULL);
+    assert((pHashTable->numEntries + 1) * LOAD_DENOM
+        <= pHashTable->tableSize * LOAD_NUMER);
+
+    robinHoodInsert(pHashTable, itemHash & (pHashTable->tableSize-1), 0,
+        itemHash, item);
+    pHashTable->numEntries++;
+}
+
+/*
+ * Find entries equal to an earlier one.
+ *
+ * Insertion keeps entries with the same home slot together, in the
+ * order they were added (see robinHoodInsert()), and equal items have equal hashes and
+ * so the same home.  So each entry only needs comparing with the ones
+ * just before it that share its home slot.
+ */
+int mzHashTableFindDuplicates(HashTable* pHashTable, HashCompareFunc cmpFunc,
+    HashForeachFunc func, void* arg)
+{
+    int mask = pHashTable->tableSize - 1;
+    const HashEntry* pEntries = pHashTable->pEntries;
+    int i, count = 0;
+
+    for (i = 0; i < pHashTable->tableSize; i++) {
+        if (pEntries[i].data == NULL)
+            continue;
+
+        unsigned int home = pEntries[i].hashValue & mask;
+        int prev = (i - 1) & mask;
+        int steps;
+        for (steps = 1; steps < pHashTable->tableSize; steps++) {
+            if (pEntries[prev].data == NULL ||
+                (pEntries[prev].hashValue & mask) != home)
+                break;
+            if (pEntries[prev].hashValue == pEntries[i].hashValue &&
+                (*cmpFunc)(pEntries[prev].data, pEntries[i].data) == 0)
             {
-                if (!resizeHash(pHashTable, pHashTable->tableSize * 2)) {
-                    /* don't really have a way to indicate failure */
-                    LOGE("Dalvik hash resize failure\n");
-                    abort();
-                }
-                /* note "pEntry" is now invalid */
-            } else {
-                //LOGW("okay %d/%d/%d\n",
-                //    pHashTable->numEntries, pHashTable->tableSize,
-                //    (pHashTable->tableSize * LOAD_NUMER) / LOAD_DENOM);
+                count++;
+                if (func != NULL)
+                    (void) (*func)(pEntries[i].data, arg);
+                break;
             }
-
-            /* full table is bad -- search for nonexistent never halts */
-            assert(pHashTable->numEntries < pHashTable->tableSize);
-            result = item;
-        } else {
-            assert(result == NULL);
+            prev = (prev - 1) & mask;
         }
-    } else {
-        result = pEntry->data;
     }
 
-    return result;
+    return count;
 }
 
 /*
@@ -254,34 +348,27 @@ void* mzHashTableLookup(HashTable* pHashTable, unsigned int itemHash, void* item
  */
 bool mzHashTableRemove(HashTable* pHashTable, unsigned int itemHash, void* item)
 {
-    HashEntry* pEntry;
-    HashEntry* pEnd;
+    int mask = pHashTable->tableSize - 1;
+    HashEntry* pEntries = pHashTable->pEntries;
+    int idx, next;
 
     assert(pHashTable->tableSize > 0);
 
-    /* jump to the first entry and probe for a match */
-    pEntry = &pHashTable->pEntries[itemHash & (pHashTable->tableSize-1)];
-    pEnd = &pHashTable->pEntries[pHashTable->tableSize];
-    while (pEntry->data != NULL) {
-        if (pEntry->data == item) {
-            //LOGI("+++ stepping on entry %d\n", pEntry - pHashTable->pEntries);
-            pEntry->data = HASH_TOMBSTONE;
-            pHashTable->numEntries--;
-            pHashTable->numDeadEntries++;
-            return true;
-        }
-
-        pEntry++;
-        if (pEntry == pEnd) {     /* wrap around to start */
-            if (pHashTable->tableSize == 1)
-                break;      /* edge case - single-entry table */
-            pEntry = pHashTable->pEntries;
-        }
+    idx = findSlot(pHashTable, itemHash, item, NULL, true, NULL, NULL, NULL);
+    if (idx < 0)
+        return false;
 
-        //LOGI("+++ del probing %d...\n", pEntry - pHashTable->pEntries);
+    /* pull the following run of displaced entries back one slot */
+    for (next = (idx + 1) & mask;
+         pEntries[next].data != NULL && probeDistance(pHashTable, next) > 0;
+         next = (next + 1) & mask)
+    {
+        pEntries[idx] = pEntries[next];
+        idx = next;
     }
-
-    return false;
+    pEntries[idx].data = NULL;
+    pHashTable->numEntries--;
+    return true;
 }
 
 /*
@@ -296,7 +383,7 @@ int mzHashForeach(HashTable* pHashTable, HashForeachFunc func, void* arg)
     for (i = 0; i < pHashTable->tableSize; i++) {
         HashEntry* pEnt = &pHashTable->pEntries[i];
 
-        if (pEnt->data != NULL && pEnt->data != HASH_TOMBSTONE) {
+        if (pEnt->data != NULL) {
             val = (*func)(pEnt->data, arg);
             if (val != 0)
                 return val;
@@ -315,38 +402,14 @@ int mzHashForeach(HashTable* pHashTable, HashForeachFunc func, void* arg)
 int countProbes(HashTable* pHashTable, unsigned int itemHash, const void* item,
     HashCompareFunc cmpFunc)
 {
-    HashEntry* pEntry;
-    HashEntry* pEnd;
-    int count = 0;
+    int count;
 
     assert(pHashTable->tableSize > 0);
-    assert(item != HASH_TOMBSTONE);
     assert(item != NULL);
 
-    /* jump to the first entry and probe for a match */
-    pEntry = &pHashTable->pEntries[itemHash & (pHashTable->tableSize-1)];
-    pEnd = &pHashTable->pEntries[pHashTable->tableSize];
-    while (pEntry->data != NULL) {
-        if (pEntry->data != HASH_TOMBSTONE &&
-            pEntry->hashValue == itemHash &&
-            (*cmpFunc)(pEntry->data, item) == 0)
-        {
-            /* match */
-            break;
-        }
-
-        pEntry++;
-        if (pEntry == pEnd) {     /* wrap around to start */
-            if (pHashTable->tableSize == 1)
-                break;      /* edge case - single-entry table */
-            pEntry = pHashTable->pEntries;
-        }
-
-        count++;
-    }
-    if (pEntry->data == NULL)
+    if (findSlot(pHashTable, itemHash, item, cmpFunc, false,
+            NULL, NULL, &count) < 0)
         return -1;
-
     return count;
 }
 
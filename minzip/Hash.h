@@ -3,7 +3,7 @@
  *
  * General purpose hash table, used for finding classes, methods, etc.
  *
- * When the number of elements reaches 3/4 of the table's capacity, the
+ * When the number of elements reaches 5/8 of the table's capacity, the
  * table will be resized.
  */
 #ifndef _MINZIP_HASH
@@ -39,10 +39,12 @@ typedef int (*HashForeachFunc)(void* data, void* arg);
 /*
  * One entry in the hash table.  "data" values are expected to be (or have
  * the same characteristics as) valid pointers.  In particular, a NULL
- * value for "data" indicates an empty slot, and HASH_TOMBSTONE indicates
- * a no-longer-used slot that must be stepped over during probing.
+ * value for "data" indicates an empty slot.  The full hash is kept next
+ * to the pointer, so probing only calls the compare function (and
+ * touches the item) when the hashes match, and the distance of each
+ * entry from its home slot can be worked out without rehashing.
  *
- * Attempting to add a NULL or tombstone value is an error.
+ * Attempting to add a NULL value is an error.
  *
  * When an entry is released, we will call (HashFreeFunc)(entry->data).
  */
@@ -51,8 +53,6 @@ typedef struct HashEntry {
     void* data;
 } HashEntry;
 
-#define HASH_TOMBSTONE ((void*) 0xcbcacccd)     // invalid ptr value
-
 /*
  * Expandable hash table.
  *
@@ -60,8 +60,7 @@ typedef struct HashEntry {
  */
 typedef struct HashTable {
     int         tableSize;          /* must be power of 2 */
-    int         numEntries;         /* current #of "live" entries */
-    int         numDeadEntries;     /* current #of tombstone entries */
+    int         numEntries;         /* current #of entries */
     HashEntry*  pEntries;           /* array on heap */
     HashFreeFunc freeFunc;
 } HashTable;
@@ -120,6 +119,25 @@ INLINE int mzHashTableMemUsage(HashTable* pHashTable) {
 void* mzHashTableLookup(HashTable* pHashTable, unsigned int itemHash, void* item,
     HashCompareFunc cmpFunc, bool doAdd);
 
+/*
+ * Add an item without looking for it first, for building a table from
+ * a known set of items.  The table must have been created with room for
+ * all of them (from mzHashSize()), since it won't be resized.  If the
+ * items might contain duplicates, check with mzHashTableFindDuplicates()
+ * once they're all in; until then, lookups find the first one added.
+ */
+void mzHashTableAddUnique(HashTable* pHashTable, unsigned int itemHash,
+    void* item);
+
+/*
+ * Find every item that compares equal to one added before it, in one
+ * pass over the table, calling "func" (if non-NULL) with each of the
+ * later ones.  Returns the number found.  "func"'s return value is
+ * ignored.
+ */
+int mzHashTableFindDuplicates(HashTable* pHashTable, HashCompareFunc cmpFunc,
+    HashForeachFunc func, void* arg);
+
 /*
  * Remove an item from the hash table, given its "data" pointer.  Does not
  * invoke the "free" function; just detaches it from the table.
@@ -153,8 +171,7 @@ INLINE void mzHashIterNext(HashIter* pIter) {
     int i = pIter->idx +1;
     int lim = pIter->pHashTable->tableSize;
     for ( ; i < lim; i++) {
-        void* data = pIter->pHashTable->pEntries[i].data;
-        if (data != NULL && data != HASH_TOMBSTONE)
+        if (pIter->pHashTable->pEntries[i].data != NULL)
             break;
     }
     pIter->idx = i;
@@ -19,6 +19,7 @@
 #include "Bits.h"
 #include "Log.h"
 #include "DirUtil.h"
+#include "trace/trace.h"
 
 #undef NDEBUG   // do this after including Log.h
 #include <assert.h>
@@ -143,18 +144,27 @@ static unsigned int computeHash(const char* name, int nameLen)
     return hash;
 }
 
+/*
+ * Entries are added without checking for duplicates; see
+ * warnDuplicateEntry().
+ */
 static void addEntryToHashTable(HashTable* pHash, ZipEntry* pEntry)
 {
     unsigned int itemHash = computeHash(pEntry->fileName, pEntry->fileNameLen);
-    const ZipEntry* found;
-
-    found = (const ZipEntry*)mzHashTableLookup(pHash,
-                itemHash, pEntry, hashcmpZipEntry, true);
-    if (found != pEntry) {
-        LOGW("WARNING: duplicate entry '%.*s' in Zip\n",
-            found->fileNameLen, found->fileName);
-        /* keep going */
-    }
+    mzHashTableAddUnique(pHash, itemHash, pEntry);
+}
+
+/*
+ * (This is a mzHashTableFindDuplicates callback.)
+ *
+ * Lookups will find the first entry with the name, as they always have.
+ */
+static int warnDuplicateEntry(void* ventry, void* arg)
+{
+    const ZipEntry* pEntry = (const ZipEntry*) ventry;
+    LOGW("WARNING: duplicate entry '%.*s' in Zip\n",
+        pEntry->fileNameLen, pEntry->fileName);
+    return 0;
 }
 
 static int validFilename(const char *fileName, unsigned int fileNameLen)
@@ -403,6 +413,10 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
     }
 #endif
 
+    /* keep going if there are any */
+    mzHashTableFindDuplicates(pArchive->pHash, hashcmpZipEntry,
+        warnDuplicateEntry, NULL);
+
     result = true;
 
 bail:
@@ -433,6 +447,7 @@ int mzOpenZipArchive(const char* fileName, ZipArchive* pArchive)
     int err;
 
     LOGV("Opening archive '%s' %p\n", fileName, pArchive);
+    int span = trace_begin("zip_open", fileName);
 
     map.addr = NULL;
     memset(pArchive, 0, sizeof(*pArchive));
@@ -471,6 +486,7 @@ bail:
         mzCloseZipArchive(pArchive);
     if (map.addr != NULL)
         sysReleaseShmem(&map);
+    trace_end(span, err == 0 ? pArchive->map.length : 0);
     return err;
 }
 
@@ -801,8 +817,11 @@ static bool writeProcessFunction(const unsigned char *data, int dataLen,
 bool mzExtractZipEntryToFile(const ZipArchive *pArchive,
     const ZipEntry *pEntry, int fd)
 {
+    int span = trace_begin_n("zip_extract", pEntry->fileName,
+                             pEntry->fileNameLen);
     bool ret = mzProcessZipEntryContents(pArchive, pEntry, writeProcessFunction,
                                          (void*)fd);
+    trace_end(span, ret ? pEntry->uncompLen : 0);
     if (!ret) {
         LOGE("Can't extract entry to file.\n");
         return false;
@@ -890,10 +909,11 @@ static const char *targetEntryPath(MzPathHelper *helper, ZipEntry *pEntry)
  *
  * Returns true on success, false on failure.
  */
-bool mzExtractRecursive(const ZipArchive *pArchive,
-                        const char *zipDir, const char *targetDir,
-                        int flags, const struct utimbuf *timestamp,
-                        void (*callback)(const char *fn, void *), void *cookie)
+static bool extractRecursive(const ZipArchive *pArchive,
+                             const char *zipDir, const char *targetDir,
+                             int flags, const struct utimbuf *timestamp,
+                             void (*callback)(const char *fn, void *),
+                             void *cookie)
 {
     if (zipDir[0] == '/') {
         LOGE("mzExtractRecursive(): zipDir must be a relative path.\n");
@@ -1110,3 +1130,15 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
 
     return ok;
 }
+
+bool mzExtractRecursive(const ZipArchive *pArchive,
+                        const char *zipDir, const char *targetDir,
+                        int flags, const struct utimbuf *timestamp,
+                        void (*callback)(const char *fn, void *), void *cookie)
+{
+    int span = trace_begin("zip_extract_dir", targetDir);
+    bool ok = extractRecursive(pArchive, zipDir, targetDir, flags, timestamp,
+                               callback, cookie);
+    trace_end(span, 0);
+    return ok;
+}
@@ -0,0 +1,268 @@
+/*
+ * Copyright (C) 2009 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Checks the hash table and measures it on names shaped like the entries
+ * of a system update package, hashed the way Zip.c hashes them.
+ *
+ *   test_hash [entries]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "Hash.h"
+
+static const char *kDirs[] = {
+    "system/app/", "system/bin/", "system/lib/", "system/framework/",
+    "system/etc/permissions/", "system/fonts/", "system/media/audio/ui/",
+    "system/usr/share/zoneinfo/", "system/xbin/", "system/lib/hw/",
+};
+
+static unsigned int computeHash(const char *name)
+{
+    unsigned int hash = 2;
+    while (*name != '\0')
+        hash = hash * 31 + *name++;
+    return hash;
+}
+
+static unsigned int calcHash(const void *item)
+{
+    return computeHash((const char *) item);
+}
+
+static int compareNames(const void *tableItem, const void *looseItem)
+{
+    return strcmp((const char *) tableItem, (const char *) looseItem);
+}
+
+static char **makeNames(int count, const char *suffix)
+{
+    char **names = malloc(count * sizeof(*names));
+    int i;
+    for (i = 0; i < count; i++) {
+        char buf[128];
+        snprintf(buf, sizeof(buf), "%s%c%x_%d%s",
+            kDirs[i % (sizeof(kDirs) / sizeof(kDirs[0]))],
+            'A' + (i * 7) % 26, i * 2654435761u, i, suffix);
+        names[i] = strdup(buf);
+    }
+    return names;
+}
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", \
+                __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+static int lookupAll(HashTable *pHash, char **names, int count)
+{
+    int i, found = 0;
+    for (i = 0; i < count; i++) {
+        if (mzHashTableLookup(pHash, computeHash(names[i]), names[i],
+                compareNames, false) != NULL)
+            found++;
+    }
+    return found;
+}
+
+static HashTable *build(char **names, int count, size_t initialSize)
+{
+    HashTable *pHash = mzHashTableCreate(initialSize, NULL);
+    int i;
+    for (i = 0; i < count; i++) {
+        void *added = mzHashTableLookup(pHash, computeHash(names[i]),
+            names[i], compareNames, true);
+        CHECK(added == names[i]);
+    }
+    return pHash;
+}
+
+static int lastDuplicate(void *item, void *arg)
+{
+    *(void **) arg = item;
+    return 0;
+}
+
+/*
+ * Entries with the same name must stay in the order they were added,
+ * even when a later entry with an earlier home slot displaces them, and
+ * when a resize re-adds a run that wraps past the end of the table.
+ * The hash values are chosen so that both happen in a 16-slot table.
+ */
+static void checkOrder()
+{
+    char *first = strdup("dup"), *second = strdup("dup");
+    void *found = NULL;
+    char others[8][4];
+    int i;
+
+    /* Two 0x105s at home 5, then 0x204 and 0x304 displace them. */
+    HashTable *pHash = mzHashTableCreate(16, NULL);
+    mzHashTableAddUnique(pHash, 0x105, first);
+    mzHashTableAddUnique(pHash, 0x105, second);
+    mzHashTableAddUnique(pHash, 0x204, "b");
+    mzHashTableAddUnique(pHash, 0x304, "c");
+    CHECK(mzHashTableLookup(pHash, 0x105, "dup", compareNames, false)
+        == first);
+    CHECK(mzHashTableFindDuplicates(pHash, compareNames, lastDuplicate,
+        &found) == 1);
+    CHECK(found == second);
+    mzHashTableFree(pHash);
+
+    /* The pair straddles slots 15 and 0, then the table doubles. */
+    pHash = mzHashTableCreate(16, NULL);
+    mzHashTableAddUnique(pHash, 0x0e, "x");
+    mzHashTableAddUnique(pHash, 0x0f, "y");
+    mzHashTableAddUnique(pHash, 0x1e, first);
+    mzHashTableAddUnique(pHash, 0x1e, second);
+    for (i = 0; i < 8; i++) {
+        snprintf(others[i], sizeof(others[i]), "o%d", i);
+        mzHashTableLookup(pHash, 0x23 + i, others[i], compareNames, true);
+    }
+    CHECK(pHash->tableSize == 32);
+    CHECK(mzHashTableLookup(pHash, 0x1e, "dup", compareNames, false)
+        == first);
+    found = NULL;
+    CHECK(mzHashTableFindDuplicates(pHash, compareNames, lastDuplicate,
+        &found) == 1);
+    CHECK(found == second);
+    mzHashTableFree(pHash);
+
+    free(first);
+    free(second);
+}
+
+int main(int argc, char **argv)
+{
+    int count = argc > 1 ? atoi(argv[1]) : 5000;
+    const int rounds = 50;
+    if (count < 2) {
+        fprintf(stderr, "usage: %s [entries]\n", argv[0]);
+        return 2;
+    }
+
+    checkOrder();
+
+    char **names = makeNames(count, "");
+    char **missing = makeNames(count, ".orig");
+    int i;
+
+    /* Sized up front, as parseZipArchive() does, and grown from small. */
+    HashTable *pHash = build(names, count, mzHashSize(count));
+    HashTable *pGrown = build(names, count, 1);
+    CHECK(mzHashTableNumEntries(pHash) == count);
+    CHECK(mzHashTableNumEntries(pGrown) == count);
+    CHECK(lookupAll(pGrown, names, count) == count);
+
+    /* Adding a name that's already there returns the original. */
+    char *copy = strdup(names[count / 2]);
+    CHECK(mzHashTableLookup(pHash, computeHash(copy), copy, compareNames,
+        true) == names[count / 2]);
+    free(copy);
+
+    /* Built in bulk, as parseZipArchive() does, with a few names twice. */
+    int dups = (count + 99) / 100;
+    char **again = malloc(dups * sizeof(*again));
+    HashTable *pBulk = mzHashTableCreate(mzHashSize(count + dups), NULL);
+    for (i = 0; i < count; i++)
+        mzHashTableAddUnique(pBulk, computeHash(names[i]), names[i]);
+    for (i = 0; i < dups; i++) {
+        again[i] = strdup(names[i * 100]);
+        mzHashTableAddUnique(pBulk, computeHash(again[i]), again[i]);
+    }
+    CHECK(mzHashTableNumEntries(pBulk) == count + dups);
+    CHECK(mzHashTableFindDuplicates(pBulk, compareNames, NULL, NULL) == dups);
+    CHECK(mzHashTableFindDuplicates(pHash, compareNames, NULL, NULL) == 0);
+    CHECK(lookupAll(pBulk, names, count) == count);
+    for (i = 0; i < dups; i++) {
+        /* The first one added is the one found. */
+        CHECK(mzHashTableLookup(pBulk, computeHash(again[i]), again[i],
+            compareNames, false) == names[i * 100]);
+        free(again[i]);
+    }
+    free(again);
+    mzHashTableFree(pBulk);
+
+    double start = now();
+    int found = 0;
+    for (i = 0; i < rounds; i++)
+        found += lookupAll(pHash, names, count);
+    double hitTime = now() - start;
+    CHECK(found == count * rounds);
+
+    start = now();
+    found = 0;
+    for (i = 0; i < rounds; i++)
+        found += lookupAll(pHash, missing, count);
+    double missTime = now() - start;
+    CHECK(found == 0);
+
+    mzHashTableProbeCount(pHash, calcHash, compareNames);
+
+    /* Remove every other entry; the rest must still be found. */
+    for (i = 0; i < count; i += 2)
+        CHECK(mzHashTableRemove(pHash, computeHash(names[i]), names[i]));
+    CHECK(!mzHashTableRemove(pHash, computeHash(names[0]), names[0]));
+    CHECK(mzHashTableNumEntries(pHash) == count / 2);
+    for (i = 0; i < count; i++) {
+        void *result = mzHashTableLookup(pHash, computeHash(names[i]),
+            names[i], compareNames, false);
+        CHECK(result == (i % 2 ? names[i] : NULL));
+    }
+
+    int iterated = 0;
+    HashIter iter;
+    for (mzHashIterBegin(pHash, &iter); !mzHashIterDone(&iter);
+        mzHashIterNext(&iter))
+        iterated++;
+    CHECK(iterated == count / 2);
+
+    printf("%d entries in %d slots: %.1f ns per hit, %.1f ns per miss\n",
+        count, pHash->tableSize,
+        hitTime * 1e9 / ((double) count * rounds),
+        missTime * 1e9 / ((double) count * rounds));
+
+    mzHashTableFree(pHash);
+    mzHashTableFree(pGrown);
+    for (i = 0; i < count; i++) {
+        free(names[i]);
+        free(missing[i]);
+    }
+    free(names);
+    free(missing);
+
+    if (failures > 0) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    return 0;
+}
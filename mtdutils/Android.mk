@@ -8,6 +8,8 @@ LOCAL_SRC_FILES := \
 	mtdutils.c \
 	mounts.c
 
+LOCAL_C_INCLUDES += $(LOCAL_PATH)/..
+
 LOCAL_MODULE := libmtdutils
 
 include $(BUILD_STATIC_LIBRARY)
@@ -15,7 +17,7 @@ include $(BUILD_STATIC_LIBRARY)
 include $(CLEAR_VARS)
 LOCAL_SRC_FILES := flash_image.c
 LOCAL_MODULE := flash_image
-LOCAL_STATIC_LIBRARIES := libmtdutils
+LOCAL_STATIC_LIBRARIES := libmtdutils libtrace
 LOCAL_SHARED_LIBRARIES := libcutils libc
 include $(BUILD_EXECUTABLE)
 
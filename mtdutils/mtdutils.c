@@ -27,6 +27,7 @@
 #include <assert.h>
 
 #include "mtdutils.h"
+#include "trace/trace.h"
 
 struct MtdPartition {
     int device_index;
@@ -40,6 +41,8 @@ struct MtdReadContext {
     char *buffer;
     size_t consumed;
     int fd;
+    int trace_span;
+    long long bytes;
 };
 
 struct MtdWriteContext {
@@ -47,6 +50,8 @@ struct MtdWriteContext {
     char *buffer;
     size_t stored;
     int fd;
+    int trace_span;
+    long long bytes;
 };
 
 typedef struct {
@@ -192,6 +197,7 @@ mtd_mount_partition(const MtdPartition *partition, const char *mount_point,
     const unsigned long flags = MS_NOATIME | MS_NODEV | MS_NODIRATIME;
     char devname[64];
     int rv = -1;
+    int span = trace_begin("mtd_mount", mount_point);
 
     sprintf(devname, "/dev/block/mtdblock%d", partition->device_index);
     if (!read_only) {
@@ -214,6 +220,7 @@ mtd_mount_partition(const MtdPartition *partition, const char *mount_point,
         struct stat st;
         rv = stat(mount_point, &st);
         if (rv < 0) {
+            trace_end(span, 0);
             return rv;
         }
         mode_t new_mode = st.st_mode | S_IXUSR | S_IXGRP | S_IXOTH;
@@ -227,6 +234,7 @@ printf("Fixing execute permissions for %s\n", mount_point);
         }
     }
 #endif
+    trace_end(span, 0);
     return rv;
 }
 
@@ -272,6 +280,8 @@ MtdReadContext *mtd_read_partition(const MtdPartition *partition)
 
     ctx->partition = partition;
     ctx->consumed = partition->erase_size;
+    ctx->trace_span = trace_begin("mtd_read", partition->name);
+    ctx->bytes = 0;
     return ctx;
 }
 
@@ -334,6 +344,7 @@ ssize_t mtd_read_data(MtdReadContext *ctx, char *data, size_t len)
         }
 
         if (read >= len) {
+            ctx->bytes += read;
             return read;
         }
 
@@ -344,11 +355,13 @@ ssize_t mtd_read_data(MtdReadContext *ctx, char *data, size_t len)
         }
     }
 
+    ctx->bytes += read;
     return read;
 }
 
 void mtd_read_close(MtdReadContext *ctx)
 {
+    trace_end(ctx->trace_span, ctx->bytes);
     close(ctx->fd);
     free(ctx->buffer);
     free(ctx);
@@ -376,9 +389,56 @@ MtdWriteContext *mtd_write_partition(const MtdPartition *partition)
 
     ctx->partition = partition;
     ctx->stored = 0;
+    ctx->trace_span = trace_begin("mtd_write", partition->name);
+    ctx->bytes = 0;
     return ctx;
 }
 
+// Erase, write and verify the block at pos.  Returns 0 on success.
+static int write_block_at(const MtdPartition *partition, int fd, off_t pos,
+        const char *data)
+{
+    ssize_t size = partition->erase_size;
+    struct erase_info_user erase_info;
+    erase_info.start = pos;
+    erase_info.length = size;
+    int retry;
+    for (retry = 0; retry < 2; ++retry) {
+        if (ioctl(fd, MEMERASE, &erase_info) < 0) {
+            fprintf(stderr, "mtd: erase failure at 0x%08lx (%s)\n",
+                    pos, strerror(errno));
+            continue;
+        }
+        if (lseek(fd, pos, SEEK_SET) != pos ||
+            write(fd, data, size) != size) {
+            fprintf(stderr, "mtd: write error at 0x%08lx (%s)\n",
+                    pos, strerror(errno));
+        }
+
+        char verify[size];
+        if (lseek(fd, pos, SEEK_SET) != pos ||
+            read(fd, verify, size) != size) {
+            fprintf(stderr, "mtd: re-read error at 0x%08lx (%s)\n",
+                    pos, strerror(errno));
+            continue;
+        }
+        if (memcmp(data, verify, size) != 0) {
+            fprintf(stderr, "mtd: verification error at 0x%08lx (%s)\n",
+                    pos, strerror(errno));
+            continue;
+        }
+
+        if (retry > 0) {
+            fprintf(stderr, "mtd: wrote block after %d retries\n", retry);
+        }
+        return 0;  // Success!
+    }
+
+    // Try to erase it once more as we give up on this block
+    ioctl(fd, MEMERASE, &erase_info);
+    return -1;
+}
+
 static int write_block(const MtdPartition *partition, int fd, const char *data)
 {
     off_t pos = lseek(fd, 0, SEEK_CUR);
@@ -393,44 +453,11 @@ static int write_block(const MtdPartition *partition, int fd, const char *data)
             continue;  // Don't try to erase known factory-bad blocks.
         }
 
-        struct erase_info_user erase_info;
-        erase_info.start = pos;
-        erase_info.length = size;
-        int retry;
-        for (retry = 0; retry < 2; ++retry) {
-            if (ioctl(fd, MEMERASE, &erase_info) < 0) {
-                fprintf(stderr, "mtd: erase failure at 0x%08lx (%s)\n",
-                        pos, strerror(errno));
-                continue;
-            }
-            if (lseek(fd, pos, SEEK_SET) != pos ||
-                write(fd, data, size) != size) {
-                fprintf(stderr, "mtd: write error at 0x%08lx (%s)\n",
-                        pos, strerror(errno));
-            }
-
-            char verify[size];
-            if (lseek(fd, pos, SEEK_SET) != pos ||
-                read(fd, verify, size) != size) {
-                fprintf(stderr, "mtd: re-read error at 0x%08lx (%s)\n",
-                        pos, strerror(errno));
-                continue;
-            }
-            if (memcmp(data, verify, size) != 0) {
-                fprintf(stderr, "mtd: verification error at 0x%08lx (%s)\n",
-                        pos, strerror(errno));
-                continue;
-            }
-
-            if (retry > 0) {
-                fprintf(stderr, "mtd: wrote block after %d retries\n", retry);
-            }
+        if (write_block_at(partition, fd, pos, data) == 0) {
             return 0;  // Success!
         }
 
-        // Try to erase it once more as we give up on this block
         fprintf(stderr, "mtd: skipping write block at 0x%08lx\n", pos);
-        ioctl(fd, MEMERASE, &erase_info);
         pos += partition->erase_size;
     }
 
@@ -465,6 +492,7 @@ ssize_t mtd_write_data(MtdWriteContext *ctx, const char *data, size_t len)
         }
     }
 
+    ctx->bytes += wrote;
     return wrote;
 }
 
@@ -487,6 +515,8 @@ off_t mtd_erase_blocks(MtdWriteContext *ctx, int blocks)
         errno = ENOSPC;
         return -1;
     }
+    int span = blocks > 0 ? trace_begin("mtd_erase", ctx->partition->name) : -1;
+    const off_t start = pos;
 
     // Erase the specified number of blocks
     while (blocks-- > 0) {
@@ -506,14 +536,47 @@ off_t mtd_erase_blocks(MtdWriteContext *ctx, int blocks)
         pos += ctx->partition->erase_size;
     }
 
+    trace_end(span, pos - start);
     return pos;
 }
 
+int mtd_rewrite_block(MtdWriteContext *ctx, off_t pos,
+        const char *data, size_t len)
+{
+    const ssize_t size = ctx->partition->erase_size;
+    if (pos % size != 0 || pos + size > (int) ctx->partition->size ||
+        len > (size_t) size) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    loff_t bpos = pos;
+    if (ioctl(ctx->fd, MEMGETBADBLOCK, &bpos) > 0) {
+        fprintf(stderr, "mtd: can't rewrite bad block at 0x%08lx\n", pos);
+        errno = EIO;
+        return -1;
+    }
+
+    char *block = malloc(size);
+    if (block == NULL) return -1;
+    memcpy(block, data, len);
+    memset(block + len, 0, size - len);
+
+    // write_block_at() moves the file position; put it back afterwards.
+    off_t cur = lseek(ctx->fd, 0, SEEK_CUR);
+    int r = cur == (off_t) -1 ? -1 :
+            write_block_at(ctx->partition, ctx->fd, pos, block);
+    if (r == 0 && lseek(ctx->fd, cur, SEEK_SET) != cur) r = -1;
+    free(block);
+    return r;
+}
+
 int mtd_write_close(MtdWriteContext *ctx)
 {
     int r = 0;
     // Make sure any pending data gets written
     if (mtd_erase_blocks(ctx, 0) == (off_t) -1) r = -1;
+    trace_end(ctx->trace_span, ctx->bytes);
     if (close(ctx->fd)) r = -1;
     free(ctx->buffer);
     free(ctx);
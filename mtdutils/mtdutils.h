@@ -49,6 +49,11 @@ void mtd_read_close(MtdReadContext *);
 MtdWriteContext *mtd_write_partition(const MtdPartition *);
 ssize_t mtd_write_data(MtdWriteContext *, const char *data, size_t data_len);
 off_t mtd_erase_blocks(MtdWriteContext *, int blocks);  /* 0 ok, -1 for all */
+/* Replace the (good) erase block at pos, which must be block-aligned, with
+ * len bytes of data padded with zeros.  The write position is unchanged.
+ */
+int mtd_rewrite_block(MtdWriteContext *, off_t pos,
+        const char *data, size_t len);
 int mtd_write_close(MtdWriteContext *);
 
 #endif  // MTDUTILS_H_
@@ -0,0 +1,1759 @@
+/*
+ * Copyright (C) 2009 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+#include <utime.h>
+#include <zlib.h>
+
+#include "common.h"
+#include "cutils/properties.h"
+#include "mincrypt/sha.h"
+#include "minzip/DirUtil.h"
+#include "mtdutils/mounts.h"
+#include "mtdutils/mtdutils.h"
+#include "nandroid.h"
+#include "roots.h"
+
+/* Archive format
+ *
+ * A backup is one file holding a stream per component.  Each stream
+ * is cut into chunks of NAB_CHUNK_SIZE bytes, which are compressed
+ * independently (so they can be compressed, and later inflated, on
+ * several threads at once) and written in order:
+ *
+ *    NabHeader
+ *    { NabChunkHeader, data } ...     chunks of all streams, in order
+ *    NabIndexHeader
+ *    NabStream      streams[stream_count]
+ *    NabChunkEntry  chunks[chunk_count]
+ *    NabTrailer
+ *
+ * The index at the end is what restore uses; the per-chunk headers are
+ * redundant with it, but let a damaged archive be salvaged by scanning.
+ * Every chunk carries the CRC-32 of its uncompressed data, and the
+ * index carries its own.  All fields are little-endian (host order).
+ *
+ * An incremental backup is split differently: chunk boundaries are
+ * chosen by content (see CDC_* below), so that an insertion early in a
+ * partition only changes the chunks around it.  Each chunk is stored
+ * once, as a file named by the SHA-1 of its contents, in a chunk store
+ * shared by all of the device's incremental backups:
+ *
+ *    <store>/<first 2 hex digits>/<remaining 38 hex digits>
+ *        NabChunkHeader, data
+ *
+ * and the backup itself is a small manifest with the same layout as an
+ * archive, minus the chunk data, whose index lists NabChunkRefs
+ * instead of NabChunkEntries:
+ *
+ *    NabHeader (magic NAB_MANIFEST_MAGIC)
+ *    NabIndexHeader
+ *    NabStream      streams[stream_count]
+ *    NabChunkRef    chunks[chunk_count]
+ *    NabTrailer
+ *
+ * A raw stream is the partition contents.  A tree stream is a series
+ * of records, each a NabEntry followed by the path (relative to the
+ * mount point, not NUL-terminated) and then 'size' bytes of file data
+ * or symlink target.  A NabEntry with mode 0 ends the tree.
+ */
+
+#define NAB_MAGIC          0x3142414e   /* "NAB1" */
+#define NAB_MANIFEST_MAGIC 0x4d42414e   /* "NABM" */
+#define NAB_VERSION        1
+#define NAB_CHUNK_MAGIC    0x4b4e4843   /* "CHNK" */
+#define NAB_INDEX_MAGIC    0x58444e49   /* "INDX" */
+#define NAB_TRAILER_MAGIC  0x5442414e   /* "NABT" */
+
+#define NAB_CHUNK_SIZE     (256 * 1024)
+
+/* Content-defined chunking for incremental backups: cut after any byte
+ * where the top bits of a gear hash (which covers the last 32 bytes)
+ * are all zero, giving chunks of ~64 KiB on average, but never smaller
+ * than CDC_MIN_SIZE nor larger than NAB_CHUNK_SIZE.
+ */
+#define CDC_MIN_SIZE       (16 * 1024)
+#define CDC_MASK           0xffff0000
+
+/* Where incremental backups keep their chunks, inside the device's
+ * folder.  The leading dot keeps it out of the restore menu.
+ */
+#define NAB_STORE_NAME     ".store"
+
+/* Chunks in flight between the reader, the compressors and the writer. */
+#define NAB_SLOTS          8
+#define NAB_MAX_WORKERS    4
+
+enum { NAB_STREAM_RAW, NAB_STREAM_TREE };
+#define NAB_CHUNK_DEFLATED 0x0001
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t chunk_size;
+    uint32_t reserved;
+} NabHeader;
+
+typedef struct {
+    uint32_t magic;
+    uint16_t stream;
+    uint16_t flags;
+    uint32_t raw_len;
+    uint32_t data_len;
+    uint32_t crc;
+} NabChunkHeader;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t stream_count;
+    uint32_t chunk_count;
+    uint32_t reserved;
+} NabIndexHeader;
+
+typedef struct {
+    char name[16];
+    uint32_t type;
+    uint32_t first_chunk;
+    uint32_t chunk_count;
+    uint32_t reserved;
+    uint64_t raw_size;
+} NabStream;
+
+typedef struct {
+    uint64_t offset;      /* of the chunk data, just past its header */
+    uint32_t raw_len;
+    uint32_t data_len;
+    uint32_t crc;
+    uint16_t stream;
+    uint16_t flags;
+} NabChunkEntry;
+
+typedef struct {
+    uint8_t digest[SHA_DIGEST_SIZE];
+    uint32_t raw_len;
+} NabChunkRef;
+
+typedef struct {
+    uint64_t index_offset;
+    uint32_t index_size;
+    uint32_t index_crc;
+    uint32_t magic;
+    uint32_t reserved;
+} NabTrailer;
+
+typedef struct {
+    uint32_t mode;        /* st_mode, or 0 at the end of the tree */
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t mtime;
+    uint64_t size;
+    uint32_t path_len;
+    uint32_t rdev;
+} NabEntry;
+
+#define NAB_MAX_STREAMS 16
+
+/* The ext partition has no entry in roots.c, since its filesystem type
+ * varies; it's mounted here by trying each type in turn.
+ */
+#define EXT_DEVICE       "/dev/block/mmcblk0p2"
+#define EXT_MOUNT_POINT  "/sd-ext"
+
+typedef struct {
+    int component;
+    const char *name;       /* stream name in the archive */
+    const char *root;       /* roots.c root, or NULL for the ext partition */
+    int type;
+} NandroidPart;
+
+static const NandroidPart PARTS[] = {
+    { NANDROID_BOOT,   "boot",   "BOOT:",   NAB_STREAM_RAW },
+    { NANDROID_SYSTEM, "system", "SYSTEM:", NAB_STREAM_TREE },
+    { NANDROID_DATA,   "data",   "DATA:",   NAB_STREAM_TREE },
+    { NANDROID_CACHE,  "cache",  "CACHE:",  NAB_STREAM_TREE },
+    { NANDROID_EXT,    "sd-ext", NULL,      NAB_STREAM_TREE },
+};
+#define PART_COUNT (sizeof(PARTS) / sizeof(PARTS[0]))
+
+static int has_extension(const char *name, const char *ext) {
+    size_t len = strlen(name);
+    size_t ext_len = strlen(ext);
+    return len > ext_len && strcmp(name + len - ext_len, ext) == 0;
+}
+
+int is_nandroid_archive(const char *name) {
+    return has_extension(name, NANDROID_EXTENSION) ||
+        has_extension(name, NANDROID_MANIFEST_EXTENSION);
+}
+
+static int mount_ext() {
+    scan_mounted_volumes();
+    if (find_mounted_volume_by_mount_point(EXT_MOUNT_POINT) != NULL) return 0;
+
+    static const char *types[] = { "ext4", "ext3", "ext2", NULL };
+    const char **type;
+    mkdir(EXT_MOUNT_POINT, 0755);
+    for (type = types; *type != NULL; ++type) {
+        if (mount(EXT_DEVICE, EXT_MOUNT_POINT, *type,
+                  MS_NOATIME | MS_NODEV | MS_NODIRATIME, "") == 0) {
+            return 0;
+        }
+    }
+    LOGE("Can't mount %s\n(%s)\n", EXT_DEVICE, strerror(errno));
+    return -1;
+}
+
+static void unmount_ext() {
+    scan_mounted_volumes();
+    const MountedVolume *vol =
+            find_mounted_volume_by_mount_point(EXT_MOUNT_POINT);
+    if (vol != NULL) unmount_mounted_volume(vol);
+}
+
+/* Mount the filesystem for a tree part and put its path in 'path'. */
+static int mount_part(const NandroidPart *part, char *path, size_t len) {
+    if (part->root == NULL) {
+        if (mount_ext()) return -1;
+        strlcpy(path, EXT_MOUNT_POINT, len);
+        return 0;
+    }
+    if (ensure_root_path_mounted(part->root) != 0) {
+        LOGE("Can't mount %s\n", part->root);
+        return -1;
+    }
+    if (translate_root_path(part->root, path, len) == NULL) {
+        LOGE("Bad path %s\n", part->root);
+        return -1;
+    }
+    return 0;
+}
+
+static void unmount_part(const NandroidPart *part) {
+    if (part->root == NULL) unmount_ext();
+}
+
+static int write_all(int fd, const void *data, size_t len) {
+    const char *p = (const char *) data;
+    while (len > 0) {
+        ssize_t w = write(fd, p, len);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += w;
+        len -= w;
+    }
+    return 0;
+}
+
+// -----------------------------------------------------------------
+//   chunk store
+// -----------------------------------------------------------------
+
+static uint32_t gear_table[256];
+
+/* The table must never change, or chunk boundaries (and so dedup
+ * against older backups) would change with it.
+ */
+static void init_gear_table() {
+    uint32_t x = 0x2545f491;
+    int i;
+    for (i = 0; i < 256; ++i) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        gear_table[i] = x;
+    }
+}
+
+/* The set of chunks known to be in the store. */
+typedef struct {
+    uint8_t (*digests)[SHA_DIGEST_SIZE];
+    char *used;
+    unsigned int size;          /* a power of two */
+    unsigned int count;
+} DigestSet;
+
+static unsigned int digest_slot(const DigestSet *set, const uint8_t *d) {
+    // SHA-1 output is already uniform; any four bytes make a good hash.
+    uint32_t h = d[0] | (d[1] << 8) | (d[2] << 16) | ((uint32_t) d[3] << 24);
+    unsigned int i = h & (set->size - 1);
+    while (set->used[i] &&
+           memcmp(set->digests[i], d, SHA_DIGEST_SIZE) != 0) {
+        i = (i + 1) & (set->size - 1);
+    }
+    return i;
+}
+
+static int digest_set_contains(const DigestSet *set, const uint8_t *d) {
+    return set->size > 0 && set->used[digest_slot(set, d)];
+}
+
+static int digest_set_add(DigestSet *set, const uint8_t *d) {
+    if ((set->count + 1) * 2 > set->size) {
+        DigestSet bigger;
+        bigger.size = set->size ? set->size * 2 : 1024;
+        bigger.count = 0;
+        bigger.digests = malloc(bigger.size * SHA_DIGEST_SIZE);
+        bigger.used = calloc(bigger.size, 1);
+        if (bigger.digests == NULL || bigger.used == NULL) {
+            free(bigger.digests);
+            free(bigger.used);
+            return -1;
+        }
+        unsigned int i;
+        for (i = 0; i < set->size; ++i) {
+            if (set->used[i]) digest_set_add(&bigger, set->digests[i]);
+        }
+        free(set->digests);
+        free(set->used);
+        *set = bigger;
+    }
+    unsigned int i = digest_slot(set, d);
+    if (!set->used[i]) {
+        memcpy(set->digests[i], d, SHA_DIGEST_SIZE);
+        set->used[i] = 1;
+        ++set->count;
+    }
+    return 0;
+}
+
+static void digest_set_free(DigestSet *set) {
+    free(set->digests);
+    free(set->used);
+    memset(set, 0, sizeof(*set));
+}
+
+static void chunk_path(const char *store, const uint8_t *digest,
+                       char *path, size_t len) {
+    char hex[SHA_DIGEST_SIZE * 2 + 1];
+    int i;
+    for (i = 0; i < SHA_DIGEST_SIZE; ++i) {
+        sprintf(hex + i * 2, "%02x", digest[i]);
+    }
+    snprintf(path, len, "%s/%.2s/%s", store, hex, hex + 2);
+}
+
+static int parse_hex(const char *hex, uint8_t *out, int bytes) {
+    int i;
+    for (i = 0; i < bytes * 2; ++i) {
+        char c = hex[i];
+        int v;
+        if (c >= '0' && c <= '9') v = c - '0';
+        else if (c >= 'a' && c <= 'f') v = c - 'a' + 10;
+        else return -1;
+        if (i & 1) out[i / 2] |= v;
+        else out[i / 2] = v << 4;
+    }
+    return hex[i] == '\0' ? 0 : -1;
+}
+
+/* True if the chunk file at 'path' has a sane header and is exactly
+ * as long as the header says.  (The digest is only checked on restore;
+ * reading every chunk back on every backup would cost too much.)
+ */
+static int chunk_file_ok(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return 0;
+    NabChunkHeader header;
+    struct stat st;
+    int ok = read(fd, &header, sizeof(header)) == sizeof(header) &&
+        fstat(fd, &st) == 0 &&
+        header.magic == NAB_CHUNK_MAGIC &&
+        header.raw_len <= NAB_CHUNK_SIZE &&
+        header.data_len <= compressBound(NAB_CHUNK_SIZE) &&
+        st.st_size == (off_t) (sizeof(header) + header.data_len);
+    close(fd);
+    return ok;
+}
+
+/* Fill 'set' with every intact chunk already in the store.  A damaged
+ * one is left out, so this backup writes it again.
+ */
+static int load_store(const char *store, DigestSet *set) {
+    int i;
+    for (i = 0; i < 256; ++i) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%02x", store, i);
+        DIR *d = opendir(path);
+        if (d == NULL) continue;
+        struct dirent *de;
+        while ((de = readdir(d)) != NULL) {
+            uint8_t digest[SHA_DIGEST_SIZE];
+            digest[0] = i;
+            // Anything else (e.g., a .tmp left by a crash) is ignored.
+            if (parse_hex(de->d_name, digest + 1, SHA_DIGEST_SIZE - 1) != 0) {
+                continue;
+            }
+            char file[PATH_MAX];
+            snprintf(file, sizeof(file), "%s/%s", path, de->d_name);
+            if (!chunk_file_ok(file)) {
+                LOGW("Ignoring damaged chunk %s\n", file);
+                continue;
+            }
+            if (digest_set_add(set, digest) != 0) {
+                closedir(d);
+                return -1;
+            }
+        }
+        closedir(d);
+    }
+    return 0;
+}
+
+/* Add a chunk to the store.  It's written under a temporary name and
+ * renamed, so a chunk is never found half-written under its real name.
+ * Its data isn't forced out here; nandroid_backup() syncs once before
+ * committing the manifest that refers to it.
+ */
+static int write_chunk_file(const char *store, const uint8_t *digest,
+                            const NabChunkHeader *header, const char *data) {
+    char path[PATH_MAX];
+    char temp[PATH_MAX];
+    chunk_path(store, digest, path, sizeof(path));
+    snprintf(temp, sizeof(temp), "%.*s", (int) (strrchr(path, '/') - path),
+             path);
+    if (mkdir(temp, 0777) != 0 && errno != EEXIST) return -1;
+    snprintf(temp, sizeof(temp), "%s.tmp", path);
+
+    int fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return -1;
+    int result = write_all(fd, header, sizeof(*header)) ||
+                 write_all(fd, data, header->data_len) ? -1 : 0;
+    if (close(fd) != 0) result = -1;
+    if (result == 0 && rename(temp, path) != 0) result = -1;
+    if (result != 0) unlink(temp);
+    return result;
+}
+
+// -----------------------------------------------------------------
+//   backup: reader -> compressor threads -> in-order writer thread
+// -----------------------------------------------------------------
+
+typedef struct {
+    int stream;
+    char *raw;
+    size_t raw_len;
+    char *data;
+    size_t data_len;
+    uint32_t crc;
+    int flags;
+    int done;
+    uint8_t digest[SHA_DIGEST_SIZE];    /* incremental backups only */
+    int stored;         /* chunk was already in the store; not compressed */
+} NabJob;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;        /* broadcast on every state change */
+    NabJob jobs[NAB_SLOTS];
+    unsigned int next_fill;     /* sequence numbers; job n is in slot n % NAB_SLOTS */
+    unsigned int next_work;
+    unsigned int next_write;
+    int finished;
+    int failed;
+
+    /* Owned by the writer thread until it exits. */
+    int fd;
+    uint64_t offset;
+    NabChunkEntry *chunks;
+    NabChunkRef *refs;
+    unsigned int chunk_size;
+
+    /* Set for incremental backups, which write chunks to this store
+     * rather than to 'fd'.  'known' is protected by 'lock'.
+     */
+    const char *store;
+    DigestSet known;
+    long long new_bytes;
+    uint32_t gear;              /* owned by the reading thread */
+
+    /* Owned by the reading (main) thread. */
+    NabJob *current;
+    int stream;
+    NabStream streams[NAB_MAX_STREAMS];
+    int stream_count;
+    long long done_bytes;
+    long long total_bytes;
+    int short_files;            /* files padded out after a failed read */
+} NabWriter;
+
+static void *compress_thread(void *cookie) {
+    NabWriter *w = (NabWriter *) cookie;
+    pthread_mutex_lock(&w->lock);
+    for (;;) {
+        while (w->next_work == w->next_fill && !w->finished && !w->failed) {
+            pthread_cond_wait(&w->cond, &w->lock);
+        }
+        if (w->failed || w->next_work == w->next_fill) break;
+        NabJob *job = &w->jobs[w->next_work++ % NAB_SLOTS];
+        pthread_mutex_unlock(&w->lock);
+
+        job->crc = crc32(crc32(0L, Z_NULL, 0),
+                         (const Bytef *) job->raw, job->raw_len);
+        job->stored = 0;
+        if (w->store != NULL) {
+            SHA_CTX sha;
+            SHA_init(&sha);
+            SHA_update(&sha, job->raw, job->raw_len);
+            memcpy(job->digest, SHA_final(&sha), SHA_DIGEST_SIZE);
+
+            // Unchanged chunks are the common case; don't compress
+            // what won't be written.
+            pthread_mutex_lock(&w->lock);
+            job->stored = digest_set_contains(&w->known, job->digest);
+            pthread_mutex_unlock(&w->lock);
+        }
+        uLongf len = compressBound(NAB_CHUNK_SIZE);
+        if (job->stored) {
+            job->data_len = 0;
+            job->flags = 0;
+        } else if (compress2((Bytef *) job->data, &len, (const Bytef *) job->raw,
+                      job->raw_len, Z_BEST_SPEED) == Z_OK &&
+            len < job->raw_len) {
+            job->data_len = len;
+            job->flags = NAB_CHUNK_DEFLATED;
+        } else {
+            job->data_len = job->raw_len;   /* incompressible; store it */
+            job->flags = 0;
+        }
+
+        pthread_mutex_lock(&w->lock);
+        job->done = 1;
+        pthread_cond_broadcast(&w->cond);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+static void *write_thread(void *cookie) {
+    NabWriter *w = (NabWriter *) cookie;
+    pthread_mutex_lock(&w->lock);
+    for (;;) {
+        NabJob *job = &w->jobs[w->next_write % NAB_SLOTS];
+        while (!w->failed &&
+               !(w->next_write != w->next_fill && job->done) &&
+               !(w->finished && w->next_write == w->next_fill)) {
+            pthread_cond_wait(&w->cond, &w->lock);
+        }
+        if (w->failed || w->next_write == w->next_fill) break;
+        pthread_mutex_unlock(&w->lock);
+
+        NabChunkHeader header;
+        header.magic = NAB_CHUNK_MAGIC;
+        header.stream = job->stream;
+        header.flags = job->flags;
+        header.raw_len = job->raw_len;
+        header.data_len = job->data_len;
+        header.crc = job->crc;
+        const char *data =
+                (job->flags & NAB_CHUNK_DEFLATED) ? job->data : job->raw;
+
+        int error = 0;
+        if (w->next_write >= w->chunk_size) {
+            w->chunk_size = w->chunk_size * 2 + 64;
+            NabChunkEntry *chunks = (NabChunkEntry *)
+                    realloc(w->chunks, w->chunk_size * sizeof(NabChunkEntry));
+            NabChunkRef *refs = (NabChunkRef *)
+                    realloc(w->refs, w->chunk_size * sizeof(NabChunkRef));
+            if (chunks != NULL) w->chunks = chunks;
+            if (refs != NULL) w->refs = refs;
+            if (chunks == NULL || refs == NULL) error = 1;
+        }
+        if (!error && w->store != NULL) {
+            // Another job with the same contents may have been
+            // compressed alongside this one; only the first is written.
+            pthread_mutex_lock(&w->lock);
+            int known = digest_set_contains(&w->known, job->digest);
+            pthread_mutex_unlock(&w->lock);
+            if (!known) {
+                if (write_chunk_file(w->store, job->digest, &header, data)) {
+                    LOGE("Can't write chunk store\n(%s)\n", strerror(errno));
+                    error = 1;
+                } else {
+                    w->new_bytes += job->data_len;
+                    pthread_mutex_lock(&w->lock);
+                    if (digest_set_add(&w->known, job->digest)) error = 1;
+                    pthread_mutex_unlock(&w->lock);
+                }
+            }
+            if (!error) {
+                NabChunkRef *ref = &w->refs[w->next_write];
+                memcpy(ref->digest, job->digest, SHA_DIGEST_SIZE);
+                ref->raw_len = job->raw_len;
+            }
+        } else if (!error && (write_all(w->fd, &header, sizeof(header)) ||
+                              write_all(w->fd, data, job->data_len))) {
+            LOGE("Can't write backup\n(%s)\n", strerror(errno));
+            error = 1;
+        } else if (!error) {
+            NabChunkEntry *e = &w->chunks[w->next_write];
+            e->offset = w->offset + sizeof(header);
+            e->raw_len = job->raw_len;
+            e->data_len = job->data_len;
+            e->crc = job->crc;
+            e->stream = job->stream;
+            e->flags = job->flags;
+            w->offset += sizeof(header) + job->data_len;
+        }
+
+        pthread_mutex_lock(&w->lock);
+        if (error) w->failed = 1;
+        ++w->next_write;
+        pthread_cond_broadcast(&w->cond);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+/* Hand the chunk being filled to the compressors. */
+static int submit_chunk(NabWriter *w) {
+    NabJob *job = w->current;
+    w->current = NULL;
+    if (job == NULL || job->raw_len == 0) return 0;
+
+    w->done_bytes += job->raw_len;
+    if (w->total_bytes > 0) {
+        float fraction = (float) w->done_bytes / w->total_bytes;
+        ui_set_progress(fraction > 1.0 ? 1.0 : fraction);
+    }
+
+    pthread_mutex_lock(&w->lock);
+    ++w->next_fill;
+    pthread_cond_broadcast(&w->cond);
+    int failed = w->failed;
+    pthread_mutex_unlock(&w->lock);
+    return failed ? -1 : 0;
+}
+
+static int nab_write(NabWriter *w, const void *data, size_t len) {
+    const char *p = (const char *) data;
+    while (len > 0) {
+        if (w->current == NULL) {
+            pthread_mutex_lock(&w->lock);
+            while (w->next_fill - w->next_write >= NAB_SLOTS && !w->failed) {
+                pthread_cond_wait(&w->cond, &w->lock);
+            }
+            int failed = w->failed;
+            pthread_mutex_unlock(&w->lock);
+            if (failed) return -1;
+
+            w->current = &w->jobs[w->next_fill % NAB_SLOTS];
+            w->current->stream = w->stream;
+            w->current->raw_len = 0;
+            w->current->done = 0;
+        }
+
+        NabJob *job = w->current;
+        size_t copy = NAB_CHUNK_SIZE - job->raw_len;
+        if (copy > len) copy = len;
+        int cut = 0;
+        if (w->store != NULL) {
+            size_t i;
+            for (i = 0; i < copy; ++i) {
+                w->gear = (w->gear << 1) + gear_table[(unsigned char) p[i]];
+                if ((w->gear & CDC_MASK) == 0 &&
+                    job->raw_len + i + 1 >= CDC_MIN_SIZE) {
+                    copy = i + 1;
+                    cut = 1;
+                    break;
+                }
+            }
+        }
+        memcpy(job->raw + job->raw_len, p, copy);
+        job->raw_len += copy;
+        p += copy;
+        len -= copy;
+
+        if ((cut || job->raw_len == NAB_CHUNK_SIZE) && submit_chunk(w)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void begin_stream(NabWriter *w, const NandroidPart *part) {
+    NabStream *s = &w->streams[w->stream_count];
+    memset(s, 0, sizeof(*s));
+    strlcpy(s->name, part->name, sizeof(s->name));
+    s->type = part->type;
+    s->first_chunk = w->next_fill;
+    w->stream = w->stream_count;
+}
+
+static int end_stream(NabWriter *w, uint64_t raw_size) {
+    if (submit_chunk(w)) return -1;
+    NabStream *s = &w->streams[w->stream_count++];
+    s->chunk_count = w->next_fill - s->first_chunk;
+    s->raw_size = raw_size;
+    return 0;
+}
+
+static int backup_raw(NabWriter *w, const NandroidPart *part,
+                      uint64_t *raw_size) {
+    const MtdPartition *mtd = get_root_mtd_partition(part->root);
+    if (mtd == NULL) {
+        LOGE("Can't find %s\n", part->root);
+        return -1;
+    }
+    size_t total;
+    if (mtd_partition_info(mtd, &total, NULL, NULL) != 0) {
+        LOGE("Can't get size of %s\n", part->root);
+        return -1;
+    }
+    MtdReadContext *in = mtd_read_partition(mtd);
+    if (in == NULL) {
+        LOGE("Can't read %s\n(%s)\n", part->root, strerror(errno));
+        return -1;
+    }
+
+    char *buffer = (char *) malloc(NAB_CHUNK_SIZE);
+    size_t done = 0;
+    int result = buffer == NULL ? -1 : 0;
+    while (result == 0 && done < total) {
+        size_t want = total - done < NAB_CHUNK_SIZE ?
+                total - done : NAB_CHUNK_SIZE;
+        ssize_t got = mtd_read_data(in, buffer, want);
+        if (got <= 0) {
+            // Bad blocks are skipped, so the last few may be unreadable;
+            // everything before them has been saved.
+            LOGW("%s: stopped reading at 0x%08lx\n",
+                 part->root, (unsigned long) done);
+            break;
+        }
+        result = nab_write(w, buffer, got);
+        done += got;
+    }
+    free(buffer);
+    mtd_read_close(in);
+    *raw_size = done;
+    return result;
+}
+
+static int backup_entry(NabWriter *w, const char *base, const char *rel,
+                        uint64_t *raw_size);
+
+static int backup_dir(NabWriter *w, const char *base, const char *rel,
+                      uint64_t *raw_size) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", base, rel);
+    DIR *d = opendir(path);
+    if (d == NULL) {
+        LOGE("Can't open %s\n(%s)\n", path, strerror(errno));
+        return -1;
+    }
+
+    int result = 0;
+    struct dirent *de;
+    while (result == 0 && (de = readdir(d)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+            continue;
+        }
+        // Formatting recreates lost+found; there's nothing to keep in it.
+        if (rel[0] == '\0' && strcmp(de->d_name, "lost+found") == 0) {
+            continue;
+        }
+        char child[PATH_MAX];
+        if (rel[0] == '\0') {
+            strlcpy(child, de->d_name, sizeof(child));
+        } else {
+            snprintf(child, sizeof(child), "%s/%s", rel, de->d_name);
+        }
+        result = backup_entry(w, base, child, raw_size);
+    }
+    closedir(d);
+    return result;
+}
+
+static int backup_entry(NabWriter *w, const char *base, const char *rel,
+                        uint64_t *raw_size) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", base, rel);
+    struct stat st;
+    if (lstat(path, &st) != 0) {
+        LOGE("Can't stat %s\n(%s)\n", path, strerror(errno));
+        return -1;
+    }
+    if (S_ISSOCK(st.st_mode)) return 0;     // recreated by whoever owns it
+
+    char target[PATH_MAX];
+    NabEntry e;
+    memset(&e, 0, sizeof(e));
+    e.mode = st.st_mode;
+    e.uid = st.st_uid;
+    e.gid = st.st_gid;
+    e.mtime = st.st_mtime;
+    e.path_len = strlen(rel);
+    if (S_ISREG(st.st_mode)) {
+        e.size = st.st_size;
+    } else if (S_ISLNK(st.st_mode)) {
+        ssize_t len = readlink(path, target, sizeof(target));
+        if (len < 0 || len == sizeof(target)) {
+            LOGE("Can't read link %s\n", path);
+            return -1;
+        }
+        e.size = len;
+    } else if (S_ISCHR(st.st_mode) || S_ISBLK(st.st_mode)) {
+        e.rdev = st.st_rdev;
+    }
+
+    if (nab_write(w, &e, sizeof(e)) || nab_write(w, rel, e.path_len)) {
+        return -1;
+    }
+    *raw_size += sizeof(e) + e.path_len;
+
+    if (S_ISDIR(st.st_mode)) {
+        return backup_dir(w, base, rel, raw_size);
+    }
+    if (S_ISLNK(st.st_mode)) {
+        *raw_size += e.size;
+        return nab_write(w, target, e.size);
+    }
+    if (!S_ISREG(st.st_mode)) return 0;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        LOGE("Can't open %s\n(%s)\n", path, strerror(errno));
+        return -1;
+    }
+    // Store exactly the size recorded above, even if the file changes
+    // underneath us or can't be read, so the stream stays parseable:
+    // once a read fails or comes up short, the rest is zeros.
+    char buffer[16384];
+    uint64_t left = e.size;
+    int result = 0;
+    int padding = 0;
+    while (result == 0 && left > 0) {
+        size_t want = left < sizeof(buffer) ? left : sizeof(buffer);
+        ssize_t got = padding ? 0 : read(fd, buffer, want);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) {
+            if (!padding) {
+                if (got < 0) {
+                    LOGW("Can't read %s\n(%s)\n", path, strerror(errno));
+                } else {
+                    LOGW("%s shrank during backup\n", path);
+                }
+                ++w->short_files;
+                padding = 1;
+            }
+            memset(buffer, 0, want);
+            got = want;
+        }
+        result = nab_write(w, buffer, got);
+        left -= got;
+    }
+    close(fd);
+    *raw_size += e.size;
+    return result;
+}
+
+static int backup_tree(NabWriter *w, const NandroidPart *part,
+                       uint64_t *raw_size) {
+    char path[PATH_MAX];
+    if (mount_part(part, path, sizeof(path))) return -1;
+
+    *raw_size = 0;
+    int result = backup_dir(w, path, "", raw_size);
+    if (result == 0) {
+        NabEntry end;
+        memset(&end, 0, sizeof(end));
+        result = nab_write(w, &end, sizeof(end));
+        *raw_size += sizeof(end);
+    }
+    unmount_part(part);
+    return result;
+}
+
+/* Rough size of a component, for the progress bar. */
+static long long estimate_size(const NandroidPart *part) {
+    if (part->type == NAB_STREAM_RAW) {
+        size_t total = 0;
+        const MtdPartition *mtd = get_root_mtd_partition(part->root);
+        if (mtd != NULL) mtd_partition_info(mtd, &total, NULL, NULL);
+        return total;
+    }
+    char path[PATH_MAX];
+    struct statfs sf;
+    long long used = 0;
+    if (mount_part(part, path, sizeof(path)) == 0 && statfs(path, &sf) == 0) {
+        used = (long long) (sf.f_blocks - sf.f_bfree) * sf.f_bsize;
+    }
+    return used;
+}
+
+static int write_index(NabWriter *w) {
+    NabIndexHeader ih;
+    ih.magic = NAB_INDEX_MAGIC;
+    ih.stream_count = w->stream_count;
+    ih.chunk_count = w->next_write;
+    ih.reserved = 0;
+
+    const void *chunks = w->store != NULL ?
+            (const void *) w->refs : (const void *) w->chunks;
+    size_t streams_size = w->stream_count * sizeof(NabStream);
+    size_t chunks_size = w->next_write * (w->store != NULL ?
+            sizeof(NabChunkRef) : sizeof(NabChunkEntry));
+    uLong crc = crc32(0L, Z_NULL, 0);
+    crc = crc32(crc, (const Bytef *) &ih, sizeof(ih));
+    crc = crc32(crc, (const Bytef *) w->streams, streams_size);
+    crc = crc32(crc, (const Bytef *) chunks, chunks_size);
+
+    NabTrailer t;
+    t.index_offset = w->offset;
+    t.index_size = sizeof(ih) + streams_size + chunks_size;
+    t.index_crc = crc;
+    t.magic = NAB_TRAILER_MAGIC;
+    t.reserved = 0;
+
+    if (write_all(w->fd, &ih, sizeof(ih)) ||
+        write_all(w->fd, w->streams, streams_size) ||
+        write_all(w->fd, chunks, chunks_size) ||
+        write_all(w->fd, &t, sizeof(t))) {
+        LOGE("Can't write backup index\n(%s)\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static int worker_count() {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1) n = 1;
+    if (n > NAB_MAX_WORKERS) n = NAB_MAX_WORKERS;
+    return n;
+}
+
+/* Write the archive (or, given a chunk store, the manifest) to the open
+ * file 'fd'.  Returns 0 on success.
+ */
+static int write_archive(int fd, const char *store, int components) {
+    NabWriter w;
+    memset(&w, 0, sizeof(w));
+    pthread_mutex_init(&w.lock, NULL);
+    pthread_cond_init(&w.cond, NULL);
+    w.fd = fd;
+    w.store = store;
+
+    int i;
+    int result = 0;
+    if (store != NULL) {
+        init_gear_table();
+        if (mkdir(store, 0777) != 0 && errno != EEXIST) {
+            LOGE("Can't create %s\n(%s)\n", store, strerror(errno));
+            result = -1;
+        } else if (load_store(store, &w.known) != 0) {
+            result = -1;
+        }
+    }
+    for (i = 0; i < NAB_SLOTS; ++i) {
+        w.jobs[i].raw = (char *) malloc(NAB_CHUNK_SIZE);
+        w.jobs[i].data = (char *) malloc(compressBound(NAB_CHUNK_SIZE));
+        if (w.jobs[i].raw == NULL || w.jobs[i].data == NULL) result = -1;
+    }
+
+    unsigned int p;
+    for (p = 0; p < PART_COUNT; ++p) {
+        if (components & PARTS[p].component) {
+            w.total_bytes += estimate_size(&PARTS[p]);
+        }
+    }
+
+    NabHeader header;
+    header.magic = store != NULL ? NAB_MANIFEST_MAGIC : NAB_MAGIC;
+    header.version = NAB_VERSION;
+    header.chunk_size = NAB_CHUNK_SIZE;
+    header.reserved = 0;
+    if (result == 0 && write_all(fd, &header, sizeof(header))) {
+        LOGE("Can't write backup\n(%s)\n", strerror(errno));
+        result = -1;
+    }
+    w.offset = sizeof(header);
+
+    int workers = worker_count();
+    pthread_t threads[NAB_MAX_WORKERS + 1];
+    int started = 0;
+    if (result == 0) {
+        if (pthread_create(&threads[started], NULL, write_thread, &w) == 0) {
+            ++started;
+        }
+        for (i = 0; i < workers; ++i) {
+            if (pthread_create(&threads[started], NULL,
+                               compress_thread, &w) == 0) {
+                ++started;
+            }
+        }
+        if (started < 2) result = -1;
+    }
+
+    for (p = 0; result == 0 && p < PART_COUNT; ++p) {
+        const NandroidPart *part = &PARTS[p];
+        if (!(components & part->component)) continue;
+
+        ui_print("Backing up %s...\n", part->name);
+        uint64_t raw_size = 0;
+        begin_stream(&w, part);
+        if (part->type == NAB_STREAM_RAW) {
+            result = backup_raw(&w, part, &raw_size);
+        } else {
+            result = backup_tree(&w, part, &raw_size);
+        }
+        if (result == 0) result = end_stream(&w, raw_size);
+    }
+
+    pthread_mutex_lock(&w.lock);
+    w.finished = 1;
+    if (result != 0) w.failed = 1;
+    pthread_cond_broadcast(&w.cond);
+    pthread_mutex_unlock(&w.lock);
+    for (i = 0; i < started; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+
+    if (w.failed) result = -1;
+    if (result == 0) result = write_index(&w);
+    if (result == 0 && store != NULL) {
+        ui_print("%lld new bytes in chunk store\n", w.new_bytes);
+    }
+    if (result == 0 && w.short_files > 0) {
+        ui_print("Warning: %d file(s) couldn't be read in full\n"
+                 "and were padded with zeros; see the log\n", w.short_files);
+    }
+
+    for (i = 0; i < NAB_SLOTS; ++i) {
+        free(w.jobs[i].raw);
+        free(w.jobs[i].data);
+    }
+    free(w.chunks);
+    free(w.refs);
+    digest_set_free(&w.known);
+    pthread_cond_destroy(&w.cond);
+    pthread_mutex_destroy(&w.lock);
+    return result;
+}
+
+int nandroid_backup(const char *root_path, int components) {
+    if (ensure_root_path_mounted(root_path) != 0) {
+        LOGE("Can't mount %s\n", root_path);
+        return -1;
+    }
+    char dir[PATH_MAX];
+    if (translate_root_path(root_path, dir, sizeof(dir)) == NULL) {
+        LOGE("Bad path %s\n", root_path);
+        return -1;
+    }
+
+    char device_id[PROPERTY_VALUE_MAX];
+    property_get("ro.serialno", device_id, "unknown");
+    strlcat(dir, "/", sizeof(dir));
+    strlcat(dir, device_id, sizeof(dir));
+    if (dirCreateHierarchy(dir, 0777, NULL, false) != 0) {
+        LOGE("Can't create %s\n(%s)\n", dir, strerror(errno));
+        return -1;
+    }
+
+    char name[32];
+    time_t now = time(NULL);
+    strftime(name, sizeof(name), "%Y%m%d-%H%M%S", localtime(&now));
+
+    int incremental = components & NANDROID_INCREMENTAL;
+    const char *ext = incremental ?
+            NANDROID_MANIFEST_EXTENSION : NANDROID_EXTENSION;
+    char path[PATH_MAX];
+    char temp[PATH_MAX];
+    char store[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s%s", dir, name, ext);
+    snprintf(temp, sizeof(temp), "%s.tmp", path);
+    snprintf(store, sizeof(store), "%s/%s", dir, NAB_STORE_NAME);
+
+    int fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        LOGE("Can't create %s\n(%s)\n", temp, strerror(errno));
+        return -1;
+    }
+
+    ui_show_progress(1.0, 0);
+    int result = write_archive(fd, incremental ? store : NULL, components);
+    // The manifest must not outlive the chunks it names: get every new
+    // chunk (and its rename) onto the card before the manifest's rename.
+    if (incremental && result == 0) sync();
+    if (fsync(fd) != 0 || close(fd) != 0) result = -1;
+    if (result == 0 && rename(temp, path) != 0) {
+        LOGE("Can't rename %s\n(%s)\n", temp, strerror(errno));
+        result = -1;
+    }
+    if (result != 0) unlink(temp);
+    ui_reset_progress();
+
+    if (result == 0) ui_print("Saved %s%s\n", name, ext);
+    return result;
+}
+
+// -----------------------------------------------------------------
+//   restore
+// -----------------------------------------------------------------
+
+/* Restore runs a thread per stream, each writing its own partition,
+ * fed by a shared pool of threads that read, inflate and check chunks
+ * up to RESTORE_AHEAD chunks ahead of each writer.  Partitions are
+ * formatted and mounted before any of this starts, since roots.c and
+ * mtdutils keep global state that isn't safe to share.
+ */
+#define RESTORE_AHEAD 4
+
+typedef struct {
+    char *raw;
+    size_t raw_len;
+    int ready;
+    int error;
+} NabSlot;
+
+typedef struct NabRestore NabRestore;
+
+typedef struct {
+    NabRestore *restore;
+    const NandroidPart *part;
+    const NabStream *stream;
+    const MtdPartition *mtd;    /* raw streams */
+    char base[PATH_MAX];        /* tree streams: where it's mounted */
+
+    /* Protected by restore->lock.  Chunk n is decoded into
+     * slots[n % RESTORE_AHEAD]; the writer holds chunk next_take while
+     * it is being consumed.
+     */
+    NabSlot slots[RESTORE_AHEAD];
+    unsigned int next_decode;
+    unsigned int next_take;
+    unsigned int end;
+    int holding;
+
+    /* Owned by the stream's writer thread. */
+    const char *raw;
+    size_t raw_len;
+    size_t raw_pos;
+    int result;
+} NabReader;
+
+struct NabRestore {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;        /* broadcast on every state change */
+    int fd;
+    const NabChunkEntry *chunks;
+    const NabChunkRef *refs;    /* instead of 'chunks', for a manifest */
+    const char *store;
+    NabReader *readers;
+    int reader_count;
+    int rotor;                  /* where decoders next look for work */
+    int active;                 /* writers still running */
+    int failed;
+    long long done_bytes;
+    long long total_bytes;
+};
+
+/* Read chunk 'n' of a manifest from the store into 'raw'. */
+static int decode_stored_chunk(NabRestore *rs, unsigned int n,
+                               char *raw, size_t *raw_len, char *data) {
+    const NabChunkRef *ref = &rs->refs[n];
+    char path[PATH_MAX];
+    chunk_path(rs->store, ref->digest, path, sizeof(path));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        LOGE("Missing chunk %s\n", path);
+        return -1;
+    }
+    NabChunkHeader header;
+    int ok = read(fd, &header, sizeof(header)) == sizeof(header) &&
+        header.magic == NAB_CHUNK_MAGIC &&
+        header.raw_len == ref->raw_len && header.raw_len <= NAB_CHUNK_SIZE &&
+        header.data_len <= compressBound(NAB_CHUNK_SIZE);
+    char *src = (header.flags & NAB_CHUNK_DEFLATED) ? data : raw;
+    ok = ok && read(fd, src, header.data_len) == (ssize_t) header.data_len;
+    close(fd);
+    if (ok && (header.flags & NAB_CHUNK_DEFLATED)) {
+        uLongf len = NAB_CHUNK_SIZE;
+        ok = uncompress((Bytef *) raw, &len, (const Bytef *) data,
+                        header.data_len) == Z_OK && len == header.raw_len;
+    }
+    if (ok) {
+        SHA_CTX sha;
+        SHA_init(&sha);
+        SHA_update(&sha, raw, header.raw_len);
+        ok = memcmp(SHA_final(&sha), ref->digest, SHA_DIGEST_SIZE) == 0;
+    }
+    if (!ok) {
+        LOGE("Chunk %s is damaged\n", path);
+        return -1;
+    }
+    *raw_len = header.raw_len;
+    return 0;
+}
+
+/* Read chunk 'n' into 'raw', using 'data' as scratch space. */
+static int decode_chunk(NabRestore *rs, unsigned int n,
+                        char *raw, size_t *raw_len, char *data) {
+    if (rs->refs != NULL) {
+        return decode_stored_chunk(rs, n, raw, raw_len, data);
+    }
+
+    const NabChunkEntry *c = &rs->chunks[n];
+    if (c->raw_len > NAB_CHUNK_SIZE ||
+        c->data_len > compressBound(NAB_CHUNK_SIZE)) {
+        LOGE("Backup index is corrupt\n");
+        return -1;
+    }
+    char *src = (c->flags & NAB_CHUNK_DEFLATED) ? data : raw;
+    if (pread(rs->fd, src, c->data_len, c->offset) != (ssize_t) c->data_len) {
+        LOGE("Can't read backup\n(%s)\n", strerror(errno));
+        return -1;
+    }
+    if (c->flags & NAB_CHUNK_DEFLATED) {
+        uLongf len = NAB_CHUNK_SIZE;
+        if (uncompress((Bytef *) raw, &len, (const Bytef *) data,
+                       c->data_len) != Z_OK || len != c->raw_len) {
+            LOGE("Backup chunk %u is damaged\n", n);
+            return -1;
+        }
+    }
+    if (crc32(crc32(0L, Z_NULL, 0), (const Bytef *) raw, c->raw_len) !=
+        c->crc) {
+        LOGE("Backup chunk %u fails its checksum\n", n);
+        return -1;
+    }
+    *raw_len = c->raw_len;
+    return 0;
+}
+
+static void *decode_thread(void *cookie) {
+    NabRestore *rs = (NabRestore *) cookie;
+    char *data = (char *) malloc(compressBound(NAB_CHUNK_SIZE));
+
+    pthread_mutex_lock(&rs->lock);
+    if (data == NULL) rs->failed = 1;
+    while (!rs->failed && rs->active > 0) {
+        // Take the next chunk of whichever stream, in turn, has room
+        // for one, so no partition's writer starves the others.
+        NabReader *r = NULL;
+        int i;
+        for (i = 0; i < rs->reader_count; ++i) {
+            int k = (rs->rotor + i) % rs->reader_count;
+            NabReader *c = &rs->readers[k];
+            if (c->next_decode < c->end &&
+                c->next_decode - c->next_take < RESTORE_AHEAD) {
+                r = c;
+                rs->rotor = k + 1;
+                break;
+            }
+        }
+        if (r == NULL) {
+            pthread_cond_wait(&rs->cond, &rs->lock);
+            continue;
+        }
+
+        unsigned int n = r->next_decode++;
+        NabSlot *slot = &r->slots[n % RESTORE_AHEAD];
+        pthread_mutex_unlock(&rs->lock);
+
+        size_t raw_len = 0;
+        int error = decode_chunk(rs, n, slot->raw, &raw_len, data);
+
+        pthread_mutex_lock(&rs->lock);
+        slot->raw_len = raw_len;
+        slot->error = error;
+        slot->ready = 1;
+        pthread_cond_broadcast(&rs->cond);
+    }
+    pthread_mutex_unlock(&rs->lock);
+    free(data);
+    return NULL;
+}
+
+/* Called with the lock held: give back the chunk the writer was using. */
+static void release_chunk(NabReader *r) {
+    if (r->holding) {
+        r->slots[r->next_take % RESTORE_AHEAD].ready = 0;
+        ++r->next_take;
+        r->holding = 0;
+        pthread_cond_broadcast(&r->restore->cond);
+    }
+}
+
+static int load_chunk(NabReader *r) {
+    NabRestore *rs = r->restore;
+    pthread_mutex_lock(&rs->lock);
+    release_chunk(r);
+    if (r->next_take >= r->end) {
+        pthread_mutex_unlock(&rs->lock);
+        LOGE("%s backup is truncated\n", r->part->name);
+        return -1;
+    }
+    NabSlot *slot = &r->slots[r->next_take % RESTORE_AHEAD];
+    while (!slot->ready && !rs->failed) {
+        pthread_cond_wait(&rs->cond, &rs->lock);
+    }
+    if (rs->failed || slot->error) {
+        rs->failed = 1;
+        pthread_cond_broadcast(&rs->cond);
+        pthread_mutex_unlock(&rs->lock);
+        return -1;
+    }
+    r->holding = 1;
+    rs->done_bytes += slot->raw_len;
+    float fraction = rs->total_bytes > 0 ?
+            (float) rs->done_bytes / rs->total_bytes : 0;
+    pthread_mutex_unlock(&rs->lock);
+
+    ui_set_progress(fraction > 1.0 ? 1.0 : fraction);
+    r->raw = slot->raw;
+    r->raw_len = slot->raw_len;
+    r->raw_pos = 0;
+    return 0;
+}
+
+static int nab_read(NabReader *r, void *data, size_t len) {
+    char *p = (char *) data;
+    while (len > 0) {
+        if (r->raw_pos == r->raw_len && load_chunk(r)) return -1;
+        size_t copy = r->raw_len - r->raw_pos;
+        if (copy > len) copy = len;
+        memcpy(p, r->raw + r->raw_pos, copy);
+        r->raw_pos += copy;
+        p += copy;
+        len -= copy;
+    }
+    return 0;
+}
+
+static int restore_raw(NabReader *r) {
+    MtdWriteContext *out = mtd_write_partition(r->mtd);
+    if (out == NULL) {
+        LOGE("Can't write %s\n(%s)\n", r->part->root, strerror(errno));
+        return -1;
+    }
+
+    int result = 0;
+    uint64_t size = r->stream->raw_size;
+    while (result == 0 && size > 0) {
+        if (r->raw_pos == r->raw_len && load_chunk(r)) {
+            result = -1;
+            break;
+        }
+        size_t len = r->raw_len - r->raw_pos;
+        if (len > size) len = size;
+        if (mtd_write_data(out, r->raw + r->raw_pos, len) != (ssize_t) len) {
+            LOGE("Can't write %s\n(%s)\n", r->part->root, strerror(errno));
+            result = -1;
+        }
+        r->raw_pos += len;
+        size -= len;
+    }
+    if (result == 0 && mtd_erase_blocks(out, -1) == (off_t) -1) {
+        LOGE("Can't finish %s\n(%s)\n", r->part->root, strerror(errno));
+        result = -1;
+    }
+    if (mtd_write_close(out) != 0) result = -1;
+    return result;
+}
+
+/* Reject paths that would land outside the mount point. */
+static int safe_path(const char *rel) {
+    if (rel[0] == '\0' || rel[0] == '/') return 0;
+    const char *p = rel;
+    while (p != NULL) {
+        if (strncmp(p, "..", 2) == 0 && (p[2] == '/' || p[2] == '\0')) {
+            return 0;
+        }
+        p = strchr(p, '/');
+        if (p != NULL) ++p;
+    }
+    return 1;
+}
+
+static int restore_file(NabReader *r, const char *path, const NabEntry *e) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        LOGE("Can't create %s\n(%s)\n", path, strerror(errno));
+        return -1;
+    }
+    int result = 0;
+    uint64_t left = e->size;
+    while (result == 0 && left > 0) {
+        if (r->raw_pos == r->raw_len && load_chunk(r)) {
+            result = -1;
+            break;
+        }
+        size_t len = r->raw_len - r->raw_pos;
+        if (len > left) len = left;
+        if (write_all(fd, r->raw + r->raw_pos, len)) {
+            LOGE("Can't write %s\n(%s)\n", path, strerror(errno));
+            result = -1;
+        }
+        r->raw_pos += len;
+        left -= len;
+    }
+    if (result == 0 && (fchown(fd, e->uid, e->gid) != 0 ||
+                        fchmod(fd, e->mode & 07777) != 0)) {
+        LOGW("Can't set permissions on %s\n", path);
+    }
+    if (close(fd) != 0) result = -1;
+
+    struct utimbuf times = { e->mtime, e->mtime };
+    utime(path, &times);
+    return result;
+}
+
+/* Get a tree part ready to be restored into: format it (or, for the
+ * ext partition, which nothing here can format, empty it) and mount it
+ * at r->base.
+ */
+static int prepare_tree(NabReader *r) {
+    const NandroidPart *part = r->part;
+    if (part->root != NULL && format_root_device(part->root) != 0) {
+        LOGE("Can't format %s\n", part->root);
+        return -1;
+    }
+    if (mount_part(part, r->base, sizeof(r->base))) return -1;
+    if (part->root == NULL) {
+        DIR *d = opendir(r->base);
+        struct dirent *de;
+        while (d != NULL && (de = readdir(d)) != NULL) {
+            if (strcmp(de->d_name, ".") == 0 ||
+                strcmp(de->d_name, "..") == 0 ||
+                strcmp(de->d_name, "lost+found") == 0) {
+                continue;
+            }
+            char path[PATH_MAX];
+            snprintf(path, sizeof(path), "%s/%s", r->base, de->d_name);
+            dirUnlinkHierarchy(path);
+        }
+        if (d != NULL) closedir(d);
+    }
+    return 0;
+}
+
+static int prepare_raw(NabReader *r) {
+    size_t total;
+    r->mtd = get_root_mtd_partition(r->part->root);
+    if (r->mtd == NULL ||
+        mtd_partition_info(r->mtd, &total, NULL, NULL) != 0) {
+        LOGE("Can't find %s\n", r->part->root);
+        return -1;
+    }
+    if (r->stream->raw_size > total) {
+        LOGE("%s backup is larger than the partition\n", r->part->name);
+        return -1;
+    }
+    return 0;
+}
+
+static int restore_tree(NabReader *r) {
+    const NandroidPart *part = r->part;
+    const char *base = r->base;
+    int result = 0;
+    for (;;) {
+        NabEntry e;
+        if (nab_read(r, &e, sizeof(e))) {
+            result = -1;
+            break;
+        }
+        if (e.mode == 0) break;
+
+        char rel[PATH_MAX];
+        char path[PATH_MAX];
+        if (e.path_len >= sizeof(rel) || nab_read(r, rel, e.path_len)) {
+            LOGE("Bad entry in %s backup\n", part->name);
+            result = -1;
+            break;
+        }
+        rel[e.path_len] = '\0';
+        if (!safe_path(rel)) {
+            LOGE("Bad path \"%s\" in %s backup\n", rel, part->name);
+            result = -1;
+            break;
+        }
+        snprintf(path, sizeof(path), "%s/%s", base, rel);
+
+        if (S_ISREG(e.mode)) {
+            result = restore_file(r, path, &e);
+        } else if (S_ISDIR(e.mode)) {
+            if (mkdir(path, e.mode & 07777) != 0 && errno != EEXIST) {
+                LOGE("Can't create %s\n(%s)\n", path, strerror(errno));
+                result = -1;
+            } else {
+                chown(path, e.uid, e.gid);
+                chmod(path, e.mode & 07777);
+            }
+        } else if (S_ISLNK(e.mode)) {
+            char target[PATH_MAX];
+            if (e.size >= sizeof(target) || nab_read(r, target, e.size)) {
+                result = -1;
+            } else {
+                target[e.size] = '\0';
+                unlink(path);
+                if (symlink(target, path) != 0) {
+                    LOGE("Can't link %s\n(%s)\n", path, strerror(errno));
+                    result = -1;
+                } else {
+                    lchown(path, e.uid, e.gid);
+                }
+            }
+        } else {
+            if (mknod(path, e.mode, e.rdev) != 0) {
+                LOGW("Can't create %s (%s)\n", path, strerror(errno));
+            } else {
+                chown(path, e.uid, e.gid);
+            }
+        }
+        if (result != 0) break;
+    }
+    return result;
+}
+
+static void *restore_thread(void *cookie) {
+    NabReader *r = (NabReader *) cookie;
+    if (r->part->type == NAB_STREAM_RAW) {
+        r->result = restore_raw(r);
+    } else {
+        r->result = restore_tree(r);
+    }
+
+    NabRestore *rs = r->restore;
+    pthread_mutex_lock(&rs->lock);
+    release_chunk(r);
+    r->end = r->next_decode;    // nothing more to decode for this stream
+    if (r->result != 0) rs->failed = 1;
+    --rs->active;
+    pthread_cond_broadcast(&rs->cond);
+    pthread_mutex_unlock(&rs->lock);
+    return NULL;
+}
+
+/* Read and check the index.  Returns a malloc'd copy, or NULL.  Sets
+ * *manifest if the file is an incremental backup's manifest.
+ */
+static char *read_index(int fd, NabIndexHeader **ih, int *manifest) {
+    NabHeader header;
+    NabTrailer t;
+    off_t size = lseek(fd, 0, SEEK_END);
+    if (size < (off_t) (sizeof(header) + sizeof(NabIndexHeader) + sizeof(t)) ||
+        pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+        pread(fd, &t, sizeof(t), size - sizeof(t)) != sizeof(t) ||
+        (header.magic != NAB_MAGIC && header.magic != NAB_MANIFEST_MAGIC) ||
+        t.magic != NAB_TRAILER_MAGIC) {
+        LOGE("Not a nandroid backup\n");
+        return NULL;
+    }
+    if (header.version != NAB_VERSION || header.chunk_size != NAB_CHUNK_SIZE) {
+        LOGE("Unsupported backup version %u\n", header.version);
+        return NULL;
+    }
+    if (t.index_size < sizeof(NabIndexHeader) ||
+        t.index_offset + t.index_size + sizeof(t) != (uint64_t) size) {
+        LOGE("Backup index is corrupt\n");
+        return NULL;
+    }
+
+    *manifest = header.magic == NAB_MANIFEST_MAGIC;
+    size_t entry_size = *manifest ? sizeof(NabChunkRef) : sizeof(NabChunkEntry);
+    char *index = (char *) malloc(t.index_size);
+    if (index == NULL ||
+        pread(fd, index, t.index_size, t.index_offset) != (ssize_t) t.index_size ||
+        crc32(crc32(0L, Z_NULL, 0), (const Bytef *) index, t.index_size) !=
+                t.index_crc) {
+        LOGE("Backup index is corrupt\n");
+        free(index);
+        return NULL;
+    }
+
+    *ih = (NabIndexHeader *) index;
+    if ((*ih)->magic != NAB_INDEX_MAGIC ||
+        (*ih)->stream_count > NAB_MAX_STREAMS ||
+        t.index_size != sizeof(NabIndexHeader) +
+                (*ih)->stream_count * sizeof(NabStream) +
+                (uint64_t) (*ih)->chunk_count * entry_size) {
+        LOGE("Backup index is corrupt\n");
+        free(index);
+        return NULL;
+    }
+    return index;
+}
+
+int nandroid_restore(const char *root_path, int components) {
+    if (ensure_root_path_mounted(root_path) != 0) {
+        LOGE("Can't mount %s\n", root_path);
+        return -1;
+    }
+    char path[PATH_MAX];
+    if (translate_root_path(root_path, path, sizeof(path)) == NULL) {
+        LOGE("Bad path %s\n", root_path);
+        return -1;
+    }
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        LOGE("Can't open %s\n(%s)\n", path, strerror(errno));
+        return -1;
+    }
+
+    NabIndexHeader *ih;
+    int manifest;
+    char *index = read_index(fd, &ih, &manifest);
+    if (index == NULL) {
+        close(fd);
+        return -1;
+    }
+    const NabStream *streams = (const NabStream *) (ih + 1);
+
+    // A manifest's chunks are in the store next to it.
+    char store[PATH_MAX];
+    strlcpy(store, path, sizeof(store));
+    char *slash = strrchr(store, '/');
+    if (slash != NULL) *slash = '\0';
+    strlcat(store, "/" NAB_STORE_NAME, sizeof(store));
+
+    NabRestore rs;
+    memset(&rs, 0, sizeof(rs));
+    pthread_mutex_init(&rs.lock, NULL);
+    pthread_cond_init(&rs.cond, NULL);
+    rs.fd = fd;
+    if (manifest) {
+        rs.refs = (const NabChunkRef *) (streams + ih->stream_count);
+        rs.store = store;
+    } else {
+        rs.chunks = (const NabChunkEntry *) (streams + ih->stream_count);
+    }
+    rs.readers = (NabReader *) calloc(NAB_MAX_STREAMS, sizeof(NabReader));
+
+    // Match each stream to a part up front, both to size the progress
+    // bar and to refuse an archive we only partly understand.
+    unsigned int s;
+    int result = rs.readers == NULL ? -1 : 0;
+    for (s = 0; result == 0 && s < ih->stream_count; ++s) {
+        const NabStream *st = &streams[s];
+        if (st->first_chunk + st->chunk_count > ih->chunk_count ||
+            st->first_chunk + st->chunk_count < st->first_chunk) {
+            LOGE("Backup index is corrupt\n");
+            result = -1;
+            break;
+        }
+        const NandroidPart *part = NULL;
+        unsigned int p;
+        for (p = 0; p < PART_COUNT; ++p) {
+            if (strncmp(PARTS[p].name, st->name, sizeof(st->name)) == 0 &&
+                PARTS[p].type == (int) st->type) {
+                part = &PARTS[p];
+            }
+        }
+        if (part == NULL) {
+            LOGW("Skipping unknown backup stream \"%.16s\"\n", st->name);
+            continue;
+        }
+        if (!(components & part->component)) continue;
+
+        NabReader *r = &rs.readers[rs.reader_count++];
+        r->restore = &rs;
+        r->part = part;
+        r->stream = st;
+        r->next_decode = r->next_take = st->first_chunk;
+        r->end = st->first_chunk + st->chunk_count;
+        int i;
+        for (i = 0; i < RESTORE_AHEAD; ++i) {
+            r->slots[i].raw = (char *) malloc(NAB_CHUNK_SIZE);
+            if (r->slots[i].raw == NULL) result = -1;
+        }
+        rs.total_bytes += st->raw_size;
+    }
+
+    // Formatting and mounting use global state in roots.c and
+    // mtdutils, so get every partition ready before starting threads.
+    int i;
+    for (i = 0; result == 0 && i < rs.reader_count; ++i) {
+        NabReader *r = &rs.readers[i];
+        ui_print("Restoring %s...\n", r->part->name);
+        if (r->part->type == NAB_STREAM_RAW) {
+            result = prepare_raw(r);
+        } else {
+            result = prepare_tree(r);
+        }
+    }
+
+    ui_show_progress(1.0, 0);
+    pthread_t threads[NAB_MAX_STREAMS + NAB_MAX_WORKERS];
+    int started = 0;
+    if (result == 0) {
+        rs.active = rs.reader_count;
+        for (i = 0; i < rs.reader_count; ++i) {
+            if (pthread_create(&threads[started], NULL, restore_thread,
+                               &rs.readers[i]) != 0) {
+                // Nobody will consume this stream; give up on all of them.
+                pthread_mutex_lock(&rs.lock);
+                rs.failed = 1;
+                --rs.active;
+                pthread_mutex_unlock(&rs.lock);
+            } else {
+                ++started;
+            }
+        }
+        int decoders = 0;
+        int workers = worker_count();
+        for (i = 0; i < workers; ++i) {
+            if (pthread_create(&threads[started], NULL, decode_thread,
+                               &rs) == 0) {
+                ++started;
+                ++decoders;
+            }
+        }
+        if (decoders == 0) {
+            pthread_mutex_lock(&rs.lock);
+            rs.failed = 1;
+            pthread_cond_broadcast(&rs.cond);
+            pthread_mutex_unlock(&rs.lock);
+        }
+    }
+    for (i = 0; i < started; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    if (rs.failed) result = -1;
+    ui_reset_progress();
+
+    sync();
+    for (i = 0; i < rs.reader_count; ++i) {
+        NabReader *r = &rs.readers[i];
+        if (r->part->type == NAB_STREAM_TREE) unmount_part(r->part);
+        int j;
+        for (j = 0; j < RESTORE_AHEAD; ++j) {
+            free(r->slots[j].raw);
+        }
+    }
+    free(rs.readers);
+    pthread_cond_destroy(&rs.cond);
+    pthread_mutex_destroy(&rs.lock);
+    free(index);
+    close(fd);
+    return result;
+}
@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2009 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _RECOVERY_NANDROID_H
+#define _RECOVERY_NANDROID_H
+
+/* Parts of the device a backup can contain.  Raw partitions (boot) are
+ * copied block for block; filesystems are walked and stored file by
+ * file, so they can be restored onto a freshly formatted partition.
+ */
+#define NANDROID_BOOT    0x01
+#define NANDROID_SYSTEM  0x02
+#define NANDROID_DATA    0x04
+#define NANDROID_CACHE   0x08
+#define NANDROID_EXT     0x10   /* ext2/3/4 partition on the sdcard */
+
+#define NANDROID_DEFAULT (NANDROID_BOOT | NANDROID_SYSTEM | NANDROID_DATA)
+#define NANDROID_ALL     0x1f
+
+/* Option for nandroid_backup(): split the data at content-defined
+ * boundaries and keep each distinct chunk once, in a store shared by
+ * the device's incremental backups, so that later backups only write
+ * what changed.  The backup itself is then just a manifest.
+ */
+#define NANDROID_INCREMENTAL 0x100
+
+/* Backups are named <time>.nab (or <time>.nai for incremental ones)
+ * and kept in a folder per device.
+ */
+#define NANDROID_EXTENSION ".nab"
+#define NANDROID_MANIFEST_EXTENSION ".nai"
+
+/* Back up the given components into a new archive under
+ * <root_path>/<device-id>/ (root_path is like "SDCARD:nandroid/").
+ * Shows progress while it runs.  Returns 0 on success; on failure no
+ * partial archive is left behind.
+ */
+int nandroid_backup(const char *root_path, int components);
+
+/* Restore every component in the archive at root_path that is also
+ * in 'components'.  Each filesystem is formatted first, then all the
+ * partitions are written at once.  The archive is checked as it is
+ * read, and a damaged chunk stops the whole restore.  Returns 0 on
+ * success.
+ */
+int nandroid_restore(const char *root_path, int components);
+
+/* Returns true if the name looks like an archive or manifest made by
+ * nandroid_backup(), rather than an older nandroid-mobile.sh folder.
+ */
+int is_nandroid_archive(const char *name);
+
+#endif
@@ -20,6 +20,7 @@
 #include <getopt.h>
 #include <limits.h>
 #include <linux/input.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <dirent.h>
 #include <stdlib.h>
@@ -35,27 +36,31 @@
 #include "commands.h"
 #include "common.h"
 #include "cutils/properties.h"
+#include "dirscan.h"
 #include "firmware.h"
 #include "install.h"
+#include "logger.h"
 #include "minui/minui.h"
 #include "minzip/DirUtil.h"
+#include "nandroid.h"
 #include "roots.h"
+#include "trace/trace.h"
 
 static const struct option OPTIONS[] = {
   { "send_intent", required_argument, NULL, 's' },
   { "update_package", required_argument, NULL, 'u' },
   { "wipe_data", no_argument, NULL, 'w' },
   { "wipe_cache", no_argument, NULL, 'c' },
+  { "profile", no_argument, NULL, 'f' },
 };
 
 static const char *COMMAND_FILE = "CACHE:recovery/command";
 static const char *INTENT_FILE = "CACHE:recovery/intent";
 static const char *LOG_FILE = "CACHE:recovery/log";
+static const char *TRACE_FILE = "CACHE:recovery/trace.json";
 static const char *SDCARD_PACKAGE_FILE = "SDCARD:update.zip";
 static const char *SDCARD_PATH = "SDCARD:";
 static const char *NANDROID_PATH = "SDCARD:/nandroid/";
-#define SDCARD_PATH_LENGTH 7
-#define NANDROID_PATH_LENGTH 17
 static const char *TEMPORARY_LOG_FILE = "/tmp/recovery.log";
 
 
@@ -68,8 +73,11 @@ static const char *TEMPORARY_LOG_FILE = "/tmp/recovery.log";
  * The arguments which may be supplied in the recovery.command file:
  *   --send_intent=anystring - write the text out to recovery.intent
  *   --update_package=root:path - verify install an OTA package file
+ *       (may be given more than once; all are verified, then each
+ *       is installed in order)
  *   --wipe_data - erase user data (and cache), then reboot
  *   --wipe_cache - wipe cache (but not user data), then reboot
+ *   --profile - write per-command script timings to /tmp/recovery.profile
  *
  * After completing, we remove /cache/recovery/command and reboot.
  * Arguments may also be supplied in the bootloader control block (BCB).
@@ -104,7 +112,9 @@ static const char *TEMPORARY_LOG_FILE = "/tmp/recovery.log";
  *    ** if the update contained radio/hboot firmware **:
  *    8a. m_i_f_u() writes BCB with "boot-recovery" and "--wipe_cache"
  *        -- after this, rebooting will reformat cache & restart main system --
- *    8b. m_i_f_u() writes firmware image into raw cache partition
+ *    8b. m_i_f_u() writes firmware image into raw cache partition,
+ *        reading it from the package again (unless the package was on
+ *        cache itself, in which case step 5 kept a copy in RAM)
  *    8c. m_i_f_u() writes BCB with "update-radio/hboot" and "--wipe_cache"
  *        -- after this, rebooting will attempt to reinstall firmware --
  *    8d. bootloader tries to flash firmware
@@ -241,20 +251,22 @@ finish_recovery(const char *send_intent)
     if (log == NULL) {
         LOGE("Can't open %s\n", LOG_FILE);
     } else {
-        FILE *tmplog = fopen(TEMPORARY_LOG_FILE, "r");
-        if (tmplog == NULL) {
-            LOGE("Can't open %s\n", TEMPORARY_LOG_FILE);
-        } else {
-            static long tmplog_offset = 0;
-            fseek(tmplog, tmplog_offset, SEEK_SET);  // Since last write
-            char buf[4096];
-            while (fgets(buf, sizeof(buf), tmplog)) fputs(buf, log);
-            tmplog_offset = ftell(tmplog);
-            check_and_fclose(tmplog, TEMPORARY_LOG_FILE);
+        static off_t tmplog_offset = 0;  // Since last write
+        fflush(log);
+        if (log_copy(fileno(log), &tmplog_offset) != 0) {
+            LOGE("Can't copy %s\n", TEMPORARY_LOG_FILE);
         }
         check_and_fclose(log, LOG_FILE);
     }
 
+    // And the timings, for looking at in about:tracing.
+    char trace_path[PATH_MAX];
+    if (ensure_root_path_mounted(TRACE_FILE) != 0 ||
+        translate_root_path(TRACE_FILE, trace_path, sizeof(trace_path)) == NULL ||
+        trace_write(trace_path) != 0) {
+        LOGW("Can't write %s\n", TRACE_FILE);
+    }
+
     // Reset the bootloader message to revert to a normal main system boot.
     struct bootloader_message boot;
     memset(&boot, 0, sizeof(boot));
@@ -278,6 +290,7 @@ test_amend()
 {
     extern int test_symtab(void);
     extern int test_cmd_fn(void);
+    extern int test_intern(void);
     int ret;
     LOGD("Testing symtab...\n");
     ret = test_symtab();
@@ -285,6 +298,9 @@ test_amend()
     LOGD("Testing cmd_fn...\n");
     ret = test_cmd_fn();
     LOGD("  returned %d\n", ret);
+    LOGD("Testing intern...\n");
+    ret = test_intern();
+    LOGD("  returned %d\n", ret);
 }
 #endif  // TEST_AMEND
 
@@ -294,7 +310,10 @@ erase_root(const char *root)
     ui_set_background(BACKGROUND_ICON_INSTALLING);
     ui_show_indeterminate_progress();
     ui_print("Formatting %s...\n", root);
-    return format_root_device(root);
+    int span = trace_begin("erase_root", root);
+    int ret = format_root_device(root);
+    trace_end(span, 0);
+    return ret;
 }
 
 static void
@@ -331,6 +350,90 @@ run_script(char *str1,char *str2,char *str3,char *str4,char *str5,char *str6,cha
 		if (!ui_text_visible()) return;
 }
 
+/* The sdcard can take seconds to come up, so it is mounted and the
+ * directories the pickers show are read into the dirscan cache on a
+ * thread started right after ui_init().  Anything that uses the
+ * sdcard (or the dirscan cache) from a menu calls wait_for_sdcard()
+ * first; by the time someone has navigated to a picker it is normally
+ * long done.
+ */
+static pthread_t sdcard_thread;
+static int sdcard_thread_running = 0;
+
+static void *
+prescan_sdcard(void *cookie)
+{
+    char path[PATH_MAX];
+    // No card at all: don't complain about failing to mount it.
+    if (access("/dev/block/mmcblk0", F_OK) != 0) return NULL;
+    int span = trace_begin("prescan_sdcard", NULL);
+    if (ensure_root_path_mounted(SDCARD_PATH) != 0) {
+        trace_end(span, 0);
+        return NULL;
+    }
+    if (translate_root_path(SDCARD_PATH, path, sizeof(path)) != NULL) {
+        scan_directory(path, ".zip");
+    }
+    if (translate_root_path(NANDROID_PATH, path, sizeof(path)) != NULL &&
+            access(path, F_OK) == 0) {
+        const DirListing *folders = scan_directory(path, NULL);
+        int i;
+        // Leave a slot in the cache for the folder list itself.
+        for (i = 0; folders != NULL && i < folders->count &&
+                i < DIRSCAN_CACHE_SIZE - 2; ++i) {
+            // Name it the way choose_nandroid_folder() will, so that
+            // the cache entry matches.
+            char folder[PATH_MAX];
+            char folder_path[PATH_MAX];
+            snprintf(folder, sizeof(folder), "%s%s",
+                     NANDROID_PATH, folders->names[i]);
+            if (translate_root_path(folder, folder_path,
+                                    sizeof(folder_path)) != NULL) {
+                scan_directory(folder_path, NULL);
+            }
+        }
+    }
+    trace_end(span, 0);
+    return NULL;
+}
+
+static void
+start_sdcard_prescan()
+{
+    if (pthread_create(&sdcard_thread, NULL, prescan_sdcard, NULL) == 0) {
+        sdcard_thread_running = 1;
+    }
+}
+
+static void
+wait_for_sdcard()
+{
+    if (sdcard_thread_running) {
+        pthread_join(sdcard_thread, NULL);
+        sdcard_thread_running = 0;
+    }
+}
+
+static void
+run_nandroid_backup(const char *prompt, int components)
+{
+    ui_print(prompt);
+    ui_clear_key_queue();
+    ui_print("\nPress Trackball to confirm,");
+    ui_print("\nany other key to abort.\n");
+    int confirm = ui_wait_key();
+    if (confirm == BTN_MOUSE) {
+        ui_print("\nPerforming backup :\n");
+        if (nandroid_backup(NANDROID_PATH, components) != 0) {
+            ui_print("\nBackup failed!\n\n");
+        } else {
+            ui_print("\nBackup complete!\n\n");
+        }
+    } else {
+        ui_print("\nBackup aborted!\n\n");
+    }
+}
+
 static void
 choose_nandroid_file(const char *nandroid_folder)
 {
@@ -340,12 +443,7 @@ choose_nandroid_file(const char *nandroid_folder)
                                NULL };
 
     char path[PATH_MAX] = "";
-    DIR *dir;
-    struct dirent *de;
-    char **files;
     char **list;
-    int total = 0;
-    int i;
 
     if (ensure_root_path_mounted(nandroid_folder) != 0) {
         LOGE("Can't mount %s\n", nandroid_folder);
@@ -357,64 +455,15 @@ choose_nandroid_file(const char *nandroid_folder)
         return;
     }
 
-    dir = opendir(path);
-    if (dir == NULL) {
-        LOGE("Couldn't open directory %s", path);
+    const DirListing *listing = scan_directory(path, NULL);
+    if (listing == NULL) {
         return;
     }
-
-    /* count how many files we're looking at */
-    while ((de = readdir(dir)) != NULL) {
-        if (de->d_name[0] == '.') {
-            continue;
-        } else {
-            total++;
-        }
-    }
-
-    if (total==0) {
+    if (listing->count == 0) {
         LOGE("No nandroid-backup files found\n");
-    		if (closedir(dir) < 0) {
-		  LOGE("Failure closing directory %s", path);
-	          goto out;
-    		}
         return;
     }
-
-    /* allocate the array for the file list menu */
-    files = (char **) malloc((total + 1) * sizeof(*files));
-    files[total] = NULL;
-
-    list = (char **) malloc((total + 1) * sizeof(*files));
-    list[total] = NULL;
-
-    /* set it up for the second pass */
-    rewinddir(dir);
-
-    /* put the names in the array for the menu */
-    i = 0;
-    while ((de = readdir(dir)) != NULL) {
-        if (de->d_name[0] == '.') {
-            continue;
-        } else {
-
-            files[i] = (char *) malloc(strlen(nandroid_folder) + strlen(de->d_name) + 1);
-            strcpy(files[i], nandroid_folder);
-            strcat(files[i], de->d_name);
-
-            list[i] = (char *) malloc(strlen(de->d_name) + 1);
-            strcpy(list[i], de->d_name);
-
-            i++;
-
-        }
-    }
-
-    /* close directory handle */
-    if (closedir(dir) < 0) {
-        LOGE("Failure closing directory %s", path);
-        goto out;
-    }
+    list = listing->names;
 
     ui_start_menu(headers, list);
     int selected = 0;
@@ -449,8 +498,20 @@ choose_nandroid_file(const char *nandroid_folder)
             ui_print(" ?\nPress Trackball to confirm,");
             ui_print("\nany other key to abort.\n");
             int confirm_apply = ui_wait_key();
-            if (confirm_apply == BTN_MOUSE) {
-                      
+            if (confirm_apply == BTN_MOUSE &&
+                    is_nandroid_archive(list[chosen_item])) {
+                ui_print("\nRestoring :\n");
+                char archive[PATH_MAX];
+                snprintf(archive, sizeof(archive), "%s/%s",
+                         nandroid_folder, list[chosen_item]);
+                if (nandroid_restore(archive, NANDROID_ALL) != 0) {
+                    ui_print("\nRestore failed!\n\n");
+                } else {
+                    ui_print("\nRestore complete!\n\n");
+                }
+            } else if (confirm_apply == BTN_MOUSE) {
+                            // Backups made by older versions are folders
+                            // that only nandroid-mobile.sh understands.
                             ui_print("\nRestoring : ");
        		            char nandroid_command[200]="/sbin/nandroid-mobile.sh -r -e --norecovery --nomisc --nosplash1 --nosplash2 --defaultinput -s ";
 
@@ -486,15 +547,6 @@ choose_nandroid_file(const char *nandroid_folder)
             break;
         }
     }
-
-out:
-
-    for (i = 0; i < total; i++) {
-        free(files[i]);
-	free(list[i]);
-    }
-    free(files);
-    free(list);
 }
 
 
@@ -507,12 +559,7 @@ choose_nandroid_folder()
                                NULL };
 
     char path[PATH_MAX] = "";
-    DIR *dir;
-    struct dirent *de;
-    char **files;
     char **list;
-    int total = 0;
-    int i;
 
     if (ensure_root_path_mounted(NANDROID_PATH) != 0) {
         LOGE("Can't mount %s\n", NANDROID_PATH);
@@ -524,63 +571,15 @@ choose_nandroid_folder()
         return;
     }
 
-    dir = opendir(path);
-    if (dir == NULL) {
-        LOGE("Couldn't open directory %s", path);
+    const DirListing *listing = scan_directory(path, NULL);
+    if (listing == NULL) {
         return;
     }
-
-    /* count how many files we're looking at */
-    while ((de = readdir(dir)) != NULL) {
-        char *extension = strrchr(de->d_name, '.');
-        if (de->d_name[0] == '.') {
-            continue;
-        } else {
-            total++;
-        }
-    }
-
-    if (total==0) {
+    if (listing->count == 0) {
         LOGE("No Device-ID folder found\n");
-    		if (closedir(dir) < 0) {
-		  LOGE("Failure closing directory %s", path);
-	          goto out;
-    		}
         return;
     }
-
-    /* allocate the array for the file list menu */
-    files = (char **) malloc((total + 1) * sizeof(*files));
-    files[total] = NULL;
-
-    list = (char **) malloc((total + 1) * sizeof(*files));
-    list[total] = NULL;
-
-    /* set it up for the second pass */
-    rewinddir(dir);
-
-    /* put the names in the array for the menu */
-    i = 0;
-    while ((de = readdir(dir)) != NULL) {
-        if (de->d_name[0] == '.') {
-            continue;
-        } else {
-            files[i] = (char *) malloc(NANDROID_PATH_LENGTH + strlen(de->d_name) + 1);
-            strcpy(files[i], NANDROID_PATH);
-            strcat(files[i], de->d_name);
-
-            list[i] = (char *) malloc(strlen(de->d_name) + 1);
-            strcpy(list[i], de->d_name);
-
-            i++;
-        }
-    }
-
-    /* close directory handle */
-    if (closedir(dir) < 0) {
-        LOGE("Failure closing directory %s", path);
-        goto out;
-    }
+    list = listing->names;
 
     ui_start_menu(headers, list);
     int selected = 0;
@@ -605,20 +604,14 @@ choose_nandroid_folder()
         }
 
         if (chosen_item >= 0) {
-            choose_nandroid_file(files[chosen_item]);
+            char folder[PATH_MAX];
+            snprintf(folder, sizeof(folder), "%s%s",
+                     NANDROID_PATH, list[chosen_item]);
+            choose_nandroid_file(folder);
             if (!ui_text_visible()) break;
             break;
         }
     }
-
-out:
-
-    for (i = 0; i < total; i++) {
-        free(files[i]);
-        free(list[i]);
-    }
-    free(files);
-    free(list);
 }
 
 
@@ -627,17 +620,13 @@ static void
 choose_update_file()
 {
     static char* headers[] = { "Choose update ZIP file,",
+			       "VOL-UP to queue several,",
 			       "or press VOL-DOWN to return",
                                "",
                                NULL };
 
     char path[PATH_MAX] = "";
-    DIR *dir;
-    struct dirent *de;
-    char **files;
     char **list;
-    int total = 0;
-    int i;
 
     if (ensure_root_path_mounted(SDCARD_PATH) != 0) {
         LOGE("Can't mount %s\n", SDCARD_PATH);
@@ -649,67 +638,30 @@ choose_update_file()
         return;
     }
 
-    dir = opendir(path);
-    if (dir == NULL) {
-        LOGE("Couldn't open directory %s", path);
+    const DirListing *listing = scan_directory(path, ".zip");
+    if (listing == NULL) {
         return;
     }
-
-    /* count how many files we're looking at */
-    while ((de = readdir(dir)) != NULL) {
-        char *extension = strrchr(de->d_name, '.');
-        if (extension == NULL || de->d_name[0] == '.') {
-            continue;
-        } else if (!strcasecmp(extension, ".zip")) {
-            total++;
-        }
-    }
-
-    if (total==0) {
+    if (listing->count == 0) {
         LOGE("No zip files found\n");
-	    /* close directory handle */
-    		if (closedir(dir) < 0) {
-		  LOGE("Failure closing directory %s", path);
-	          goto out;
-    		}
         return;
     }
-
-    /* allocate the array for the file list menu */
-    files = (char **) malloc((total + 1) * sizeof(*files));
-    files[total] = NULL;
-
-    list = (char **) malloc((total + 1) * sizeof(*files));
-    list[total] = NULL;
-
-    /* set it up for the second pass */
-    rewinddir(dir);
-
-    /* put the names in the array for the menu */
-    i = 0;
-    while ((de = readdir(dir)) != NULL) {
-        char *extension = strrchr(de->d_name, '.');
-        if (extension == NULL || de->d_name[0] == '.') {
-            continue;
-        } else if (!strcasecmp(extension, ".zip")) {
-            files[i] = (char *) malloc(SDCARD_PATH_LENGTH + strlen(de->d_name) + 1);
-            strcpy(files[i], SDCARD_PATH);
-            strcat(files[i], de->d_name);
-
-            list[i] = (char *) malloc(strlen(de->d_name) + 1);
-            strcpy(list[i], de->d_name);
-
-            i++;
-        }
-    }
-
-    /* close directory handle */
-    if (closedir(dir) < 0) {
-        LOGE("Failure closing directory %s", path);
-        goto out;
+    list = listing->names;
+
+    // Queued files are shown with a "+ " in front.
+    int count = listing->count;
+    char *queued = (char *) calloc(count, 1);
+    char **shown = (char **) malloc((count + 1) * sizeof(*shown));
+    if (queued == NULL || shown == NULL) {
+        LOGE("Out of memory\n");
+        free(queued);
+        free(shown);
+        return;
     }
+    memcpy(shown, list, (count + 1) * sizeof(*shown));
+    int queued_count = 0;
 
-    ui_start_menu(headers, list);
+    ui_start_menu(headers, shown);
     int selected = 0;
     int chosen_item = -1;
 
@@ -727,10 +679,58 @@ choose_update_file()
         } else if ((key == KEY_UP) && visible) {
             --selected;
             selected = ui_menu_select(selected);
+        } else if ((key == KEY_VOLUMEUP) && visible) {
+            if (queued[selected]) {
+                free(shown[selected]);
+                shown[selected] = list[selected];
+                queued[selected] = 0;
+                --queued_count;
+            } else if (queued_count < MAX_QUEUED_PACKAGES &&
+                    asprintf(&shown[selected], "+ %s", list[selected]) >= 0) {
+                queued[selected] = 1;
+                ++queued_count;
+            }
+            ui_start_menu(headers, shown);
+            selected = ui_menu_select(selected);
         } else if ((key == BTN_MOUSE) && visible ) {
             chosen_item = selected;
         }
 
+        if (chosen_item >= 0 && queued_count > 0) {
+            ui_end_menu();
+
+            ui_print("\nInstall %d queued packages", queued_count);
+            ui_clear_key_queue();
+            ui_print(" ? \nPress Trackball to confirm,");
+            ui_print("\nany other key to abort.\n");
+            int confirm_apply = ui_wait_key();
+            if (confirm_apply == BTN_MOUSE) {
+                char packages[MAX_QUEUED_PACKAGES][PATH_MAX];
+                const char *package_list[MAX_QUEUED_PACKAGES];
+                int i, n = 0;
+                for (i = 0; i < count; ++i) {
+                    if (!queued[i]) continue;
+                    snprintf(packages[n], sizeof(packages[n]), "%s%s",
+                             SDCARD_PATH, list[i]);
+                    package_list[n] = packages[n];
+                    ++n;
+                }
+                int status = install_packages(package_list, n);
+                if (status != INSTALL_SUCCESS) {
+                    ui_set_background(BACKGROUND_ICON_ERROR);
+                    ui_print("\nInstallation aborted.\n");
+                } else if (firmware_update_pending()) {
+                    ui_print("\nReboot via vol-up+vol-down or menu\n"
+                             "to complete installation.\n");
+                } else {
+                    ui_print("\nInstall from sdcard complete.\n");
+                }
+            } else {
+                ui_print("\nInstallation aborted.\n");
+            }
+            break;
+        }
+
         if (chosen_item >= 0) {
             // turn off the menu, letting ui_print() to scroll output
             // on the screen.
@@ -744,7 +744,10 @@ choose_update_file()
             int confirm_apply = ui_wait_key();
             if (confirm_apply == BTN_MOUSE) {
                 ui_print("\nInstall from sdcard...\n");
-                int status = install_package(files[chosen_item]);
+                char package[PATH_MAX];
+                snprintf(package, sizeof(package), "%s%s",
+                         SDCARD_PATH, list[chosen_item]);
+                int status = install_package(package);
                 if (status != INSTALL_SUCCESS) {
                     ui_set_background(BACKGROUND_ICON_ERROR);
                     ui_print("\nInstallation aborted.\n");
@@ -766,14 +769,12 @@ choose_update_file()
         }
     }
 
-out:
-
-    for (i = 0; i < total; i++) {
-        free(files[i]);
-        free(list[i]);
+    int i;
+    for (i = 0; i < count; ++i) {
+        if (queued[i]) free(shown[i]);
     }
-    free(files);
-    free(list);
+    free(shown);
+    free(queued);
 }
 
 
@@ -938,14 +939,16 @@ show_menu_br()
 // these constants correspond to elements of the items[] list.
 #define ITEM_NANDROID_BCK  0
 #define ITEM_NANDROID_BCKEXT  1
-#define ITEM_NANDROID_RES  2
-#define ITEM_GOOG_BCK  3
-#define ITEM_GOOG_RES  4
+#define ITEM_NANDROID_BCKINC  2
+#define ITEM_NANDROID_RES  3
+#define ITEM_GOOG_BCK  4
+#define ITEM_GOOG_RES  5
 
 
 
     static char* items[] = { "- Nand backup",
 			     "- Nand + ext backup",
+			     "- Nand incremental backup",
 			     "- Nand restore",
 			     "- Backup Google proprietary system files",
                              "- Restore Google proprietary system files",
@@ -982,23 +985,18 @@ show_menu_br()
             switch (chosen_item) {
 
                 case ITEM_NANDROID_BCK:
-			run_script("\nCreate Nandroid backup?",
-				   "\nPerforming backup : ",
-				   "/sbin/nandroid-mobile.sh -b --norecovery --nomisc --nosplash1 --nosplash2 --defaultinput",
-				   "\nuNnable to execute nandroid-mobile.sh!\n(%s)\n",
-				   "\nError : Run 'nandroid-mobile.sh' via adb!\n",
-				   "\nBackup complete!\n\n",
-				   "\nBackup aborted!\n\n");
+			run_nandroid_backup("\nCreate Nandroid backup?",
+					    NANDROID_DEFAULT);
 			break;
 
                 case ITEM_NANDROID_BCKEXT:
-			run_script("\nCreate Nandroid + ext backup?",
-				   "\nPerforming backup : ",
-				   "/sbin/nandroid-mobile.sh -b -e --norecovery --nomisc --nosplash1 --nosplash2 --defaultinput",
-				   "\nuNnable to execute nandroid-mobile.sh!\n(%s)\n",
-				   "\nError : Run 'nandroid-mobile.sh' via adb!\n",
-				   "\nBackup complete!\n\n",
-				   "\nBackup aborted!\n\n");
+			run_nandroid_backup("\nCreate Nandroid + ext backup?",
+					    NANDROID_DEFAULT | NANDROID_EXT);
+			break;
+
+                case ITEM_NANDROID_BCKINC:
+			run_nandroid_backup("\nCreate incremental Nandroid backup?",
+					    NANDROID_DEFAULT | NANDROID_INCREMENTAL);
 			break;
 
                 case ITEM_NANDROID_RES:
@@ -1367,6 +1365,7 @@ prompt_and_wait()
             // turn off the menu, letting ui_print() to scroll output
             // on the screen.
             ui_end_menu();
+            wait_for_sdcard();
 
             switch (chosen_item) {
                 case ITEM_REBOOT:
@@ -1388,6 +1387,7 @@ prompt_and_wait()
                		        sleep(1);
 			}
                 	ui_print("\n");
+			note_mounts_changed("SDCARD:");  // ums_toggle unmounts the sdcard
 			if (!WIFEXITED(status) || (WEXITSTATUS(status) != 0)) {
                 		ui_print("\nError : Run 'ums_toggl' via adb!\n\n");
                 	} else {
@@ -1412,6 +1412,7 @@ prompt_and_wait()
 				               		        sleep(1);
 							}
 				                	ui_print("\n");
+							note_mounts_changed("SDCARD:");  // and remounts it
 							if (!WIFEXITED(status) || (WEXITSTATUS(status) != 0)) {
 				                		ui_print("\nError : Run 'ums_toggle' via adb!\n\n");
 				                	} else {
@@ -1476,7 +1477,7 @@ prompt_and_wait()
 static void
 print_property(const char *key, const char *name, void *cookie)
 {
-    fprintf(stderr, "%s=%s\n", key, name);
+    log_write("%s=%s\n", key, name);
 }
 
 int
@@ -1484,26 +1485,23 @@ main(int argc, char **argv)
 {
     time_t start = time(NULL);
 
-    // If these fail, there's not really anywhere to complain...
-    freopen(TEMPORARY_LOG_FILE, "a", stdout); setbuf(stdout, NULL);
-    freopen(TEMPORARY_LOG_FILE, "a", stderr); setbuf(stderr, NULL);
-    fprintf(stderr, "Starting recovery on %s", ctime(&start));
+    log_init(TEMPORARY_LOG_FILE);
+    trace_init(TRACE_DEFAULT_EVENTS);
+    log_write("Starting recovery on %s", ctime(&start));
 
     tcflow(STDIN_FILENO, TCOOFF);
 
     char prop_value[PROPERTY_VALUE_MAX];
     property_get("ro.modversion", &prop_value, "not set");
- 
-    ui_init();
-    ui_print("Build : ");
-    ui_print(prop_value);
-    ui_print("\n");
 
+    int span = trace_begin("get_args", NULL);
     get_args(&argc, &argv);
+    trace_end(span, 0);
     
     int previous_runs = 0;
     const char *send_intent = NULL;
-    const char *update_package = NULL;
+    const char *update_packages[MAX_QUEUED_PACKAGES];
+    int update_package_count = 0;
     int wipe_data = 0, wipe_cache = 0;
 
     int arg;
@@ -1511,23 +1509,46 @@ main(int argc, char **argv)
         switch (arg) {
         case 'p': previous_runs = atoi(optarg); break;
         case 's': send_intent = optarg; break;
-        case 'u': update_package = optarg; break;
+        case 'u':
+            if (update_package_count < MAX_QUEUED_PACKAGES) {
+                update_packages[update_package_count++] = optarg;
+            } else {
+                LOGE("Too many update packages; ignoring %s\n", optarg);
+            }
+            break;
         case 'w': wipe_data = wipe_cache = 1; break;
         case 'c': wipe_cache = 1; break;
+        case 'f': set_install_profiling(1); break;
         case '?':
             LOGE("Invalid command argument\n");
             continue;
         }
     }
 
-    fprintf(stderr, "Command:");
+    // A command from the system is normally run with nobody watching,
+    // so start on it without decoding bitmaps or opening input devices;
+    // the rest of the UI comes up once the command is done.
+    int headless = update_package_count > 0 || wipe_data || wipe_cache;
+    span = trace_begin("ui_init", headless ? "minimal" : NULL);
+    if (headless) {
+        ui_init_minimal();
+    } else {
+        ui_init();
+        start_sdcard_prescan();
+    }
+    trace_end(span, 0);
+    ui_print("Build : ");
+    ui_print(prop_value);
+    ui_print("\n");
+
+    log_write("Command:");
     for (arg = 0; arg < argc; arg++) {
-        fprintf(stderr, " \"%s\"", argv[arg]);
+        log_write(" \"%s\"", argv[arg]);
     }
-    fprintf(stderr, "\n\n");
+    log_write("\n\n");
 
     property_list(print_property, NULL);
-    fprintf(stderr, "\n");
+    log_write("\n");
 
 #if TEST_AMEND
     test_amend();
@@ -1540,8 +1561,11 @@ main(int argc, char **argv)
 
     int status = INSTALL_SUCCESS;
 
-    if (update_package != NULL) {
-        status = install_package(update_package);
+    if (update_package_count == 1) {
+        status = install_package(update_packages[0]);
+        if (status != INSTALL_SUCCESS) ui_print("Installation aborted.\n");
+    } else if (update_package_count > 1) {
+        status = install_packages(update_packages, update_package_count);
         if (status != INSTALL_SUCCESS) ui_print("Installation aborted.\n");
     } else if (wipe_data || wipe_cache) {
         if (wipe_data && erase_root("DATA:")) status = INSTALL_ERROR;
@@ -1551,18 +1575,36 @@ main(int argc, char **argv)
         status = INSTALL_ERROR;  // No command specified
     }
 
+    log_sync();  // Whatever happens next, keep the record of the above.
+
+    if (headless) {
+        ui_init();
+        start_sdcard_prescan();
+    }
+
     if (status != INSTALL_SUCCESS) ui_set_background(BACKGROUND_ICON_ERROR);
     if (status != INSTALL_SUCCESS || ui_text_visible()) prompt_and_wait();
+    wait_for_sdcard();
 
     // If there is a radio image pending, reboot now to install it.
-    maybe_install_firmware_update(send_intent);
+    if (maybe_install_firmware_update(send_intent)) {
+        // It was read again from the package, which may have gone away
+        // or changed; make sure nobody thinks it was installed.
+        ui_set_background(BACKGROUND_ICON_ERROR);
+        ui_print("\nFirmware update failed;\nthe radio/hboot image was "
+                 "not installed.\n");
+        prompt_and_wait();
+    }
 
     // Otherwise, get ready to boot the main system...
+    span = trace_begin("finish_recovery", NULL);
     finish_recovery(send_intent);
+    trace_end(span, 0);
     sync();
     if (do_reboot)
     {
     	ui_print("Rebooting...\n");
+    	log_sync();
     	reboot(RB_AUTOBOOT);
 	}
 	
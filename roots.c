@@ -15,6 +15,7 @@
  */
 
 #include <errno.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
@@ -25,6 +26,7 @@
 #include "mtdutils/mounts.h"
 #include "minzip/Zip.h"
 #include "roots.h"
+#include "trace/trace.h"
 #include "common.h"
 
 typedef struct {
@@ -57,6 +59,18 @@ static RootInfo g_roots[] = {
 };
 #define NUM_ROOTS (sizeof(g_roots) / sizeof(g_roots[0]))
 
+/* The mount table and the mtd partition table are globals inside
+ * mtdutils, so everything here that rescans them holds this lock; the
+ * sdcard may be mounted from a background thread while the main
+ * thread works on the other roots.
+ */
+static pthread_mutex_t g_roots_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Bumped whenever the root at the same index in g_roots is mounted or
+ * unmounted; see get_mount_generation().
+ */
+static unsigned int g_mount_generation[NUM_ROOTS];
+
 // TODO: for SDCARD:, try /dev/block/mmcblk0 if mmcblk0p1 fails
 
 static const RootInfo *
@@ -104,6 +118,12 @@ register_package_root(const ZipArchive *package, const char *package_path)
     return 0;
 }
 
+const char *
+get_package_root_file()
+{
+    return g_package != NULL ? g_package_path : NULL;
+}
+
 int
 is_package_root_path(const char *root_path)
 {
@@ -198,8 +218,8 @@ internal_root_mounted(const RootInfo *info)
     return -1;
 }
 
-int
-is_root_path_mounted(const char *root_path)
+static int
+locked_is_root_path_mounted(const char *root_path)
 {
     const RootInfo *info = get_root_info_for_path(root_path);
     if (info == NULL) {
@@ -208,8 +228,8 @@ is_root_path_mounted(const char *root_path)
     return internal_root_mounted(info) >= 0;
 }
 
-int
-ensure_root_path_mounted(const char *root_path)
+static int
+locked_ensure_root_path_mounted(const char *root_path)
 {
     const RootInfo *info = get_root_info_for_path(root_path);
     if (info == NULL) {
@@ -236,8 +256,10 @@ ensure_root_path_mounted(const char *root_path)
         if (partition == NULL) {
             return -1;
         }
-        return mtd_mount_partition(partition, info->mount_point,
+        ret = mtd_mount_partition(partition, info->mount_point,
                 info->filesystem, 0);
+        if (ret == 0) g_mount_generation[info - g_roots]++;
+        return ret;
     }
 
     if (info->device == NULL || info->mount_point == NULL ||
@@ -260,11 +282,12 @@ ensure_root_path_mounted(const char *root_path)
             return -1;
         }
     }
+    g_mount_generation[info - g_roots]++;
     return 0;
 }
 
-int
-ensure_root_path_unmounted(const char *root_path)
+static int
+locked_ensure_root_path_unmounted(const char *root_path)
 {
     const RootInfo *info = get_root_info_for_path(root_path);
     if (info == NULL) {
@@ -291,11 +314,13 @@ ensure_root_path_unmounted(const char *root_path)
         return 0;
     }
 
+    // Even if it fails, it may be half gone.
+    g_mount_generation[info - g_roots]++;
     return unmount_mounted_volume(volume);
 }
 
-const MtdPartition *
-get_root_mtd_partition(const char *root_path)
+static const MtdPartition *
+locked_get_root_mtd_partition(const char *root_path)
 {
     const RootInfo *info = get_root_info_for_path(root_path);
     if (info == NULL || info->device != g_mtd_device ||
@@ -307,8 +332,8 @@ get_root_mtd_partition(const char *root_path)
     return mtd_find_partition_by_name(info->partition_name);
 }
 
-int
-format_root_device(const char *root)
+static int
+locked_format_root_device(const char *root)
 {
     /* Be a little safer here; require that "root" is just
      * a device with no relative path after it.
@@ -330,7 +355,7 @@ format_root_device(const char *root)
     if (info->mount_point != NULL) {
         /* Don't try to format a mounted device.
          */
-        int ret = ensure_root_path_unmounted(root);
+        int ret = locked_ensure_root_path_unmounted(root);
         if (ret < 0) {
             LOGW("format_root_device: can't unmount \"%s\"\n", root);
             return ret;
@@ -369,3 +394,88 @@ format_root_device(const char *root)
     LOGW("format_root_device: can't handle non-mtd device \"%s\"\n", root);
     return -1;
 }
+
+unsigned int
+get_mount_generation(const char *path)
+{
+    /* The root whose mount point is the longest prefix of the path.
+     */
+    size_t best = 0, best_len = 0;
+    size_t i;
+    for (i = 0; i < NUM_ROOTS; i++) {
+        const char *mount_point = g_roots[i].mount_point;
+        if (mount_point == NULL) continue;
+        size_t len = strlen(mount_point);
+        if (strncmp(path, mount_point, len) == 0 &&
+            (path[len] == '\0' || path[len] == '/' ||
+             mount_point[len-1] == '/') &&
+            len > best_len) {
+            best = i;
+            best_len = len;
+        }
+    }
+
+    pthread_mutex_lock(&g_roots_lock);
+    unsigned int generation = best_len > 0 ? g_mount_generation[best] : 0;
+    pthread_mutex_unlock(&g_roots_lock);
+    return generation;
+}
+
+void
+note_mounts_changed(const char *root_path)
+{
+    const RootInfo *info = get_root_info_for_path(root_path);
+    if (info == NULL) return;
+    pthread_mutex_lock(&g_roots_lock);
+    g_mount_generation[info - g_roots]++;
+    pthread_mutex_unlock(&g_roots_lock);
+}
+
+int
+is_root_path_mounted(const char *root_path)
+{
+    pthread_mutex_lock(&g_roots_lock);
+    int ret = locked_is_root_path_mounted(root_path);
+    pthread_mutex_unlock(&g_roots_lock);
+    return ret;
+}
+
+int
+ensure_root_path_mounted(const char *root_path)
+{
+    int span = trace_begin("ensure_root_path_mounted", root_path);
+    pthread_mutex_lock(&g_roots_lock);
+    int ret = locked_ensure_root_path_mounted(root_path);
+    pthread_mutex_unlock(&g_roots_lock);
+    trace_end(span, 0);
+    return ret;
+}
+
+int
+ensure_root_path_unmounted(const char *root_path)
+{
+    pthread_mutex_lock(&g_roots_lock);
+    int ret = locked_ensure_root_path_unmounted(root_path);
+    pthread_mutex_unlock(&g_roots_lock);
+    return ret;
+}
+
+const MtdPartition *
+get_root_mtd_partition(const char *root_path)
+{
+    pthread_mutex_lock(&g_roots_lock);
+    const MtdPartition *partition = locked_get_root_mtd_partition(root_path);
+    pthread_mutex_unlock(&g_roots_lock);
+    return partition;
+}
+
+int
+format_root_device(const char *root)
+{
+    int span = trace_begin("format_root_device", root);
+    pthread_mutex_lock(&g_roots_lock);
+    int ret = locked_format_root_device(root);
+    pthread_mutex_unlock(&g_roots_lock);
+    trace_end(span, 0);
+    return ret;
+}
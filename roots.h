@@ -28,6 +28,10 @@
  */
 int register_package_root(const ZipArchive *package, const char *package_path);
 
+/* Returns the file name the package root was registered with, or NULL.
+ */
+const char *get_package_root_file();
+
 /* Returns non-zero iff root_path points inside a package.
  */
 int is_package_root_path(const char *root_path);
@@ -55,6 +59,20 @@ int ensure_root_path_unmounted(const char *root_path);
 
 const MtdPartition *get_root_mtd_partition(const char *root_path);
 
+/* Returns a number that changes whenever the root holding the
+ * filesystem path 'path' (the one whose mount point is the longest
+ * prefix of it) is mounted or unmounted here, or note_mounts_changed()
+ * is called for it.  Caches of anything read from a mounted root can
+ * compare it to tell whether to trust what they have; mounting other
+ * roots doesn't change it.
+ */
+unsigned int get_mount_generation(const char *path);
+
+/* Call after something else (like ums_toggle) may have unmounted or
+ * remounted 'root_path' behind our back.
+ */
+void note_mounts_changed(const char *root_path);
+
 /* "root" must be the exact name of the root; no relative path is permitted.
  * If the named root is mounted, this will attempt to unmount it first.
  */
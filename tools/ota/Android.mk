@@ -19,6 +19,21 @@ LOCAL_MODULE := make-update-script
 LOCAL_SRC_FILES := make-update-script.c
 include $(BUILD_HOST_EXECUTABLE)
 
+include $(CLEAR_VARS)
+LOCAL_MODULE := layout-update-package
+LOCAL_SRC_FILES := layout-update-package.c
+LOCAL_C_INCLUDES += external/zlib
+LOCAL_STATIC_LIBRARIES := libz
+include $(BUILD_HOST_EXECUTABLE)
+
+include $(CLEAR_VARS)
+LOCAL_MODULE := make-block-patch
+LOCAL_SRC_FILES := make-block-patch.c
+LOCAL_C_INCLUDES += external/bzip2
+LOCAL_STATIC_LIBRARIES := libbz
+LOCAL_LDLIBS += -lpthread
+include $(BUILD_HOST_EXECUTABLE)
+
 ifneq ($(TARGET_SIMULATOR),true)
 
 include $(CLEAR_VARS)
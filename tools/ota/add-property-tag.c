@@ -21,111 +21,217 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 /*
  * Append a tag to a property value in a .prop file if it isn't already there.
  * Normally used to modify build properties to record incremental updates.
+ *
+ * Any number of (property, tag) rules are applied in one pass over the
+ * file, and the result replaces the file atomically.
  */
 
-// Return nonzero if the tag should be added to this line.
-int should_tag(const char *line, const char *propname) {
-    const char *prop = strstr(line, propname);
-    if (prop == NULL) return 0;
-
-    // Make sure this is actually the property name (not an accidental hit)
-    const char *ptr;
-    for (ptr = line; ptr < prop && isspace(*ptr); ++ptr) ;
-    if (ptr != prop) return 0;  // Must be at the beginning of the line
-
-    for (ptr += strlen(propname); *ptr != '\0' && isspace(*ptr); ++ptr) ;
-    return (*ptr == '=');  // Must be followed by a '='
+#define MAX_RULES 64
+#define MAX_LINE 4096
+
+typedef struct {
+    const char *propname;
+    const char *tag;
+    int found;
+} Rule;
+
+// If 'line' assigns a property, return the length of its name (starting
+// at *name) and set *value to what follows the '='.  Otherwise return 0.
+static int parse_property(const char *line, const char **name,
+        const char **value) {
+    const char *ptr = line;
+    while (isspace(*ptr)) ++ptr;
+    *name = ptr;
+    while (*ptr != '\0' && *ptr != '=' && !isspace(*ptr)) ++ptr;
+    int len = ptr - *name;
+    while (*ptr != '\0' && isspace(*ptr)) ++ptr;
+    if (len == 0 || *ptr != '=') return 0;  // Must be followed by a '='
+    *value = ptr + 1;
+    return len;
 }
 
-// Remove existing tags from the line, return the following number (if any)
-int remove_tag(char *line, const char *tag) {
-    char *pos = strstr(line, tag);
-    if (pos == NULL) return 0;
-
-    char *end;
-    int num = strtoul(pos + strlen(tag), &end, 10);
-    strcpy(pos, end);
-    return num;
-}
+/*
+ * Copy 'value' to 'out' with 'tag' (and the number after it, if any)
+ * removed.  Unless 'remove' is set, add the tag back at the end (before
+ * any trailing whitespace), followed by the old number plus 'increment'
+ * if that's above 0.  Returns -1 if the result doesn't fit.
+ */
+static int retag(const char *value, const char *tag, int remove,
+        int increment, char *out, size_t out_size) {
+    char stripped[MAX_LINE];
+    int number = 0, n;
+    const char *pos = strstr(value, tag);
+    if (pos == NULL) {
+        n = snprintf(stripped, sizeof(stripped), "%s", value);
+    } else {
+        char *end;
+        number = strtoul(pos + strlen(tag), &end, 10);
+        n = snprintf(stripped, sizeof(stripped), "%.*s%s",
+                (int) (pos - value), value, end);
+    }
+    if (n < 0 || (size_t) n >= sizeof(stripped)) return -1;
 
-// Write line to output with the tag added, adding a number (if >0)
-void write_tagged(FILE *out, const char *line, const char *tag, int number) {
-    const char *end = line + strlen(line);
-    while (end > line && isspace(end[-1])) --end;
-    if (number > 0) {
-        fprintf(out, "%.*s%s%d%s", end - line, line, tag, number, end);
+    if (remove) {
+        n = snprintf(out, out_size, "%s", stripped);
     } else {
-        fprintf(out, "%.*s%s%s", end - line, line, tag, end);
+        const char *end = stripped + n;
+        while (end > stripped && isspace(end[-1])) --end;
+        if (number + increment > 0) {
+            n = snprintf(out, out_size, "%.*s%s%d%s", (int) (end - stripped),
+                    stripped, tag, number + increment, end);
+        } else {
+            n = snprintf(out, out_size, "%.*s%s%s", (int) (end - stripped),
+                    stripped, tag, end);
+        }
     }
+    return n < 0 || (size_t) n >= out_size ? -1 : 0;
+}
+
+static void usage() {
+    fprintf(stderr,
+        "usage: add-property-tag [flags] [tag-to-add]\n"
+        "flags: -f /dir/file.prop (default /system/build.prop)\n"
+        "       -p prop.name (default ro.build.fingerprint)\n"
+        "       -t prop.name=tag (tag another property; may be repeated,\n"
+        "          and then tag-to-add and -p are optional)\n"
+        "       -r (if set, remove the tag rather than adding it)\n"
+        "       -n (if set, add and increment a number after the tag)\n");
+    exit(2);
 }
 
 int main(int argc, char **argv) {
     const char *filename = "/system/build.prop";
     const char *propname = "ro.build.fingerprint";
-    const char *tag = NULL;
     int do_remove = 0, do_number = 0;
+    Rule rules[MAX_RULES];
+    int rule_count = 0;
 
     int opt;
-    while ((opt = getopt(argc, argv, "f:p:rn")) != -1) {
+    while ((opt = getopt(argc, argv, "f:p:t:rn")) != -1) {
         switch (opt) {
         case 'f': filename = optarg; break;
         case 'p': propname = optarg; break;
+        case 't': {
+            char *eq = strchr(optarg, '=');
+            if (eq == NULL || eq == optarg || eq[1] == '\0') usage();
+            if (rule_count >= MAX_RULES) {
+                fprintf(stderr, "too many rules (max %d)\n", MAX_RULES);
+                return 2;
+            }
+            *eq = '\0';
+            rules[rule_count].propname = optarg;
+            rules[rule_count].tag = eq + 1;
+            rules[rule_count].found = 0;
+            ++rule_count;
+            break;
+        }
         case 'r': do_remove = 1; break;
         case 'n': do_number = 1; break;
         case '?': return 2;
         }
     }
 
-    if (argc != optind + 1) {
-        fprintf(stderr,
-            "usage: add-property-tag [flags] tag-to-add\n"
-            "flags: -f /dir/file.prop (default /system/build.prop)\n"
-            "       -p prop.name (default ro.build.fingerprint)\n"
-            "       -r (if set, remove the tag rather than adding it)\n"
-            "       -n (if set, add and increment a number after the tag)\n");
-        return 2;
+    if (argc == optind + 1 && rule_count < MAX_RULES) {
+        rules[rule_count].propname = propname;
+        rules[rule_count].tag = argv[optind];
+        rules[rule_count].found = 0;
+        ++rule_count;
+    } else if (argc != optind || rule_count == 0) {
+        usage();
     }
 
-    tag = argv[optind];
     FILE *input = fopen(filename, "r");
-    if (input == NULL) {
+    struct stat st;
+    if (input == NULL || fstat(fileno(input), &st)) {
         fprintf(stderr, "can't read %s: %s\n", filename, strerror(errno));
         return 1;
     }
 
+    // Write next to the original, so the rename can't cross filesystems.
     char tmpname[PATH_MAX];
-    snprintf(tmpname, sizeof(tmpname), "%s.tmp", filename);
-    FILE *output = fopen(tmpname, "w");
+    snprintf(tmpname, sizeof(tmpname), "%s.XXXXXX", filename);
+    int fd = mkstemp(tmpname);
+    FILE *output = fd < 0 ? NULL : fdopen(fd, "w");
     if (output == NULL) {
         fprintf(stderr, "can't write %s: %s\n", tmpname, strerror(errno));
         return 1;
     }
 
-    int found = 0;
-    char line[4096];
-    while (fgets(line, sizeof(line), input)) {
-        if (!should_tag(line, propname)) {
-            fputs(line, output);  // Pass through unmodified
-        } else {
-            found = 1;
-            int number = remove_tag(line, tag);
-            if (do_remove) {
-                fputs(line, output);  // Remove the tag but don't re-add it
-            } else {
-                write_tagged(output, line, tag, number + do_number);
+    int ok = 1, continued = 0;
+    char line[MAX_LINE], buf[2][MAX_LINE];
+    while (ok && fgets(line, sizeof(line), input)) {
+        size_t len = strlen(line);
+        int partial = len > 0 && line[len - 1] != '\n' && !feof(input);
+
+        // The rest of an over-long line, or one we don't need to change,
+        // passes through unmodified.
+        const char *name, *value;
+        int name_len = continued ? 0 : parse_property(line, &name, &value);
+        continued = partial;
+
+        const char *current = value;
+        int i, which = 0, changed = 0;
+        for (i = 0; name_len > 0 && i < rule_count; ++i) {
+            Rule *r = &rules[i];
+            if (strncmp(r->propname, name, name_len) ||
+                r->propname[name_len] != '\0') continue;
+            if (partial) {
+                fprintf(stderr, "line for %s is too long\n", r->propname);
+                ok = 0;
+                break;
+            }
+            r->found = 1;
+            if (retag(current, r->tag, do_remove, do_number,
+                      buf[which], sizeof(buf[which]))) {
+                fprintf(stderr, "line for %s is too long\n", r->propname);
+                ok = 0;
+                break;
             }
+            current = buf[which];
+            which = !which;
+            changed = 1;
+        }
+
+        if (!changed) {
+            fputs(line, output);
+        } else {
+            fprintf(output, "%.*s%s", (int) (value - line), line, current);
         }
     }
 
+    if (ferror(input)) {
+        fprintf(stderr, "can't read %s: %s\n", filename, strerror(errno));
+        ok = 0;
+    }
     fclose(input);
-    fclose(output);
 
-    if (!found) {
-        fprintf(stderr, "property %s not found in %s\n", propname, filename);
+    int i;
+    for (i = 0; ok && i < rule_count; ++i) {
+        if (!rules[i].found) {
+            fprintf(stderr, "property %s not found in %s\n",
+                rules[i].propname, filename);
+            ok = 0;
+        }
+    }
+
+    if (fflush(output) || fchmod(fileno(output), st.st_mode & 07777) ||
+        fsync(fileno(output))) {
+        if (ok) fprintf(stderr, "can't write %s: %s\n",
+            tmpname, strerror(errno));
+        ok = 0;
+    }
+    if (fclose(output) && ok) {
+        fprintf(stderr, "can't write %s: %s\n", tmpname, strerror(errno));
+        ok = 0;
+    }
+
+    if (!ok) {
         remove(tmpname);
         return 1;
     }
@@ -14,7 +14,6 @@
  * limitations under the License.
  */
 
-#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
@@ -24,8 +23,10 @@
 #include <sys/klog.h>
 #include <sys/reboot.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <time.h>
+#include <unistd.h>
 
 #include "private/android_filesystem_config.h"
 
@@ -36,12 +37,111 @@ static const char *kMarkerFile = "/data/misc/check-lost+found-rebooted-2";
 static const char *kOutputDir = "/data/tombstones";
 static const char *kOutputFile = "/data/tombstones/check-lost+found-log";
 
+// Only this much of the output file gets uploaded
+static const long kUploadLimit = 8192;
+
 // Partitions to check
 static const char *kPartitions[] = { "/system", "/data", "/cache", NULL };
 
+// Give up on a lost+found that takes longer than this to scan
+static const long kScanLimitMs = 2000;
+
+// As returned by getdents64 (not every libc declares it)
+struct linux_dirent64 {
+    unsigned long long d_ino;
+    long long d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+static long elapsed_ms(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000 +
+           (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+/*
+ * Write one line describing the lost+found directory 'fn':
+ *
+ *   lost+found <dir> entries=N bytes=N oldest=<mtime>,<name>
+ *       newest=<mtime>,<name> errors=N ms=N complete=0|1
+ *
+ * (all on one line), or "lost+found <dir> errno=N" if it can't be read.
+ * Entries are read a buffer at a time and stat'ed relative to the
+ * directory, so a big lost+found doesn't cost a path lookup per file.
+ * If the scan runs past kScanLimitMs, what was seen so far is reported
+ * with complete=0.
+ */
+static void scan_lost_found(FILE *out, const char *fn) {
+    int fd = open(fn, O_RDONLY | O_DIRECTORY);
+    if (fd < 0) {
+        fprintf(out, "lost+found %s errno=%d\n", fn, errno);
+        return;
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    long long count = 0, bytes = 0;
+    int errors = 0, complete = 1;
+    time_t oldest = 0, newest = 0;
+    char oldest_name[32] = "", newest_name[32] = "";
+
+    char buf[8192];
+    int len;
+    while ((len = syscall(SYS_getdents64, fd, buf, sizeof(buf))) > 0) {
+        int pos;
+        for (pos = 0; pos < len; ) {
+            const struct linux_dirent64 *d =
+                    (const struct linux_dirent64 *) (buf + pos);
+            pos += d->d_reclen;
+            if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, "..")) continue;
+
+            ++count;
+            struct stat st;
+            if (fstatat(fd, d->d_name, &st, AT_SYMLINK_NOFOLLOW)) {
+                ++errors;
+                continue;
+            }
+            bytes += st.st_size;
+            if (count == 1 || st.st_mtime < oldest) {
+                oldest = st.st_mtime;
+                snprintf(oldest_name, sizeof(oldest_name), "%s", d->d_name);
+            }
+            if (count == 1 || st.st_mtime > newest) {
+                newest = st.st_mtime;
+                snprintf(newest_name, sizeof(newest_name), "%s", d->d_name);
+            }
+        }
+
+        if (elapsed_ms(&start) > kScanLimitMs) {
+            complete = 0;
+            break;
+        }
+    }
+    if (len < 0) ++errors;
+    close(fd);
+
+    // Names in lost+found are normally "#<inode>"; keep the record one
+    // whitespace-separated line whatever they are.
+    char *p;
+    for (p = oldest_name; *p != '\0'; ++p) if (*p <= ' ' || *p == ',') *p = '?';
+    for (p = newest_name; *p != '\0'; ++p) if (*p <= ' ' || *p == ',') *p = '?';
+
+    fprintf(out, "lost+found %s entries=%lld bytes=%lld", fn, count, bytes);
+    if (count > errors) {
+        fprintf(out, " oldest=%ld,%s newest=%ld,%s",
+                (long) oldest, oldest_name, (long) newest, newest_name);
+    }
+    fprintf(out, " errors=%d ms=%ld complete=%d\n",
+            errors, elapsed_ms(&start), complete);
+}
+
 /*
  * 1. If /data/misc/forced-reboot is missing, touch it & force "unclean" boot.
- * 2. Write a log entry with the number of files in lost+found directories.
+ * 2. Write a log entry describing the files in lost+found directories.
  */
 
 int main(int argc, char **argv) {
@@ -97,23 +197,7 @@ int main(int argc, char **argv) {
     for (i = 0; kPartitions[i] != NULL; ++i) {
         char fn[PATH_MAX];
         snprintf(fn, sizeof(fn), "%s/%s", kPartitions[i], "lost+found");
-        DIR *dir = opendir(fn);
-        if (dir == NULL) {
-            fprintf(out, "Can't open %s: %s\n", fn, strerror(errno));
-        } else {
-            int count = 0;
-            struct dirent *ent;
-            while ((ent = readdir(dir))) {
-                if (strcmp(ent->d_name, ".") && strcmp(ent->d_name, ".."))
-                    ++count;
-            }
-            closedir(dir);
-            if (count > 0) {
-                fprintf(out, "OMGZ FOUND %d FILES IN %s\n", count, fn);
-            } else {
-                fprintf(out, "%s is clean\n", fn);
-            }
-        }
+        scan_lost_found(out, fn);
     }
 
     char dmesg[131073];
@@ -122,6 +206,11 @@ int main(int argc, char **argv) {
         fprintf(out, "Can't read kernel log: %s\n", strerror(errno));
     } else {  // To conserve space, only write lines with certain keywords
         fprintf(out, "--- Kernel log ---\n");
+        fflush(out);
+        // Only the start of the file is uploaded, and it is opened for
+        // append, so the budget is what's left of kUploadLimit overall.
+        long budget = kUploadLimit - ftell(out);
+        if (budget < 0) budget = 0;
         dmesg[len] = '\0';
         char *saveptr, *line;
         int in_yaffs = 0;
@@ -133,6 +222,10 @@ int main(int argc, char **argv) {
                     strstr(line, "yaffs") ||
                     strstr(line, "mtd") ||
                     strstr(line, "msm_nand")) {
+                // Stop before the file passes the upload limit.
+                long line_len = strlen(line) + 1;
+                if (line_len > budget) break;
+                budget -= line_len;
                 fprintf(out, "%s\n", line);
             }
 
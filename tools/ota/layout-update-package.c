@@ -0,0 +1,683 @@
+/*
+ * Copyright (C) 2009 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "zlib.h"
+
+/*
+ * Rewrite a (signed) update package so that recovery reads it front to
+ * back: the META-INF files needed to verify it and find the script come
+ * first, then everything the script extracts in the order the script
+ * asks for it, then anything the script doesn't mention, and the raw
+ * images (*.img), which are flashed last, at the end.  The data of
+ * STORED entries starts on a page boundary, so it can be used straight
+ * out of the mapped package.
+ *
+ * Each entry is also stored or deflated, whichever the device gets
+ * through faster (see choose_compression()); -k keeps the compression
+ * each entry already has.  The jar signature covers the uncompressed
+ * contents, so it stays valid either way.  The optional index lists
+ * where each entry's data ended up.
+ */
+
+#define LOCSIG 0x04034b50
+#define CENSIG 0x02014b50
+#define ENDSIG 0x06054b50
+#define LOCHDR 30
+#define CENHDR 46
+#define ENDHDR 22
+
+#define STORED   0
+#define DEFLATED 8
+
+#define FLAG_DATA_DESCRIPTOR 0x0008
+
+// Extra field holding the alignment padding, as zipalign/apksigner do.
+#define ALIGNMENT_EXTRA_ID 0xd935
+#define ALIGNMENT_EXTRA_MIN 6
+
+#define DEFAULT_ALIGNMENT 4096
+
+// Device speeds used to choose each entry's compression.  The defaults
+// are rough numbers for a G1-class device reading the package from the
+// sdcard; a -c file with "key value" lines can replace them.
+typedef struct {
+    double read_bps;      // reading the package
+    double inflate_bps;   // inflating, in uncompressed bytes
+} Calibration;
+
+static Calibration calibration = {
+    6 * 1024 * 1024,      // read_bps
+    20 * 1024 * 1024,     // inflate_bps
+};
+
+static const int LEVELS[] = { 1, 6, 9 };
+
+static const char *SCRIPT_NAMES[] = {
+    "META-INF/com/google/android/updater-script",  // edify
+    "META-INF/com/google/android/update-script",   // amend
+    NULL
+};
+
+typedef struct {
+    const unsigned char *cen;     // central directory record in the input
+    const char *name;
+    unsigned name_len;
+    unsigned method;
+    unsigned comp_len, uncomp_len;
+    unsigned flags;               // general purpose bit flags
+    unsigned version;             // version needed to extract
+    const unsigned char *data;    // compressed data (input, or recompressed)
+    int group;                    // where it goes, see order_entries()
+    int order;                    // position within the group
+    unsigned out_offset;          // local header offset in the output
+    unsigned out_data;            // data offset in the output
+} Entry;
+
+static unsigned get2LE(const unsigned char *p) {
+    return p[0] | (p[1] << 8);
+}
+
+static unsigned get4LE(const unsigned char *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned) p[3] << 24);
+}
+
+static void put2LE(unsigned char *p, unsigned v) {
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static void put4LE(unsigned char *p, unsigned v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static unsigned char *read_file(const char *path, size_t *len) {
+    FILE *fp = fopen(path, "rb");
+    struct stat st;
+    if (fp == NULL || fstat(fileno(fp), &st)) {
+        perror(path);
+        exit(1);
+    }
+    unsigned char *data = malloc(st.st_size + 1);
+    if (data == NULL) {
+        fprintf(stderr, "%s: out of memory\n", path);
+        exit(1);
+    }
+    if (fread(data, 1, st.st_size, fp) != (size_t) st.st_size) {
+        fprintf(stderr, "%s: short read\n", path);
+        exit(1);
+    }
+    fclose(fp);
+    data[st.st_size] = '\0';
+    *len = st.st_size;
+    return data;
+}
+
+/*
+ * Parse the central directory of 'zip'.  Returns the entries (in
+ * central directory order) and sets *count and *eocd.
+ */
+static Entry *read_entries(const unsigned char *zip, size_t len,
+        int *count, const unsigned char **eocd) {
+    const unsigned char *ptr;
+    if (len < ENDHDR) {
+        fprintf(stderr, "not a zip file\n");
+        exit(1);
+    }
+    for (ptr = zip + len - ENDHDR; ptr >= zip; --ptr) {
+        if (get4LE(ptr) == ENDSIG) break;
+    }
+    if (ptr < zip) {
+        fprintf(stderr, "can't find end of central directory\n");
+        exit(1);
+    }
+    *eocd = ptr;
+
+    int n = get2LE(ptr + 10);
+    unsigned cd_offset = get4LE(ptr + 16);
+    if (get2LE(ptr + 4) != 0 || n != (int) get2LE(ptr + 8)) {
+        fprintf(stderr, "multi-disk archives aren't supported\n");
+        exit(1);
+    }
+    if (n == 0xffff || cd_offset == 0xffffffff) {
+        fprintf(stderr, "zip64 archives aren't supported\n");
+        exit(1);
+    }
+
+    Entry *entries = calloc(n, sizeof(*entries));
+    if (entries == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+
+    int i;
+    ptr = zip + cd_offset;
+    for (i = 0; i < n; ++i) {
+        Entry *e = &entries[i];
+        if (ptr + CENHDR > *eocd || get4LE(ptr) != CENSIG) {
+            fprintf(stderr, "bad central directory (entry %d)\n", i);
+            exit(1);
+        }
+        e->cen = ptr;
+        e->version = get2LE(ptr + 6);
+        e->flags = get2LE(ptr + 8) & ~FLAG_DATA_DESCRIPTOR;
+        e->method = get2LE(ptr + 10);
+        e->comp_len = get4LE(ptr + 20);
+        e->uncomp_len = get4LE(ptr + 24);
+        e->name_len = get2LE(ptr + 28);
+        e->name = (const char *) ptr + CENHDR;
+
+        unsigned local = get4LE(ptr + 42);
+        const unsigned char *loc = zip + local;
+        if (local + LOCHDR > len || get4LE(loc) != LOCSIG) {
+            fprintf(stderr, "bad local header for %.*s\n",
+                    e->name_len, e->name);
+            exit(1);
+        }
+        e->data = loc + LOCHDR + get2LE(loc + 26) + get2LE(loc + 28);
+        if (e->data + e->comp_len > zip + len) {
+            fprintf(stderr, "%.*s runs off the end\n", e->name_len, e->name);
+            exit(1);
+        }
+
+        ptr += CENHDR + e->name_len + get2LE(ptr + 30) + get2LE(ptr + 32);
+    }
+
+    *count = n;
+    return entries;
+}
+
+// Returns the contents of 'e' as a malloc'd, null-terminated string.
+static char *read_entry(const Entry *e) {
+    char *data = malloc(e->uncomp_len + 1);
+    if (data == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+
+    if (e->method == STORED && e->comp_len == e->uncomp_len) {
+        memcpy(data, e->data, e->comp_len);
+    } else if (e->method == DEFLATED) {
+        z_stream zs;
+        memset(&zs, 0, sizeof(zs));
+        zs.next_in = (unsigned char *) e->data;
+        zs.avail_in = e->comp_len;
+        zs.next_out = (unsigned char *) data;
+        zs.avail_out = e->uncomp_len;
+        int ok = inflateInit2(&zs, -MAX_WBITS) == Z_OK &&
+                inflate(&zs, Z_FINISH) == Z_STREAM_END &&
+                zs.total_out == e->uncomp_len;
+        inflateEnd(&zs);
+        if (!ok) {
+            fprintf(stderr, "can't inflate %.*s\n", e->name_len, e->name);
+            exit(1);
+        }
+    } else {
+        fprintf(stderr, "%.*s: unknown compression method %u\n",
+                e->name_len, e->name, e->method);
+        exit(1);
+    }
+
+    if (crc32(crc32(0L, Z_NULL, 0), (unsigned char *) data, e->uncomp_len) !=
+            get4LE(e->cen + 16)) {
+        fprintf(stderr, "%.*s: bad crc\n", e->name_len, e->name);
+        exit(1);
+    }
+
+    data[e->uncomp_len] = '\0';
+    return data;
+}
+
+// Seconds the device spends getting this much data out of the package.
+static double device_time(unsigned method, unsigned comp_len,
+        unsigned uncomp_len) {
+    double t = comp_len / calibration.read_bps;
+    if (method == DEFLATED) t += uncomp_len / calibration.inflate_bps;
+    return t;
+}
+
+/*
+ * Store or deflate 'e', whichever is quicker for the device to read
+ * (writing the result out costs the same either way).  Deflating only
+ * pays when it saves more read time than inflating takes, so payloads
+ * that are already compressed (APKs, PNGs, most images) end up stored.
+ * Of the deflate levels tried, the one that compresses best wins; the
+ * device inflates them all at about the same speed.
+ */
+static void choose_compression(Entry *e) {
+    if (e->uncomp_len == 0) return;
+
+    unsigned char *data = (unsigned char *) read_entry(e);
+    unsigned best_method = STORED, best_len = e->uncomp_len, best_level = 0;
+    unsigned char *best = NULL;
+
+    uLong bound = compressBound(e->uncomp_len);
+    unsigned i;
+    for (i = 0; i < sizeof(LEVELS) / sizeof(LEVELS[0]); ++i) {
+        unsigned char *out = malloc(bound);
+        if (out == NULL) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+
+        z_stream zs;
+        memset(&zs, 0, sizeof(zs));
+        zs.next_in = data;
+        zs.avail_in = e->uncomp_len;
+        zs.next_out = out;
+        zs.avail_out = bound;
+        if (deflateInit2(&zs, LEVELS[i], Z_DEFLATED, -MAX_WBITS, 8,
+                    Z_DEFAULT_STRATEGY) != Z_OK ||
+            deflate(&zs, Z_FINISH) != Z_STREAM_END) {
+            fprintf(stderr, "can't deflate %.*s\n", e->name_len, e->name);
+            exit(1);
+        }
+        deflateEnd(&zs);
+
+        if (device_time(DEFLATED, zs.total_out, e->uncomp_len) <
+                device_time(best_method, best_len, e->uncomp_len)) {
+            free(best);
+            best = out;
+            best_method = DEFLATED;
+            best_len = zs.total_out;
+            best_level = LEVELS[i];
+        } else {
+            free(out);
+        }
+    }
+
+    e->method = best_method;
+    e->comp_len = best_len;
+    e->flags &= ~0x0006;
+    if (best_method == DEFLATED) {
+        e->data = best;
+        e->version = 20;
+        if (best_level >= 8) e->flags |= 0x0002;        // maximum
+        else if (best_level <= 2) e->flags |= 0x0004;   // fast
+        free(data);
+    } else {
+        e->data = data;
+        e->version = 10;
+    }
+}
+
+// Read "key value" lines (keys named as in Calibration) from 'path'.
+static void load_calibration(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        perror(path);
+        exit(1);
+    }
+
+    static const struct {
+        const char *key;
+        double *value;
+    } keys[] = {
+        { "read_bps",    &calibration.read_bps },
+        { "inflate_bps", &calibration.inflate_bps },
+    };
+
+    char line[256];
+    while (fgets(line, sizeof(line), f)) {
+        char key[64];
+        double value;
+        if (line[0] == '#' || sscanf(line, "%63s", key) != 1) continue;
+        if (sscanf(line, "%63s %lf", key, &value) != 2 || value <= 0) {
+            fprintf(stderr, "%s: bad line: %s", path, line);
+            exit(1);
+        }
+        unsigned i;
+        for (i = 0; i < sizeof(keys) / sizeof(keys[0]); ++i) {
+            if (!strcmp(key, keys[i].key)) {
+                *keys[i].value = value;
+                break;
+            }
+        }
+        if (i == sizeof(keys) / sizeof(keys[0])) {
+            fprintf(stderr, "%s: unknown key \"%s\"\n", path, key);
+            exit(1);
+        }
+    }
+    fclose(f);
+}
+
+static Entry *find_entry(Entry *entries, int count,
+        const char *name, int name_len) {
+    int i;
+    for (i = 0; i < count; ++i) {
+        if (entries[i].name_len == (unsigned) name_len &&
+            !memcmp(entries[i].name, name, name_len)) return &entries[i];
+    }
+    return NULL;
+}
+
+static int is_image(const Entry *e) {
+    return e->name_len > 4 && !memcmp(e->name + e->name_len - 4, ".img", 4);
+}
+
+enum {
+    GROUP_META_INF,
+    GROUP_SCRIPT,
+    GROUP_UNUSED,
+    GROUP_IMAGE,
+    GROUP_NONE,  // not placed yet
+};
+
+/*
+ * Place whatever the package path 'ref' names: the entry itself, or if
+ * there is no such entry, everything under it as a directory.
+ */
+static void place_reference(Entry *entries, int count,
+        const char *ref, int ref_len, int *next) {
+    while (ref_len > 0 && ref[ref_len - 1] == '/') --ref_len;
+    if (ref_len == 0) return;
+
+    Entry *e = find_entry(entries, count, ref, ref_len);
+    if (e != NULL) {
+        if (e->group == GROUP_NONE) {
+            e->group = is_image(e) ? GROUP_IMAGE : GROUP_SCRIPT;
+            e->order = (*next)++;
+        }
+        return;
+    }
+
+    // minzip extracts a directory in name order, which is how the
+    // entries get sorted in the end.
+    int i;
+    for (i = 0; i < count; ++i) {
+        e = &entries[i];
+        if (e->group == GROUP_NONE && e->name_len > (unsigned) ref_len &&
+            e->name[ref_len] == '/' && !memcmp(e->name, ref, ref_len)) {
+            e->group = is_image(e) ? GROUP_IMAGE : GROUP_SCRIPT;
+            e->order = *next;
+        }
+    }
+    ++*next;
+}
+
+/*
+ * Find the package paths the script uses, in order.  Amend scripts name
+ * them as PACKAGE:<path>; edify scripts as the first (string) argument
+ * of package_extract_dir() and package_extract_file().
+ */
+static void place_script_references(Entry *entries, int count,
+        const char *script, int *next) {
+    static const char *EDIFY_FUNCTIONS[] = {
+        "package_extract_dir", "package_extract_file", NULL
+    };
+    const char *p = script;
+    while (*p != '\0') {
+        if (!strncmp(p, "PACKAGE:", 8)) {
+            p += 8;
+            int len = strcspn(p, " \t\r\n\"");
+            place_reference(entries, count, p, len, next);
+            p += len;
+            continue;
+        }
+
+        const char **fn;
+        for (fn = EDIFY_FUNCTIONS; *fn != NULL; ++fn) {
+            int fn_len = strlen(*fn);
+            if (strncmp(p, *fn, fn_len)) continue;
+            const char *q = p + fn_len;
+            q += strspn(q, " \t\r\n");
+            if (*q++ != '(') break;
+            q += strspn(q, " \t\r\n");
+            if (*q++ != '"') break;
+            int len = strcspn(q, "\"");
+            place_reference(entries, count, q, len, next);
+            p = q + len - 1;
+            break;
+        }
+        ++p;
+    }
+}
+
+static int compare_entries(const void *a, const void *b) {
+    const Entry *ea = (const Entry *) a, *eb = (const Entry *) b;
+    if (ea->group != eb->group) return ea->group - eb->group;
+    if (ea->order != eb->order) return ea->order - eb->order;
+    unsigned len = ea->name_len < eb->name_len ? ea->name_len : eb->name_len;
+    int diff = memcmp(ea->name, eb->name, len);
+    return diff ? diff : (int) ea->name_len - (int) eb->name_len;
+}
+
+static void order_entries(Entry *entries, int count, const char *script) {
+    int i, next = 0;
+    for (i = 0; i < count; ++i) {
+        Entry *e = &entries[i];
+        e->group = e->name_len >= 9 && !memcmp(e->name, "META-INF/", 9)
+                ? GROUP_META_INF : GROUP_NONE;
+    }
+
+    if (script != NULL) place_script_references(entries, count, script, &next);
+
+    for (i = 0; i < count; ++i) {
+        Entry *e = &entries[i];
+        if (e->group == GROUP_NONE) {
+            e->group = is_image(e) ? GROUP_IMAGE : GROUP_UNUSED;
+            e->order = next;
+        }
+    }
+
+    qsort(entries, count, sizeof(*entries), compare_entries);
+}
+
+static void write_or_die(FILE *out, const void *data, size_t len,
+        const char *path) {
+    if (len > 0 && fwrite(data, 1, len, out) != len) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+}
+
+/*
+ * Write the entries to 'path' in their current order, aligning STORED
+ * data to 'alignment' bytes.  Returns the bytes of padding added.
+ */
+static unsigned write_package(const char *path, Entry *entries, int count,
+        const unsigned char *eocd, unsigned alignment) {
+    FILE *out = fopen(path, "wb");
+    if (out == NULL) {
+        perror(path);
+        exit(1);
+    }
+
+    static const unsigned char zeros[DEFAULT_ALIGNMENT * 2];
+    unsigned offset = 0, padding = 0;
+    int i;
+    for (i = 0; i < count; ++i) {
+        Entry *e = &entries[i];
+        unsigned extra_len = 0;
+        if (e->method == STORED && e->comp_len > 0 && alignment > 1) {
+            unsigned data = offset + LOCHDR + e->name_len;
+            unsigned pad = (alignment - data % alignment) % alignment;
+            if (pad > 0 && pad < ALIGNMENT_EXTRA_MIN) pad += alignment;
+            extra_len = pad;
+            padding += pad;
+        }
+
+        // Sizes go in the local header, so no data descriptor is needed.
+        unsigned char loc[LOCHDR];
+        put4LE(loc, LOCSIG);
+        put2LE(loc + 4, e->version);
+        put2LE(loc + 6, e->flags);
+        put2LE(loc + 8, e->method);
+        put4LE(loc + 10, get4LE(e->cen + 12));             // time and date
+        put4LE(loc + 14, get4LE(e->cen + 16));             // crc
+        put4LE(loc + 18, e->comp_len);
+        put4LE(loc + 22, e->uncomp_len);
+        put2LE(loc + 26, e->name_len);
+        put2LE(loc + 28, extra_len);
+        write_or_die(out, loc, LOCHDR, path);
+        write_or_die(out, e->name, e->name_len, path);
+        if (extra_len > 0) {
+            unsigned char extra[ALIGNMENT_EXTRA_MIN];
+            put2LE(extra, ALIGNMENT_EXTRA_ID);
+            put2LE(extra + 2, extra_len - 4);
+            put2LE(extra + 4, alignment);
+            write_or_die(out, extra, sizeof(extra), path);
+            write_or_die(out, zeros, extra_len - sizeof(extra), path);
+        }
+
+        e->out_offset = offset;
+        e->out_data = offset + LOCHDR + e->name_len + extra_len;
+        write_or_die(out, e->data, e->comp_len, path);
+        offset = e->out_data + e->comp_len;
+    }
+
+    unsigned cd_offset = offset;
+    for (i = 0; i < count; ++i) {
+        const Entry *e = &entries[i];
+        unsigned rest = get2LE(e->cen + 30) + get2LE(e->cen + 32);
+        unsigned char cen[CENHDR];
+        memcpy(cen, e->cen, CENHDR);
+        put2LE(cen + 6, e->version);
+        put2LE(cen + 8, e->flags);
+        put2LE(cen + 10, e->method);
+        put4LE(cen + 20, e->comp_len);
+        put4LE(cen + 42, e->out_offset);
+        write_or_die(out, cen, CENHDR, path);
+        write_or_die(out, e->cen + CENHDR, e->name_len + rest, path);
+        offset += CENHDR + e->name_len + rest;
+    }
+
+    unsigned comment_len = get2LE(eocd + 20);
+    unsigned char end[ENDHDR];
+    memcpy(end, eocd, ENDHDR);
+    put4LE(end + 12, offset - cd_offset);
+    put4LE(end + 16, cd_offset);
+    write_or_die(out, end, ENDHDR, path);
+    write_or_die(out, eocd + ENDHDR, comment_len, path);
+
+    if (fclose(out)) {
+        perror(path);
+        exit(1);
+    }
+    return padding;
+}
+
+// One line per entry: data offset, compressed and uncompressed size,
+// method (0 stored, 8 deflated), name.  In file order.
+static void write_index(const char *path, const Entry *entries, int count) {
+    FILE *out = fopen(path, "w");
+    if (out == NULL) {
+        perror(path);
+        exit(1);
+    }
+    int i;
+    for (i = 0; i < count; ++i) {
+        const Entry *e = &entries[i];
+        fprintf(out, "%u %u %u %u %.*s\n", e->out_data, e->comp_len,
+                e->uncomp_len, e->method, e->name_len, e->name);
+    }
+    if (fclose(out)) {
+        perror(path);
+        exit(1);
+    }
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr, "usage: %s [-k] [-c calibration.txt] [-a alignment] "
+            "[-i index.txt] input.zip output.zip\n", argv0);
+    exit(2);
+}
+
+int main(int argc, char *argv[]) {
+    unsigned alignment = DEFAULT_ALIGNMENT;
+    const char *index_path = NULL;
+    int keep_compression = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "a:c:i:k")) != -1) {
+        switch (opt) {
+            case 'a': {
+                char *end;
+                alignment = strtoul(optarg, &end, 0);
+                if (*end != '\0' || alignment == 0 ||
+                    alignment > DEFAULT_ALIGNMENT ||
+                    (alignment & (alignment - 1))) {
+                    fprintf(stderr, "alignment must be a power of 2, "
+                            "up to %d\n", DEFAULT_ALIGNMENT);
+                    return 2;
+                }
+                break;
+            }
+            case 'c': load_calibration(optarg); break;
+            case 'i': index_path = optarg; break;
+            case 'k': keep_compression = 1; break;
+            default: usage(argv[0]);
+        }
+    }
+    if (optind + 2 != argc) usage(argv[0]);
+    const char *in_path = argv[optind], *out_path = argv[optind + 1];
+    if (!strcmp(in_path, out_path)) {
+        fprintf(stderr, "can't rewrite %s in place\n", in_path);
+        return 2;
+    }
+
+    size_t len;
+    const unsigned char *zip = read_file(in_path, &len);
+    const unsigned char *eocd;
+    int count;
+    Entry *entries = read_entries(zip, len, &count, &eocd);
+    if (get2LE(eocd + 20) > 0) {
+        fprintf(stderr, "warning: %s has an archive comment; "
+                "a whole-file signature in it won't survive\n", in_path);
+    }
+
+    char *script = NULL;
+    const char **name;
+    for (name = SCRIPT_NAMES; *name != NULL && script == NULL; ++name) {
+        const Entry *e = find_entry(entries, count, *name, strlen(*name));
+        if (e != NULL) script = read_entry(e);
+    }
+    if (script == NULL) {
+        fprintf(stderr, "warning: no update script in %s; "
+                "ordering entries by name\n", in_path);
+    }
+
+    int i;
+    double before = 0, after = 0;
+    for (i = 0; i < count; ++i) {
+        Entry *e = &entries[i];
+        before += device_time(e->method, e->comp_len, e->uncomp_len);
+        if (!keep_compression) choose_compression(e);
+        after += device_time(e->method, e->comp_len, e->uncomp_len);
+    }
+
+    order_entries(entries, count, script);
+    unsigned padding = write_package(out_path, entries, count, eocd, alignment);
+    if (index_path != NULL) write_index(index_path, entries, count);
+
+    int stored = 0;
+    for (i = 0; i < count; ++i) stored += entries[i].method == STORED;
+    fprintf(stderr, "%s: %d entries (%d stored, aligned to %u), "
+            "%u bytes of padding\n", out_path, count, stored, alignment,
+            padding);
+    fprintf(stderr, "reading and inflating on the device: about %.2f s "
+            "(was %.2f s)\n", after, before);
+    return 0;
+}
@@ -0,0 +1,521 @@
+/*
+ * Copyright (C) 2009 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "bzlib.h"
+
+/*
+ * Make a binary patch from one version of a file (or partition image)
+ * to the next, in the BSDIFF40 format that apply_patch() understands.
+ *
+ * The target is cut into blocks that are diffed independently, one per
+ * core at a time, against an index of the whole source.  Each block's
+ * instructions only read its own part of the target, so the work splits
+ * cleanly, and a block boundary only costs a seek in the patch.
+ *
+ * A patch is a list of (diff, extra, seek) instructions: add the next
+ * 'diff' bytes of the diff stream to as many source bytes, append the
+ * next 'extra' bytes of the extra stream unchanged, then move the source
+ * position by 'seek'.  Near-matches leave mostly zeros in the diff
+ * stream, which bzip2 squeezes well.
+ */
+
+#define DEFAULT_BLOCK_SIZE (1024 * 1024)
+
+// Source windows of WINDOW bytes, taken every STRIDE bytes, are hashed;
+// any match of WINDOW + STRIDE - 1 bytes or more will be found.
+#define WINDOW 16
+#define STRIDE 4
+#define MAX_CANDIDATES 32
+
+// A new match has to beat the current alignment by this many bytes
+// before it's worth the instruction (24 bytes, before compression).
+#define MIN_GAIN 8
+
+typedef struct {
+    const unsigned char *data;
+    size_t size;
+} Buffer;
+
+typedef struct {
+    uint32_t *heads;        // hash -> first source position + 1, or 0
+    uint32_t *next;         // source position / STRIDE -> next + 1, or 0
+    unsigned bits;
+} SourceIndex;
+
+typedef struct {
+    int64_t *ctrl;          // diff, extra, seek triples
+    int ctrl_count, ctrl_alloc;
+    unsigned char *diff;
+    size_t diff_len;
+    unsigned char *extra;
+    size_t extra_len;
+    int64_t start_pos;      // source position the block starts at
+    int64_t end_pos;        // source position after the last instruction
+} BlockPatch;
+
+typedef struct {
+    const Buffer *source, *target;
+    const SourceIndex *index;
+    size_t block_size;
+    BlockPatch *blocks;
+    int block_count;
+
+    pthread_mutex_t lock;
+    int next_block;
+} DiffJob;
+
+static void *xmalloc(size_t size) {
+    void *p = malloc(size > 0 ? size : 1);
+    if (p == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    return p;
+}
+
+static double now() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void read_file(const char *path, Buffer *buf) {
+    FILE *fp = fopen(path, "rb");
+    struct stat st;
+    if (fp == NULL || fstat(fileno(fp), &st)) {
+        perror(path);
+        exit(1);
+    }
+    if (st.st_size >= UINT32_MAX / 2) {
+        fprintf(stderr, "%s: too big\n", path);
+        exit(1);
+    }
+    unsigned char *data = xmalloc(st.st_size);
+    if (fread(data, 1, st.st_size, fp) != (size_t) st.st_size) {
+        fprintf(stderr, "%s: short read\n", path);
+        exit(1);
+    }
+    fclose(fp);
+    buf->data = data;
+    buf->size = st.st_size;
+}
+
+static uint32_t hash_window(const unsigned char *p, unsigned bits) {
+    uint64_t a, b;
+    memcpy(&a, p, 8);
+    memcpy(&b, p + 8, 8);
+    uint64_t h = (a * 0x9e3779b97f4a7c15ULL) ^ (b * 0xc2b2ae3d27d4eb4fULL);
+    return (uint32_t) (h >> (64 - bits));
+}
+
+static void build_index(const Buffer *source, SourceIndex *index) {
+    size_t windows = source->size >= WINDOW
+            ? (source->size - WINDOW) / STRIDE + 1 : 0;
+    index->bits = 10;
+    while ((1u << index->bits) < windows && index->bits < 28) ++index->bits;
+    index->heads = calloc(1u << index->bits, sizeof(uint32_t));
+    index->next = calloc(windows + 1, sizeof(uint32_t));
+    if (index->heads == NULL || index->next == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+
+    // Insert back to front, so each chain lists the earliest copy first.
+    size_t w;
+    for (w = windows; w-- > 0; ) {
+        uint32_t h = hash_window(source->data + w * STRIDE, index->bits);
+        index->next[w] = index->heads[h];
+        index->heads[h] = w * STRIDE + 1;
+    }
+}
+
+static size_t match_length(const unsigned char *a, size_t a_len,
+        const unsigned char *b, size_t b_len) {
+    size_t n = a_len < b_len ? a_len : b_len, i = 0;
+    while (i < n && a[i] == b[i]) ++i;
+    return i;
+}
+
+/*
+ * Find the longest exact match for target[scan..end) in the source.
+ * Returns its length (0 if none) and sets *pos.
+ */
+static size_t find_match(const DiffJob *job, size_t scan, size_t end,
+        size_t *pos) {
+    const Buffer *src = job->source;
+    const unsigned char *tgt = job->target->data;
+    size_t best = 0, d;
+    for (d = 0; d < STRIDE && scan + d + WINDOW <= end; ++d) {
+        uint32_t h = hash_window(tgt + scan + d, job->index->bits);
+        uint32_t c = job->index->heads[h];
+        int tries;
+        for (tries = 0; c != 0 && tries < MAX_CANDIDATES; ++tries) {
+            size_t p = c - 1;
+            c = job->index->next[p / STRIDE];
+            if (p < d) continue;
+            p -= d;
+            size_t len = match_length(src->data + p, src->size - p,
+                    tgt + scan, end - scan);
+            if (len > best) {
+                best = len;
+                *pos = p;
+            }
+        }
+    }
+    return best;
+}
+
+static void add_ctrl(BlockPatch *bp, int64_t diff, int64_t extra,
+        int64_t seek) {
+    if (bp->ctrl_count + 3 > bp->ctrl_alloc) {
+        bp->ctrl_alloc = bp->ctrl_alloc * 2 + 3;
+        bp->ctrl = realloc(bp->ctrl, bp->ctrl_alloc * sizeof(*bp->ctrl));
+        if (bp->ctrl == NULL) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+    }
+    bp->ctrl[bp->ctrl_count++] = diff;
+    bp->ctrl[bp->ctrl_count++] = extra;
+    bp->ctrl[bp->ctrl_count++] = seek;
+}
+
+/*
+ * Diff target[start..end) into 'bp'.  The block starts with the source
+ * position at the same offset (images mostly keep things in place);
+ * write_patch() adds the seek there from the end of the previous block.
+ *
+ * 'last_scan'/'last_pos' is where the previous match left off in the
+ * target and source.  Whenever a better match turns up at 'scan', the
+ * bytes in between are covered by stretching the previous match forward
+ * and the new one backward, as far as that pays off (more bytes the
+ * same than different), and the rest goes to the extra stream.
+ */
+static void diff_block(const DiffJob *job, size_t start, size_t end,
+        BlockPatch *bp) {
+    const unsigned char *src = job->source->data;
+    const unsigned char *tgt = job->target->data;
+    const int64_t src_size = job->source->size;
+
+    bp->diff = xmalloc(end - start);
+    bp->extra = xmalloc(end - start);
+
+    size_t last_scan = start, scan = start;
+    int64_t last_pos = (int64_t) start < src_size ? (int64_t) start : src_size;
+    int64_t offset = last_pos - (int64_t) start;
+    bp->start_pos = last_pos;
+    for (;;) {
+        size_t pos = 0, len = 0;
+
+        // Extend the current alignment as far as it goes, then look for
+        // a match that beats it.
+        for (; scan < end; ++scan) {
+            int64_t o = (int64_t) scan + offset;
+            if (o >= 0 && o < src_size && src[o] == tgt[scan]) continue;
+
+            len = find_match(job, scan, end, &pos);
+            if (len == 0) continue;
+
+            size_t i, same = 0;
+            for (i = scan; i < scan + len; ++i) {
+                o = (int64_t) i + offset;
+                if (o >= 0 && o < src_size && src[o] == tgt[i]) ++same;
+            }
+            if (len >= same + MIN_GAIN) break;
+            len = 0;
+        }
+
+        // How far the previous match stretches forward...
+        size_t i, fwd = 0;
+        int64_t score = 0, best = 0;
+        for (i = 0; last_scan + i < scan && last_pos + (int64_t) i < src_size;) {
+            score += src[last_pos + i] == tgt[last_scan + i] ? 1 : -1;
+            ++i;
+            if (score > best) {
+                best = score;
+                fwd = i;
+            }
+        }
+
+        // ...and the new one backward.
+        size_t back = 0;
+        if (len > 0) {
+            score = best = 0;
+            for (i = 1; scan >= last_scan + i && pos >= i; ++i) {
+                score += src[pos - i] == tgt[scan - i] ? 1 : -1;
+                if (score > best) {
+                    best = score;
+                    back = i;
+                }
+            }
+        }
+
+        // If they overlap, split the overlap where it's best for both.
+        if (last_scan + fwd > scan - back) {
+            size_t overlap = last_scan + fwd - (scan - back), split = 0;
+            score = best = 0;
+            for (i = 0; i < overlap; ++i) {
+                size_t t1 = last_scan + fwd - overlap + i;
+                size_t t2 = scan - back + i;
+                if (tgt[t1] == src[last_pos + t1 - last_scan]) ++score;
+                if (tgt[t2] == src[pos - back + i]) --score;
+                if (score > best) {
+                    best = score;
+                    split = i + 1;
+                }
+            }
+            fwd += split - overlap;
+            back -= split;
+        }
+
+        for (i = 0; i < fwd; ++i) {
+            bp->diff[bp->diff_len++] = tgt[last_scan + i] - src[last_pos + i];
+        }
+        size_t extra = (scan - back) - (last_scan + fwd);
+        memcpy(bp->extra + bp->extra_len, tgt + last_scan + fwd, extra);
+        bp->extra_len += extra;
+
+        int64_t next_pos = len > 0 ? (int64_t) (pos - back)
+                : last_pos + (int64_t) fwd;
+        add_ctrl(bp, fwd, extra, next_pos - (last_pos + (int64_t) fwd));
+
+        if (len == 0) {  // That covered the rest of the block.
+            bp->end_pos = next_pos;
+            break;
+        }
+
+        last_scan = scan - back;
+        last_pos = next_pos;
+        offset = (int64_t) pos - (int64_t) scan;
+        scan += len;
+    }
+}
+
+static void *diff_thread(void *cookie) {
+    DiffJob *job = (DiffJob *) cookie;
+    for (;;) {
+        pthread_mutex_lock(&job->lock);
+        int b = job->next_block++;
+        pthread_mutex_unlock(&job->lock);
+        if (b >= job->block_count) break;
+
+        size_t start = (size_t) b * job->block_size;
+        size_t end = start + job->block_size;
+        if (end > job->target->size) end = job->target->size;
+        diff_block(job, start, end, &job->blocks[b]);
+    }
+    return NULL;
+}
+
+typedef struct {
+    const unsigned char *data;
+    size_t len;
+    char *out;
+    unsigned int out_len;
+} Compression;
+
+static void *compress_thread(void *cookie) {
+    Compression *c = (Compression *) cookie;
+    unsigned int bound = c->len + c->len / 100 + 600;
+    c->out = xmalloc(bound);
+    c->out_len = bound;
+    if (BZ2_bzBuffToBuffCompress(c->out, &c->out_len, (char *) c->data,
+                c->len, 9, 0, 0) != BZ_OK) {
+        fprintf(stderr, "bzip2 failed\n");
+        exit(1);
+    }
+    return NULL;
+}
+
+static void put_offset(unsigned char *p, int64_t v) {
+    uint64_t m = v < 0 ? -v : v;
+    int i;
+    for (i = 0; i < 8; ++i) {
+        p[i] = m & 0xff;
+        m >>= 8;
+    }
+    if (v < 0) p[7] |= 0x80;
+}
+
+/*
+ * Join the blocks into one patch and write it to 'path'.  The last seek
+ * of each block is adjusted to go where the next block starts.  Returns
+ * the patch size.
+ */
+static size_t write_patch(const char *path, BlockPatch *blocks, int count,
+        size_t target_size, double *compress_sec) {
+    size_t ctrl_count = 0, diff_len = 0, extra_len = 0;
+    int b;
+    for (b = 0; b < count; ++b) {
+        ctrl_count += blocks[b].ctrl_count;
+        diff_len += blocks[b].diff_len;
+        extra_len += blocks[b].extra_len;
+    }
+
+    unsigned char *ctrl = xmalloc(ctrl_count * 8);
+    unsigned char *diff = xmalloc(diff_len);
+    unsigned char *extra = xmalloc(extra_len);
+    size_t c = 0, d = 0, e = 0;
+    for (b = 0; b < count; ++b) {
+        BlockPatch *bp = &blocks[b];
+        if (b + 1 < count && bp->ctrl_count > 0) {
+            bp->ctrl[bp->ctrl_count - 1] += blocks[b + 1].start_pos - bp->end_pos;
+        }
+        int i;
+        for (i = 0; i < bp->ctrl_count; ++i) {
+            put_offset(ctrl + (c++) * 8, bp->ctrl[i]);
+        }
+        memcpy(diff + d, bp->diff, bp->diff_len);
+        d += bp->diff_len;
+        memcpy(extra + e, bp->extra, bp->extra_len);
+        e += bp->extra_len;
+    }
+
+    // The three streams are compressed independently, so do them at once.
+    double start = now();
+    Compression streams[3] = {
+        { ctrl, ctrl_count * 8, NULL, 0 },
+        { diff, diff_len, NULL, 0 },
+        { extra, extra_len, NULL, 0 },
+    };
+    pthread_t threads[3];
+    int i;
+    for (i = 0; i < 3; ++i) {
+        pthread_create(&threads[i], NULL, compress_thread, &streams[i]);
+    }
+    for (i = 0; i < 3; ++i) pthread_join(threads[i], NULL);
+    *compress_sec = now() - start;
+
+    unsigned char header[32];
+    memcpy(header, "BSDIFF40", 8);
+    put_offset(header + 8, streams[0].out_len);
+    put_offset(header + 16, streams[1].out_len);
+    put_offset(header + 24, target_size);
+
+    FILE *out = fopen(path, "wb");
+    if (out == NULL) {
+        perror(path);
+        exit(1);
+    }
+    size_t size = sizeof(header);
+    int ok = fwrite(header, 1, sizeof(header), out) == sizeof(header);
+    for (i = 0; i < 3; ++i) {
+        ok = ok && fwrite(streams[i].out, 1, streams[i].out_len, out) ==
+                streams[i].out_len;
+        size += streams[i].out_len;
+        free(streams[i].out);
+    }
+    if (fclose(out) || !ok) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        unlink(path);
+        exit(1);
+    }
+
+    free(ctrl);
+    free(diff);
+    free(extra);
+    return size;
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr, "usage: %s [-j threads] [-b block_size] "
+            "source target patch\n", argv0);
+    exit(2);
+}
+
+int main(int argc, char *argv[]) {
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    long block_size = DEFAULT_BLOCK_SIZE;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "b:j:")) != -1) {
+        char *end;
+        switch (opt) {
+            case 'b':
+                block_size = strtol(optarg, &end, 0);
+                if (*end != '\0' || block_size < 4096) {
+                    fprintf(stderr, "block size must be at least 4096\n");
+                    return 2;
+                }
+                break;
+            case 'j':
+                threads = strtol(optarg, &end, 0);
+                if (*end != '\0' || threads < 1) usage(argv[0]);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (optind + 3 != argc) usage(argv[0]);
+    if (threads < 1) threads = 1;
+
+    Buffer source, target;
+    read_file(argv[optind], &source);
+    read_file(argv[optind + 1], &target);
+
+    double start = now();
+    SourceIndex index;
+    build_index(&source, &index);
+    double index_sec = now() - start;
+
+    DiffJob job;
+    memset(&job, 0, sizeof(job));
+    job.source = &source;
+    job.target = &target;
+    job.index = &index;
+    job.block_size = block_size;
+    job.block_count = (target.size + block_size - 1) / block_size;
+    job.blocks = calloc(job.block_count + 1, sizeof(*job.blocks));
+    if (job.blocks == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    pthread_mutex_init(&job.lock, NULL);
+
+    if (threads > job.block_count && job.block_count > 0) {
+        threads = job.block_count;
+    }
+    start = now();
+    pthread_t *tids = xmalloc(threads * sizeof(*tids));
+    long t;
+    for (t = 0; t < threads; ++t) {
+        pthread_create(&tids[t], NULL, diff_thread, &job);
+    }
+    for (t = 0; t < threads; ++t) pthread_join(tids[t], NULL);
+    double diff_sec = now() - start;
+
+    double compress_sec;
+    size_t size = write_patch(argv[optind + 2], job.blocks, job.block_count,
+            target.size, &compress_sec);
+
+    fprintf(stderr, "%s: %zu bytes (%.1f%% of %zu), %d blocks on %ld "
+            "threads; index %.2f s, diff %.2f s, compress %.2f s\n",
+            argv[optind + 2], size,
+            target.size ? 100.0 * size / target.size : 0.0, target.size,
+            job.block_count, threads, index_sec, diff_sec, compress_sec);
+    return 0;
+}
@@ -20,28 +20,110 @@
 #include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 /*
- * Recursively walk the directory tree at <sysdir>/<subdir>, writing
- * script commands to set permissions and create symlinks.
- * Assume the contents already have the specified default permissions,
- * so only output commands if they need to be changed from the defaults.
+ * The permission commands are run on the device by amend (see
+ * commands.c and dirSetHierarchyPermissions() in minzip/DirUtil.c).
+ * We count what each costs in system calls and pick the cheapest script.
+ *
+ * Every command starts by checking /proc/mounts (open, read, close).
+ * set_perm is then a chown and a chmod.  set_perm_recursive walks the
+ * whole subtree: lstat, chown and chmod for every entry, plus opendir,
+ * two getdents (the second one finds the end) and closedir for every
+ * directory.  Symlinks are created by the script after copy_dir, and
+ * a subtree is never walked after its own symlinks are made, so they
+ * cost nothing here.
+ */
+#define COMMAND_COST   3
+#define SET_PERM_COST  (COMMAND_COST + 2)
+#define WALK_FILE_COST 3
+#define WALK_DIR_COST  (WALK_FILE_COST + 4)
+
+/*
+ * Ownership and modes that a set_perm_recursive leaves behind.
+ * PERMS_UNKNOWN is the state after copy_dir, which matches nothing.
+ */
+typedef struct {
+    unsigned uid, gid, dir_mode, file_mode;
+} Perms;
+
+#define PERMS_UNKNOWN 0
+
+static Perms *all_perms = NULL;
+static int perms_count = 0, perms_alloc = 0;
+
+static int entry_count = 0;  // files and directories, not symlinks
+
+typedef struct Node {
+    char *name;
+    unsigned char type;           // DT_DIR, DT_LNK or DT_REG
+    unsigned uid, gid, mode;      // from fs_config()
+    char *link;                   // symlink target
+    struct Node *children;
+    int child_count, child_alloc;
+
+    // Indexed by the Perms the subtree has on entry: the cheapest cost
+    // from there, and the set_perm_recursive that achieves it (or -1).
+    long *cost;
+    int *choice;
+} Node;
+
+static void *xrealloc(void *p, size_t size) {
+    p = realloc(p, size);
+    if (p == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    return p;
+}
+
+static char *xstrdup(const char *s) {
+    return strcpy(xrealloc(NULL, strlen(s) + 1), s);
+}
+
+static int add_perms(unsigned uid, unsigned gid,
+        unsigned dir_mode, unsigned file_mode) {
+    int i;
+    for (i = PERMS_UNKNOWN + 1; i < perms_count; ++i) {
+        const Perms *p = &all_perms[i];
+        if (p->uid == uid && p->gid == gid &&
+            p->dir_mode == dir_mode && p->file_mode == file_mode) return i;
+    }
+    if (perms_count >= perms_alloc) {
+        perms_alloc = perms_alloc * 2 + 1;
+        all_perms = xrealloc(all_perms, perms_alloc * sizeof(*all_perms));
+    }
+    Perms *p = &all_perms[perms_count];
+    p->uid = uid;
+    p->gid = gid;
+    p->dir_mode = dir_mode;
+    p->file_mode = file_mode;
+    return perms_count++;
+}
+
+static int node_matches(const Node *n, int state) {
+    if (state == PERMS_UNKNOWN) return 0;
+    const Perms *p = &all_perms[state];
+    return n->uid == p->uid && n->gid == p->gid &&
+           n->mode == (n->type == DT_DIR ? p->dir_mode : p->file_mode);
+}
+
+/*
+ * Read the directory tree at <sysdir>/<subdir> into 'node'.
  *
  * Note that permissions are set by fs_config(), which uses a lookup table of
  * Android permissions.  They are not drawn from the build host filesystem.
  */
-static void walk_files(
-        const char *sysdir, const char *subdir,
-        unsigned default_uid, unsigned default_gid,
-        unsigned default_dir_mode, unsigned default_file_mode) {
+static void read_tree(const char *sysdir, const char *subdir, Node *node) {
     const char *sep = strcmp(subdir, "") ? "/" : "";
 
     char fn[PATH_MAX];
-    unsigned dir_uid = 0, dir_gid = 0, dir_mode = 0;
     snprintf(fn, PATH_MAX, "system%s%s", sep, subdir);
-    fs_config(fn, 1, &dir_uid, &dir_gid, &dir_mode);
+    fs_config(fn, 1, &node->uid, &node->gid, &node->mode);
+    ++entry_count;
 
     snprintf(fn, PATH_MAX, "%s%s%s", sysdir, sep, subdir);
     DIR *dir = opendir(fn);
@@ -50,28 +132,24 @@ static void walk_files(
         exit(1);
     }
 
-    /*
-     * We can use "set_perm" and "set_perm_recursive" to set file permissions
-     * (owner, group, and file mode) for individual files and entire subtrees.
-     * We want to use set_perm_recursive efficiently to avoid setting the
-     * permissions of every single file in the system image individually.
-     *
-     * What we do is recursively set our entire subtree to the permissions
-     * used by the first file we encounter, and then use "set_perm" to adjust
-     * the permissions of subsequent files which don't match the first one.
-     * This is bad if the first file is an outlier, but it generally works.
-     * Subdirectories can do the same thing recursively if they're different.
-     */
-
-    int is_first = 1;
     const struct dirent *e;
     while ((e = readdir(dir))) {
         // Skip over "." and ".." entries
         if (!strcmp(e->d_name, ".") || !strcmp(e->d_name, "..")) continue;
 
+        if (node->child_count >= node->child_alloc) {
+            node->child_alloc = node->child_alloc * 2 + 1;
+            node->children = xrealloc(node->children,
+                    node->child_alloc * sizeof(*node->children));
+        }
+        Node *child = &node->children[node->child_count++];
+        memset(child, 0, sizeof(*child));
+        child->name = xstrdup(e->d_name);
+
         if (e->d_type == DT_LNK) {  // Symlink
 
             // Symlinks don't really have permissions, so this is orthogonal.
+            child->type = DT_LNK;
             snprintf(fn, PATH_MAX, "%s/%s%s%s", sysdir, subdir, sep, e->d_name);
             int len = readlink(fn, fn, PATH_MAX - 1);
             if (len <= 0) {
@@ -79,78 +157,185 @@ static void walk_files(
                 exit(1);
             }
             fn[len] = '\0';
-            printf("symlink %s SYSTEM:%s%s%s\n", fn, subdir, sep, e->d_name);
+            child->link = xstrdup(fn);
 
         } else if (e->d_type == DT_DIR) {  // Subdirectory
 
-            // Use the parent directory as the model for default permissions.
-            // We haven't seen a file, so just make up some file defaults.
-            if (is_first && (
-                    dir_mode != default_dir_mode ||
-                    dir_uid != default_uid || dir_gid != default_gid)) {
-                default_uid = dir_uid;
-                default_gid = dir_gid;
-                default_dir_mode = dir_mode;
-                default_file_mode = dir_mode & default_file_mode & 0666;
-                printf("set_perm_recursive %d %d 0%o 0%o SYSTEM:%s\n",
-                         default_uid, default_gid,
-                         default_dir_mode, default_file_mode,
-                         subdir);
-            }
-
-            is_first = 0;
-
-            // Recursively handle the subdirectory.
-            // Note, the recursive call handles the directory's own permissions.
+            child->type = DT_DIR;
             snprintf(fn, PATH_MAX, "%s%s%s", subdir, sep, e->d_name);
-            walk_files(sysdir, fn,
-                    default_uid, default_gid,
-                    default_dir_mode, default_file_mode);
+            read_tree(sysdir, fn, child);
 
         } else {  // Ordinary file
 
-            // Get the file's desired permissions.
-            unsigned file_uid = 0, file_gid = 0, file_mode = 0;
+            child->type = DT_REG;
             snprintf(fn, PATH_MAX, "system/%s%s%s", subdir, sep, e->d_name);
-            fs_config(fn, 0, &file_uid, &file_gid, &file_mode);
-
-            // If this is the first file, its mode gets to become the default.
-            if (is_first && (
-                    dir_mode != default_dir_mode ||
-                    file_mode != default_file_mode ||
-                    dir_uid != default_uid || file_uid != default_uid ||
-                    dir_gid != default_gid || file_gid != default_gid)) {
-                default_uid = dir_uid;
-                default_gid = dir_gid;
-                default_dir_mode = dir_mode;
-                default_file_mode = file_mode;
-                printf("set_perm_recursive %d %d 0%o 0%o SYSTEM:%s\n",
-                         default_uid, default_gid,
-                         default_dir_mode, default_file_mode,
-                         subdir);
-            }
+            fs_config(fn, 0, &child->uid, &child->gid, &child->mode);
+            ++entry_count;
+
+        }
+    }
+
+    closedir(dir);
+}
+
+/*
+ * Collect the states a set_perm_recursive could usefully establish:
+ * each directory's ownership and mode, paired with the mode of every
+ * file with the same owner (or, failing that, the directory mode
+ * without execute bits).
+ */
+static void collect_perms(const Node *node) {
+    int i, paired = 0;
+    for (i = 0; i < node->child_count; ++i) {
+        const Node *child = &node->children[i];
+        if (child->type == DT_DIR) {
+            collect_perms(child);
+        } else if (child->type == DT_REG &&
+                   child->uid == node->uid && child->gid == node->gid) {
+            add_perms(node->uid, node->gid, node->mode, child->mode);
+            paired = 1;
+        }
+    }
+    if (!paired) {
+        add_perms(node->uid, node->gid, node->mode, node->mode & 0666);
+    }
+}
+
+/*
+ * Fill in node->cost and node->choice for every entry state, bottom up.
+ * Returns the cost of walking the subtree with set_perm_recursive.
+ */
+static long plan_tree(Node *node) {
+    long walk = WALK_DIR_COST;
+    long *direct = xrealloc(NULL, perms_count * sizeof(*direct));
+    int i, s;
 
-            is_first = 0;
+    for (s = 0; s < perms_count; ++s) {
+        direct[s] = node_matches(node, s) ? 0 : SET_PERM_COST;
+    }
 
-            // Otherwise, override this file if it doesn't match the defaults.
-            if (file_mode != default_file_mode ||
-                file_uid != default_uid || file_gid != default_gid) {
-                printf("set_perm %d %d 0%o SYSTEM:%s%s%s\n",
-                         file_uid, file_gid, file_mode,
-                         subdir, sep, e->d_name);
+    for (i = 0; i < node->child_count; ++i) {
+        Node *child = &node->children[i];
+        if (child->type == DT_DIR) {
+            walk += plan_tree(child);
+            for (s = 0; s < perms_count; ++s) direct[s] += child->cost[s];
+        } else if (child->type == DT_REG) {
+            walk += WALK_FILE_COST;
+            for (s = 0; s < perms_count; ++s) {
+                if (!node_matches(child, s)) direct[s] += SET_PERM_COST;
             }
+        }
+    }
 
+    // The best set_perm_recursive here is the same whatever came before.
+    int best = -1;
+    long best_cost = 0;
+    for (s = PERMS_UNKNOWN + 1; s < perms_count; ++s) {
+        if (best < 0 || direct[s] < best_cost) {
+            best = s;
+            best_cost = direct[s];
         }
     }
+    best_cost += COMMAND_COST + walk;
+
+    node->cost = xrealloc(NULL, perms_count * sizeof(*node->cost));
+    node->choice = xrealloc(NULL, perms_count * sizeof(*node->choice));
+    for (s = 0; s < perms_count; ++s) {
+        if (best >= 0 && best_cost < direct[s]) {
+            node->cost[s] = best_cost;
+            node->choice[s] = best;
+        } else {
+            node->cost[s] = direct[s];
+            node->choice[s] = -1;
+        }
+    }
+
+    free(direct);
+    return walk;
+}
 
-    // Set the directory's permissions directly, if they never got set.
-    if (dir_mode != default_dir_mode ||
-        dir_uid != default_uid || dir_gid != default_gid) {
+typedef struct {
+    int recursive, single, symlinks;
+    long syscalls;
+} ScriptStats;
+
+/*
+ * Write the commands chosen by plan_tree() for the tree at SYSTEM:<subdir>,
+ * given the permissions it has on entry.  Commands are written parent
+ * first, so later ones override what a set_perm_recursive did.
+ */
+static void write_tree(const Node *node, const char *subdir, int state,
+        ScriptStats *stats) {
+    const char *sep = strcmp(subdir, "") ? "/" : "";
+    char fn[PATH_MAX];
+    int i;
+
+    if (node->choice[state] >= 0) {
+        state = node->choice[state];
+        const Perms *p = &all_perms[state];
+        printf("set_perm_recursive %d %d 0%o 0%o SYSTEM:%s\n",
+                p->uid, p->gid, p->dir_mode, p->file_mode, subdir);
+        ++stats->recursive;
+    }
+
+    if (!node_matches(node, state)) {
         printf("set_perm %d %d 0%o SYSTEM:%s\n",
-                dir_uid, dir_gid, dir_mode, subdir);
+                node->uid, node->gid, node->mode, subdir);
+        ++stats->single;
     }
 
-    closedir(dir);
+    for (i = 0; i < node->child_count; ++i) {
+        const Node *child = &node->children[i];
+        if (child->type == DT_LNK) {
+            printf("symlink %s SYSTEM:%s%s%s\n",
+                    child->link, subdir, sep, child->name);
+            ++stats->symlinks;
+        } else if (child->type == DT_DIR) {
+            snprintf(fn, PATH_MAX, "%s%s%s", subdir, sep, child->name);
+            write_tree(child, fn, state, stats);
+        } else if (!node_matches(child, state)) {
+            printf("set_perm %d %d 0%o SYSTEM:%s%s%s\n",
+                    child->uid, child->gid, child->mode,
+                    subdir, sep, child->name);
+            ++stats->single;
+        }
+    }
+}
+
+/*
+ * Write script commands to set permissions and create symlinks for the
+ * directory tree at <sysdir>.  The contents are assumed to have unknown
+ * permissions after copy_dir, so every entry gets set one way or another.
+ *
+ * We can use "set_perm" and "set_perm_recursive" to set file permissions
+ * (owner, group, and file mode) for individual files and entire subtrees.
+ * A set_perm_recursive is cheap to write but touches everything below it,
+ * so using one on a directory whose contents then mostly get overridden
+ * costs more than it saves.  plan_tree() finds, for every directory and
+ * every set of permissions it could inherit, whether a set_perm_recursive
+ * there (and with which permissions) minimizes the total system calls.
+ */
+static void walk_files(const char *sysdir) {
+    Node root;
+    memset(&root, 0, sizeof(root));
+    read_tree(sysdir, "", &root);
+
+    add_perms(0, 0, 0, 0);  // PERMS_UNKNOWN
+    collect_perms(&root);
+    plan_tree(&root);
+
+    ScriptStats stats;
+    memset(&stats, 0, sizeof(stats));
+    write_tree(&root, "", PERMS_UNKNOWN, &stats);
+    stats.syscalls = root.cost[PERMS_UNKNOWN];
+
+    // For comparison: a set_perm for every file and directory.
+    long individual = (long) entry_count * SET_PERM_COST;
+
+    fprintf(stderr, "permissions: %d set_perm_recursive, %d set_perm, "
+            "%d symlink; about %ld syscalls (%ld with set_perm only)\n",
+            stats.recursive, stats.single, stats.symlinks,
+            stats.syscalls, individual);
 }
 
 /*
@@ -219,8 +404,7 @@ int main(int argc, char *argv[]) {
     printf("copy_dir PACKAGE:system SYSTEM:\n");
 
     // walk the files in the system image, set their permissions, etc.
-    // use -1 for default values to force permissions to be set explicitly.
-    walk_files(argv[1], "", -1, -1, -1, -1);
+    walk_files(argv[1]);
 
     // as the last step, write the boot sector.
     printf("show_progress 0.2 0\n");
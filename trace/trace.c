@@ -0,0 +1,197 @@
+/*
+ * Copyright (C) 2009 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+#define TRACE_DETAIL_SIZE 40
+
+typedef struct {
+    const char *name;
+    char detail[TRACE_DETAIL_SIZE];
+    long long start_us;
+    long long dur_us;       // -1 while the span is open
+    long long bytes;
+    int tid;
+} TraceEvent;
+
+static TraceEvent *g_events = NULL;
+static int g_max_events = 0;
+static volatile int g_next_event = 0;   // may run past g_max_events
+
+// Spans read by trace_import(), as the JSON objects from the other
+// process's traceEvents list, comma-separated.
+static char *g_imported = NULL;
+static size_t g_imported_len = 0;
+static int g_imported_dropped = 0;
+
+static long long now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int trace_init(int max_events) {
+    if (g_events != NULL) return 0;
+    TraceEvent *events = (TraceEvent *) calloc(max_events, sizeof(*events));
+    if (events == NULL) return -1;
+    g_max_events = max_events;
+    g_events = events;
+    return 0;
+}
+
+int trace_begin(const char *name, const char *detail) {
+    if (g_events == NULL) return -1;
+    return trace_begin_n(name, detail, detail != NULL ? strlen(detail) : 0);
+}
+
+int trace_begin_n(const char *name, const char *detail, int detail_len) {
+    if (g_events == NULL) return -1;
+    int span = __sync_fetch_and_add(&g_next_event, 1);
+    if (span >= g_max_events) return -1;
+
+    TraceEvent *e = &g_events[span];
+    e->name = name;
+    if (detail != NULL) {
+        if (detail_len > (int) sizeof(e->detail) - 1) {
+            detail_len = sizeof(e->detail) - 1;
+        }
+        memcpy(e->detail, detail, detail_len);
+    }
+    e->tid = (int) syscall(__NR_gettid);
+    e->bytes = 0;
+    e->dur_us = -1;
+    e->start_us = now_us();
+    return span;
+}
+
+void trace_end(int span, long long bytes) {
+    if (span < 0 || g_events == NULL) return;
+    TraceEvent *e = &g_events[span];
+    e->bytes = bytes;
+    e->dur_us = now_us() - e->start_us;
+}
+
+/* Write a string as a JSON string literal. */
+static void write_json_string(FILE *f, const char *s) {
+    fputc('"', f);
+    for (; *s != '\0'; ++s) {
+        unsigned char c = (unsigned char) *s;
+        if (c == '"' || c == '\\') {
+            fprintf(f, "\\%c", c);
+        } else if (c < 0x20) {
+            fprintf(f, "\\u%04x", c);
+        } else {
+            fputc(c, f);
+        }
+    }
+    fputc('"', f);
+}
+
+int trace_write(const char *path) {
+    if (g_events == NULL) return -1;
+    FILE *f = fopen(path, "w");
+    if (f == NULL) return -1;
+
+    long long now = now_us();
+    int count = g_next_event;
+    int dropped = 0;
+    if (count > g_max_events) {
+        dropped = count - g_max_events;
+        count = g_max_events;
+    }
+
+    fprintf(f, "{\"traceEvents\":[\n");
+    int i, first = 1;
+    for (i = 0; i < count; ++i) {
+        const TraceEvent *e = &g_events[i];
+        if (e->name == NULL) continue;  // claimed but not yet filled in
+        long long dur = e->dur_us >= 0 ? e->dur_us : now - e->start_us;
+        fprintf(f, "%s{\"name\":", first ? "" : ",\n");
+        write_json_string(f, e->name);
+        fprintf(f, ",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+                "\"ts\":%lld,\"dur\":%lld,\"args\":{",
+                (int) getpid(), e->tid, e->start_us, dur);
+        fprintf(f, "\"bytes\":%lld", e->bytes);
+        if (e->detail[0] != '\0') {
+            fprintf(f, ",\"detail\":");
+            write_json_string(f, e->detail);
+        }
+        if (e->dur_us < 0) fprintf(f, ",\"unfinished\":true");
+        fprintf(f, "}}");
+        first = 0;
+    }
+    if (g_imported_len > 0) {
+        fprintf(f, "%s", first ? "" : ",\n");
+        fwrite(g_imported, 1, g_imported_len, f);
+    }
+    fprintf(f, "\n],\"displayTimeUnit\":\"ms\",\"otherData\":"
+            "{\"dropped_spans\":%d}}\n", dropped + g_imported_dropped);
+
+    int result = ferror(f) ? -1 : 0;
+    if (fclose(f) != 0) result = -1;
+    return result;
+}
+
+int trace_import(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) return -1;
+    char *text = NULL;
+    long len = -1;
+    if (fseek(f, 0, SEEK_END) == 0 && (len = ftell(f)) >= 0 &&
+        fseek(f, 0, SEEK_SET) == 0 && (text = malloc(len + 1)) != NULL) {
+        len = fread(text, 1, len, f);
+        text[len] = '\0';
+    }
+    fclose(f);
+    if (text == NULL) return -1;
+
+    // Pick the events out of the layout trace_write() produces.
+    static const char kStart[] = "{\"traceEvents\":[\n";
+    char *events = strstr(text, kStart);
+    char *end = strstr(text, "\n],");
+    char *other = strstr(text, "\"dropped_spans\":");
+    if (events == NULL || end == NULL || end < events) {
+        free(text);
+        return -1;
+    }
+    events += sizeof(kStart) - 1;
+    size_t events_len = end > events ? end - events : 0;
+
+    if (events_len > 0) {
+        size_t sep = g_imported_len > 0 ? 2 : 0;
+        char *grown = realloc(g_imported, g_imported_len + sep + events_len);
+        if (grown == NULL) {
+            free(text);
+            return -1;
+        }
+        g_imported = grown;
+        if (sep) memcpy(g_imported + g_imported_len, ",\n", sep);
+        memcpy(g_imported + g_imported_len + sep, events, events_len);
+        g_imported_len += sep + events_len;
+    }
+    if (other != NULL) {
+        g_imported_dropped += atoi(other + strlen("\"dropped_spans\":"));
+    }
+    free(text);
+    return 0;
+}
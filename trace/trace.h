@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2009 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef TRACE_H_
+#define TRACE_H_
+
+/* Timing spans for the phases of recovery (mounting, verifying,
+ * extracting, flashing...), kept in a buffer allocated once up front
+ * and written out in Chrome's trace format ("about:tracing").
+ *
+ * Until trace_init() is called every function here is a cheap no-op,
+ * so libraries can be instrumented without caring whether the program
+ * they're linked into traces.  Spans may be begun and ended from any
+ * thread; recording one takes no locks.
+ */
+
+#define TRACE_DEFAULT_EVENTS 8192
+
+/* Allocate room for 'max_events' spans and start the clock.  Spans
+ * beyond that are dropped (and counted).  Returns 0 on success.
+ */
+int trace_init(int max_events);
+
+/* Start a span.  'name' must be a string constant (it isn't copied);
+ * 'detail', which may be NULL, is copied and truncated.  Returns a
+ * handle for trace_end(), or -1 if tracing is off or the buffer is full
+ * (trace_end() accepts that too).
+ */
+int trace_begin(const char *name, const char *detail);
+
+/* trace_begin() for a detail that isn't NUL-terminated. */
+int trace_begin_n(const char *name, const char *detail, int detail_len);
+
+/* Finish a span, recording 'bytes' moved during it (0 if that isn't
+ * meaningful).
+ */
+void trace_end(int span, long long bytes);
+
+/* Write every span so far to 'path' as JSON (spans still open are
+ * written as ending now), followed by any imported with
+ * trace_import().  Returns 0 on success.
+ */
+int trace_write(const char *path);
+
+/* Read the spans another process (the updater binary) wrote to 'path'
+ * with trace_write(), to be included when this one writes its trace.
+ * Both use the same monotonic clock, so the spans line up.  Not
+ * thread-safe; call it from the thread that calls trace_write().
+ * Returns 0 on success.
+ */
+int trace_import(const char *path);
+
+#endif  // TRACE_H_
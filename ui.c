@@ -70,6 +70,15 @@ static const struct { gr_surface* surface; const char *name; } BITMAPS[] = {
 
 static gr_surface gCurrentIcon = NULL;
 
+// ui_init_minimal() brings up only the framebuffer and a plain progress
+// bar; the bitmaps and input come later, with ui_init().
+static int gUiStarted = 0;      // framebuffer and progress thread are up
+static int gFullUi = 0;         // bitmaps are loaded and input is running
+static int gDeferredShowText;   // show_text to restore when gFullUi is set
+static int gCurrentIconIndex = -1;
+
+#define PLAIN_PROGRESS_HEIGHT 8
+
 static enum ProgressBarType {
     PROGRESSBAR_TYPE_NONE,
     PROGRESSBAR_TYPE_INDETERMINATE,
@@ -116,11 +125,48 @@ static void draw_background_locked(gr_surface icon)
     }
 }
 
+// Width of the progress bar, in pixels.
+static int progress_width()
+{
+    if (!gFullUi) return gr_fb_width() * 2 / 3;
+    return gr_get_width(gProgressBarIndeterminate[0]);
+}
+
+// The bitmap-free progress bar drawn before the full UI is up: a
+// filled rectangle, or a block sweeping across for indeterminate
+// progress.  Should only be called with gUpdateMutex locked.
+static void draw_plain_progress_locked()
+{
+    int width = progress_width();
+    int dx = (gr_fb_width() - width) / 2;
+    int dy = gr_fb_height() * 3 / 4;
+
+    gr_color(64, 64, 64, 255);
+    gr_fill(dx, dy, dx + width, dy + PLAIN_PROGRESS_HEIGHT);
+
+    gr_color(61, 233, 255, 255);
+    if (gProgressBarType == PROGRESSBAR_TYPE_NORMAL) {
+        float progress = gProgressScopeStart + gProgress * gProgressScopeSize;
+        gr_fill(dx, dy, dx + (int) (progress * width),
+                dy + PLAIN_PROGRESS_HEIGHT);
+    } else {
+        static int frame = 0;
+        int block = width / 4;
+        int x = frame * (width - block) / (PROGRESSBAR_INDETERMINATE_FPS - 1);
+        gr_fill(dx + x, dy, dx + x + block, dy + PLAIN_PROGRESS_HEIGHT);
+        frame = (frame + 1) % PROGRESSBAR_INDETERMINATE_FPS;
+    }
+}
+
 // Draw the progress bar (if any) on the screen.  Does not flip pages.
 // Should only be called with gUpdateMutex locked.
 static void draw_progress_locked()
 {
     if (gProgressBarType == PROGRESSBAR_TYPE_NONE) return;
+    if (!gFullUi) {
+        draw_plain_progress_locked();
+        return;
+    }
 
     int iconHeight = gr_get_height(gBackgroundIcon[BACKGROUND_ICON_INSTALLING]);
     int width = gr_get_width(gProgressBarIndeterminate[0]);
@@ -331,11 +377,8 @@ static void *input_thread(void *cookie)
     return NULL;
 }
 
-void ui_init(void)
+static void init_text_size()
 {
-    gr_init();
-    ev_init();
-
     text_col = text_row = 0;
     text_rows = gr_fb_height() / CHAR_HEIGHT;
     if (text_rows > MAX_ROWS) text_rows = MAX_ROWS;
@@ -343,6 +386,33 @@ void ui_init(void)
 
     text_cols = gr_fb_width() / CHAR_WIDTH;
     if (text_cols > MAX_COLS - 1) text_cols = MAX_COLS - 1;
+}
+
+void ui_init_minimal(void)
+{
+    if (gUiStarted) return;
+    gr_init();
+
+    pthread_mutex_lock(&gUpdateMutex);
+    init_text_size();
+    // The log is kept, but not drawn until ui_init().
+    gDeferredShowText = show_text;
+    show_text = 0;
+    pthread_mutex_unlock(&gUpdateMutex);
+
+    pthread_t t;
+    pthread_create(&t, NULL, progress_thread, NULL);
+    gUiStarted = 1;
+}
+
+void ui_init(void)
+{
+    if (gFullUi) return;
+    if (!gUiStarted) {
+        gr_init();
+        init_text_size();
+    }
+    ev_init();
 
     int i;
     for (i = 0; BITMAPS[i].name != NULL; ++i) {
@@ -353,9 +423,21 @@ void ui_init(void)
         }
     }
 
+    pthread_mutex_lock(&gUpdateMutex);
+    gFullUi = 1;
+    if (gUiStarted) {
+        show_text = gDeferredShowText;
+        if (gCurrentIconIndex >= 0) {
+            gCurrentIcon = gBackgroundIcon[gCurrentIconIndex];
+        }
+        update_screen_locked();
+    }
+    pthread_mutex_unlock(&gUpdateMutex);
+
     pthread_t t;
-    pthread_create(&t, NULL, progress_thread, NULL);
+    if (!gUiStarted) pthread_create(&t, NULL, progress_thread, NULL);
     pthread_create(&t, NULL, input_thread, NULL);
+    gUiStarted = 1;
 }
 
 char *ui_copy_image(int icon, int *width, int *height, int *bpp) {
@@ -379,6 +461,7 @@ void ui_set_background(int icon)
 {
     pthread_mutex_lock(&gUpdateMutex);
     gCurrentIcon = gBackgroundIcon[icon];
+    gCurrentIconIndex = icon;
     update_screen_locked();
     pthread_mutex_unlock(&gUpdateMutex);
 }
@@ -413,8 +496,7 @@ void ui_set_progress(float fraction)
     if (fraction > 1.0) fraction = 1.0;
     if (gProgressBarType == PROGRESSBAR_TYPE_NORMAL && fraction > gProgress) {
         // Skip updates that aren't visibly different.
-        int width = gr_get_width(gProgressBarIndeterminate[0]);
-        float scale = width * gProgressScopeSize;
+        float scale = progress_width() * gProgressScopeSize;
         if ((int) (gProgress * scale) != (int) (fraction * scale)) {
             gProgress = fraction;
             update_progress_locked();
@@ -442,7 +524,7 @@ void ui_print(const char *fmt, ...)
     vsnprintf(buf, 256, fmt, ap);
     va_end(ap);
 
-    fputs(buf, stderr);
+    log_write("%s", buf);
 
     // This can get called before ui_init(), so be careful.
     pthread_mutex_lock(&gUpdateMutex);
@@ -465,7 +547,7 @@ void ui_print(const char *fmt, ...)
             if (*ptr != '\n') text[text_row][text_col++] = *ptr;
         }
         text[text_row][text_col] = '\0';
-        update_screen_locked();
+        if (gFullUi || show_text) update_screen_locked();
     }
     pthread_mutex_unlock(&gUpdateMutex);
 }
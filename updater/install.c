@@ -31,6 +31,8 @@
 #include "minzip/DirUtil.h"
 #include "mtdutils/mounts.h"
 #include "mtdutils/mtdutils.h"
+#include "trace/trace.h"
+#include "install.h"
 #include "updater.h"
 
 
@@ -287,6 +289,13 @@ char* SetProgressFn(const char* name, State* state, int argc, Expr* argv[]) {
     return frac_str;
 }
 
+// mzExtractRecursive callback used when profiling, to charge the size
+// of each extracted file to the package_extract_dir() call.
+static void profile_extracted_file(const char* fn, void* cookie) {
+    struct stat st;
+    if (lstat(fn, &st) == 0) ProfileAddBytes(st.st_size);
+}
+
 // package_extract_dir(package_path, destination_path)
 char* PackageExtractDirFn(const char* name, State* state,
                           int argc, Expr* argv[]) {
@@ -304,7 +313,9 @@ char* PackageExtractDirFn(const char* name, State* state,
 
     bool success = mzExtractRecursive(za, zip_path, dest_path,
                                       MZ_EXTRACT_FILES_ONLY, &timestamp,
-                                      NULL, NULL);
+                                      ProfilingEnabled() ?
+                                          profile_extracted_file : NULL,
+                                      NULL);
     free(zip_path);
     free(dest_path);
     return strdup(success ? "t" : "");
@@ -338,6 +349,7 @@ char* PackageExtractFileFn(const char* name, State* state,
     }
     success = mzExtractZipEntryToFile(za, entry, fileno(f));
     fclose(f);
+    if (success) ProfileAddBytes(mzGetZipEntryUncompLen(entry));
 
   done:
     free(zip_path);
@@ -612,6 +624,7 @@ char* WriteRawImageFn(const char* name, State* state, int argc, Expr* argv[]) {
     int read;
     while (success && (read = fread(buffer, 1, BUFSIZ, f)) > 0) {
         int wrote = mtd_write_data(ctx, buffer, read);
+        if (wrote > 0) ProfileAddBytes(wrote);
         success = success && (wrote == read);
         if (!success) {
             fprintf(stderr, "mtd_write_data to %s failed: %s\n",
@@ -760,29 +773,66 @@ char* UIPrintFn(const char* name, State* state, int argc, Expr* argv[]) {
 }
 
 
+// Each of the functions below is registered as TracedFn(), which runs
+// it inside a trace span detailed with its name.  (Tracing is off
+// unless the updater was asked for a trace.)
+
+#define MAX_TRACED_FUNCTIONS 32
+
+static struct {
+    const char* name;
+    Function fn;
+} traced_functions[MAX_TRACED_FUNCTIONS];
+static int traced_count = 0;
+
+static char* TracedFn(const char* name, State* state, int argc, Expr* argv[]) {
+    int i;
+    for (i = 0; i < traced_count; ++i) {
+        if (strcmp(traced_functions[i].name, name) == 0) break;
+    }
+    if (i == traced_count) {
+        return ErrorAbort(state, "%s: not registered", name);
+    }
+    int span = trace_begin("command", name);
+    char* result = traced_functions[i].fn(name, state, argc, argv);
+    trace_end(span, 0);
+    return result;
+}
+
+static void RegisterTracedFunction(const char* name, Function fn) {
+    if (traced_count >= MAX_TRACED_FUNCTIONS) {
+        RegisterFunction(name, fn);
+        return;
+    }
+    traced_functions[traced_count].name = name;
+    traced_functions[traced_count].fn = fn;
+    ++traced_count;
+    RegisterFunction(name, TracedFn);
+}
+
 void RegisterInstallFunctions() {
-    RegisterFunction("mount", MountFn);
-    RegisterFunction("is_mounted", IsMountedFn);
-    RegisterFunction("unmount", UnmountFn);
-    RegisterFunction("format", FormatFn);
-    RegisterFunction("show_progress", ShowProgressFn);
-    RegisterFunction("set_progress", SetProgressFn);
-    RegisterFunction("delete", DeleteFn);
-    RegisterFunction("delete_recursive", DeleteFn);
-    RegisterFunction("package_extract_dir", PackageExtractDirFn);
-    RegisterFunction("package_extract_file", PackageExtractFileFn);
-    RegisterFunction("symlink", SymlinkFn);
-    RegisterFunction("set_perm", SetPermFn);
-    RegisterFunction("set_perm_recursive", SetPermFn);
-
-    RegisterFunction("getprop", GetPropFn);
-    RegisterFunction("file_getprop", FileGetPropFn);
-    RegisterFunction("write_raw_image", WriteRawImageFn);
-    RegisterFunction("write_firmware_image", WriteFirmwareImageFn);
-
-    RegisterFunction("apply_patch", ApplyPatchFn);
-    RegisterFunction("apply_patch_check", ApplyPatchFn);
-    RegisterFunction("apply_patch_space", ApplyPatchFn);
-
-    RegisterFunction("ui_print", UIPrintFn);
+    RegisterTracedFunction("mount", MountFn);
+    RegisterTracedFunction("is_mounted", IsMountedFn);
+    RegisterTracedFunction("unmount", UnmountFn);
+    RegisterTracedFunction("format", FormatFn);
+    RegisterTracedFunction("show_progress", ShowProgressFn);
+    RegisterTracedFunction("set_progress", SetProgressFn);
+    RegisterTracedFunction("delete", DeleteFn);
+    RegisterTracedFunction("delete_recursive", DeleteFn);
+    RegisterTracedFunction("package_extract_dir", PackageExtractDirFn);
+    RegisterTracedFunction("package_extract_file", PackageExtractFileFn);
+    RegisterTracedFunction("symlink", SymlinkFn);
+    RegisterTracedFunction("set_perm", SetPermFn);
+    RegisterTracedFunction("set_perm_recursive", SetPermFn);
+
+    RegisterTracedFunction("getprop", GetPropFn);
+    RegisterTracedFunction("file_getprop", FileGetPropFn);
+    RegisterTracedFunction("write_raw_image", WriteRawImageFn);
+    RegisterTracedFunction("write_firmware_image", WriteFirmwareImageFn);
+
+    RegisterTracedFunction("apply_patch", ApplyPatchFn);
+    RegisterTracedFunction("apply_patch_check", ApplyPatchFn);
+    RegisterTracedFunction("apply_patch_space", ApplyPatchFn);
+
+    RegisterTracedFunction("ui_print", UIPrintFn);
 }
@@ -17,6 +17,12 @@
 #ifndef _UPDATER_INSTALL_H_
 #define _UPDATER_INSTALL_H_
 
+#include "edify/expr.h"
+
 void RegisterInstallFunctions();
 
+// These only read from the device, so plan mode uses them as-is.
+char* GetPropFn(const char* name, State* state, int argc, Expr* argv[]);
+char* FileGetPropFn(const char* name, State* state, int argc, Expr* argv[]);
+
 #endif
@@ -0,0 +1,614 @@
+/*
+ * Copyright (C) 2009 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "edify/expr.h"
+#include "install.h"
+#include "minzip/Zip.h"
+#include "plan.h"
+#include "updater.h"
+
+static PlanCalibration calibration = {
+    4.0 * 1024 * 1024,    // extract_bps
+    3.0 * 1024 * 1024,    // flash_bps
+    0.5,                  // erase_sec
+    0.0015,               // file_sec
+    0.0001,               // perm_sec
+    1.5,                  // patch_sec
+};
+
+// Everything the plan knows about one partition.  Files that land
+// outside any mounted partition (e.g., images staged in /tmp) are
+// charged to ROOTFS.
+#define ROOTFS "(rootfs)"
+
+typedef struct {
+    char* name;
+    int erased;
+    int files;
+    long long extract_bytes;
+    long long raw_bytes;
+    long long firmware_bytes;
+} PlanPartition;
+
+typedef struct {
+    char* mount_point;
+    char* location;
+} PlanMount;
+
+// A file or directory tree the script has extracted, so later calls
+// (write_raw_image, set_perm_recursive) can find out what they would
+// have operated on.
+typedef struct {
+    char* path;
+    int files;
+    long long bytes;
+} PlanExtract;
+
+static PlanPartition* partitions = NULL;
+static int partition_count = 0;
+static int partition_size = 0;
+
+static PlanMount* mounts = NULL;
+static int mount_count = 0;
+static int mount_size = 0;
+
+static PlanExtract* extracts = NULL;
+static int extract_count = 0;
+static int extract_size = 0;
+
+static int perm_ops = 0;
+static int symlinks = 0;
+static int deletes = 0;
+static int patches = 0;
+static double script_seconds = 0;
+
+// Returns NULL if out of memory.
+static PlanPartition* find_partition(const char* name) {
+    int i;
+    for (i = 0; i < partition_count; ++i) {
+        if (strcmp(partitions[i].name, name) == 0) return partitions+i;
+    }
+    if (partition_count >= partition_size) {
+        int size = partition_size*2 + 1;
+        PlanPartition* grown =
+            realloc(partitions, size * sizeof(PlanPartition));
+        if (grown == NULL) return NULL;
+        partitions = grown;
+        partition_size = size;
+    }
+    char* copy = strdup(name);
+    if (copy == NULL) return NULL;
+    PlanPartition* p = partitions + partition_count++;
+    memset(p, 0, sizeof(*p));
+    p->name = copy;
+    return p;
+}
+
+// True if 'path' is 'dir' or something underneath it.
+static int path_under(const char* path, const char* dir) {
+    size_t len = strlen(dir);
+    while (len > 1 && dir[len-1] == '/') --len;
+    return strncmp(path, dir, len) == 0 &&
+        (path[len] == '\0' || path[len] == '/');
+}
+
+// The partition a path would be written to, judging by what the
+// script has mounted so far.  NULL if out of memory.
+static PlanPartition* partition_for_path(const char* path) {
+    const PlanMount* best = NULL;
+    int i;
+    for (i = 0; i < mount_count; ++i) {
+        if (path_under(path, mounts[i].mount_point) &&
+            (best == NULL ||
+             strlen(mounts[i].mount_point) > strlen(best->mount_point))) {
+            best = mounts+i;
+        }
+    }
+    return find_partition(best == NULL ? ROOTFS : best->location);
+}
+
+// Returns 0 on success, -1 if out of memory.
+static int add_extract(const char* path, int files, long long bytes) {
+    if (extract_count >= extract_size) {
+        int size = extract_size*2 + 1;
+        PlanExtract* grown = realloc(extracts, size * sizeof(PlanExtract));
+        if (grown == NULL) return -1;
+        extracts = grown;
+        extract_size = size;
+    }
+    char* copy = strdup(path);
+    if (copy == NULL) return -1;
+    extracts[extract_count].path = copy;
+    extracts[extract_count].files = files;
+    extracts[extract_count].bytes = bytes;
+    ++extract_count;
+    return 0;
+}
+
+// mount(type, location, mount_point)
+static char* PlanMountFn(const char* name, State* state,
+                         int argc, Expr* argv[]) {
+    if (argc != 3) {
+        return ErrorAbort(state, "%s() expects 3 args, got %d", name, argc);
+    }
+    char* type;
+    char* location;
+    char* mount_point;
+    if (ReadArgs(state, argv, 3, &type, &location, &mount_point) < 0) {
+        return NULL;
+    }
+    free(type);
+
+    char* copy = NULL;
+    if (mount_count >= mount_size) {
+        int size = mount_size*2 + 1;
+        PlanMount* grown = realloc(mounts, size * sizeof(PlanMount));
+        if (grown == NULL) goto oom;
+        mounts = grown;
+        mount_size = size;
+    }
+    if (find_partition(location) == NULL) goto oom;
+    copy = strdup(mount_point);
+    if (copy == NULL) goto oom;
+    mounts[mount_count].mount_point = copy;
+    mounts[mount_count].location = location;
+    ++mount_count;
+
+    return mount_point;
+
+oom:
+    free(location);
+    free(mount_point);
+    return ErrorAbort(state, "%s: out of memory", name);
+}
+
+// is_mounted(mount_point)
+static char* PlanIsMountedFn(const char* name, State* state,
+                             int argc, Expr* argv[]) {
+    if (argc != 1) {
+        return ErrorAbort(state, "%s() expects 1 arg, got %d", name, argc);
+    }
+    char* mount_point;
+    if (ReadArgs(state, argv, 1, &mount_point) < 0) return NULL;
+
+    int i;
+    for (i = 0; i < mount_count; ++i) {
+        if (strcmp(mounts[i].mount_point, mount_point) == 0) {
+            return mount_point;
+        }
+    }
+    free(mount_point);
+    return strdup("");
+}
+
+// unmount(mount_point)
+static char* PlanUnmountFn(const char* name, State* state,
+                           int argc, Expr* argv[]) {
+    if (argc != 1) {
+        return ErrorAbort(state, "%s() expects 1 arg, got %d", name, argc);
+    }
+    char* mount_point;
+    if (ReadArgs(state, argv, 1, &mount_point) < 0) return NULL;
+
+    int i;
+    for (i = 0; i < mount_count; ++i) {
+        if (strcmp(mounts[i].mount_point, mount_point) == 0) {
+            free(mounts[i].mount_point);
+            free(mounts[i].location);
+            mounts[i] = mounts[--mount_count];
+            return mount_point;
+        }
+    }
+    free(mount_point);
+    return strdup("");
+}
+
+// format(type, location)
+static char* PlanFormatFn(const char* name, State* state,
+                          int argc, Expr* argv[]) {
+    if (argc != 2) {
+        return ErrorAbort(state, "%s() expects 2 args, got %d", name, argc);
+    }
+    char* type;
+    char* location;
+    if (ReadArgs(state, argv, 2, &type, &location) < 0) return NULL;
+    free(type);
+
+    PlanPartition* p = find_partition(location);
+    if (p == NULL) {
+        free(location);
+        return ErrorAbort(state, "%s: out of memory", name);
+    }
+    p->erased++;
+    return location;
+}
+
+// delete(file, ...), delete_recursive(dir, ...)
+static char* PlanDeleteFn(const char* name, State* state,
+                          int argc, Expr* argv[]) {
+    char** paths = ReadVarArgs(state, argc, argv);
+    if (paths == NULL) return NULL;
+
+    int i;
+    for (i = 0; i < argc; ++i) {
+        free(paths[i]);
+    }
+    free(paths);
+    deletes += argc;
+
+    char buffer[10];
+    sprintf(buffer, "%d", argc);
+    return strdup(buffer);
+}
+
+// show_progress(fraction, seconds)
+static char* PlanShowProgressFn(const char* name, State* state,
+                                int argc, Expr* argv[]) {
+    if (argc != 2) {
+        return ErrorAbort(state, "%s() expects 2 args, got %d", name, argc);
+    }
+    char* frac_str;
+    char* sec_str;
+    if (ReadArgs(state, argv, 2, &frac_str, &sec_str) < 0) return NULL;
+
+    script_seconds += strtod(sec_str, NULL);
+
+    free(sec_str);
+    return frac_str;
+}
+
+// set_progress(fraction)
+static char* PlanSetProgressFn(const char* name, State* state,
+                               int argc, Expr* argv[]) {
+    if (argc != 1) {
+        return ErrorAbort(state, "%s() expects 1 arg, got %d", name, argc);
+    }
+    char* frac_str;
+    if (ReadArgs(state, argv, 1, &frac_str) < 0) return NULL;
+    return frac_str;
+}
+
+// package_extract_dir(package_path, destination_path)
+static char* PlanExtractDirFn(const char* name, State* state,
+                              int argc, Expr* argv[]) {
+    if (argc != 2) {
+        return ErrorAbort(state, "%s() expects 2 args, got %d", name, argc);
+    }
+    char* zip_path;
+    char* dest_path;
+    if (ReadArgs(state, argv, 2, &zip_path, &dest_path) < 0) return NULL;
+
+    // Match the entries mzExtractRecursive() would: everything under
+    // "zip_path/" that isn't itself a directory.
+    size_t prefix_len = strlen(zip_path);
+    while (prefix_len > 0 && zip_path[prefix_len-1] == '/') --prefix_len;
+
+    ZipArchive* za = ((UpdaterInfo*)(state->cookie))->package_zip;
+    int files = 0;
+    long long bytes = 0;
+    unsigned int i;
+    for (i = 0; i < mzZipEntryCount(za); ++i) {
+        const ZipEntry* entry = mzGetZipEntryAt(za, i);
+        UnterminatedString fn = mzGetZipEntryFileName(entry);
+        if (prefix_len > 0 &&
+            (fn.len <= prefix_len + 1 ||
+             memcmp(fn.str, zip_path, prefix_len) != 0 ||
+             fn.str[prefix_len] != '/')) {
+            continue;
+        }
+        if (fn.len > 0 && fn.str[fn.len-1] == '/') continue;
+        ++files;
+        bytes += mzGetZipEntryUncompLen(entry);
+    }
+
+    PlanPartition* p = partition_for_path(dest_path);
+    int ok = p != NULL && add_extract(dest_path, files, bytes) == 0;
+    if (ok) {
+        p->files += files;
+        p->extract_bytes += bytes;
+    }
+
+    free(zip_path);
+    free(dest_path);
+    if (!ok) return ErrorAbort(state, "%s: out of memory", name);
+    return strdup("t");
+}
+
+// package_extract_file(package_path, destination_path)
+static char* PlanExtractFileFn(const char* name, State* state,
+                               int argc, Expr* argv[]) {
+    if (argc != 2) {
+        return ErrorAbort(state, "%s() expects 2 args, got %d", name, argc);
+    }
+    char* zip_path;
+    char* dest_path;
+    if (ReadArgs(state, argv, 2, &zip_path, &dest_path) < 0) return NULL;
+
+    ZipArchive* za = ((UpdaterInfo*)(state->cookie))->package_zip;
+    const ZipEntry* entry = mzFindZipEntry(za, zip_path);
+    int ok = 1;
+    if (entry == NULL) {
+        fprintf(stderr, "%s: no %s in package\n", name, zip_path);
+    } else {
+        long long bytes = mzGetZipEntryUncompLen(entry);
+        PlanPartition* p = partition_for_path(dest_path);
+        ok = p != NULL && add_extract(dest_path, 1, bytes) == 0;
+        if (ok) {
+            p->files++;
+            p->extract_bytes += bytes;
+        }
+    }
+
+    free(zip_path);
+    free(dest_path);
+    if (!ok) return ErrorAbort(state, "%s: out of memory", name);
+    return strdup(entry != NULL ? "t" : "");
+}
+
+// symlink(target, src1, src2, ...)
+static char* PlanSymlinkFn(const char* name, State* state,
+                           int argc, Expr* argv[]) {
+    if (argc == 0) {
+        return ErrorAbort(state, "%s() expects 1+ args, got %d", name, argc);
+    }
+    char** args = ReadVarArgs(state, argc, argv);
+    if (args == NULL) return NULL;
+
+    int i;
+    for (i = 0; i < argc; ++i) {
+        free(args[i]);
+    }
+    free(args);
+    symlinks += argc-1;
+    return strdup("");
+}
+
+// set_perm(uid, gid, mode, file1, ...)
+// set_perm_recursive(uid, gid, dirmode, filemode, dir1, ...)
+//
+// A recursive change is charged one operation per file the script has
+// extracted beneath each directory, plus the directory itself.  Files
+// that were already on the device aren't counted.
+static char* PlanSetPermFn(const char* name, State* state,
+                           int argc, Expr* argv[]) {
+    bool recursive = (strcmp(name, "set_perm_recursive") == 0);
+    int first = recursive ? 4 : 3;
+    if (argc <= first) {
+        return ErrorAbort(state, "%s() expects %d+ args, got %d",
+                          name, first+1, argc);
+    }
+
+    char** args = ReadVarArgs(state, argc, argv);
+    if (args == NULL) return NULL;
+
+    int i;
+    for (i = first; i < argc; ++i) {
+        ++perm_ops;
+        if (recursive) {
+            int j;
+            for (j = 0; j < extract_count; ++j) {
+                if (path_under(extracts[j].path, args[i])) {
+                    perm_ops += extracts[j].files;
+                }
+            }
+        }
+    }
+
+    for (i = 0; i < argc; ++i) {
+        free(args[i]);
+    }
+    free(args);
+    return strdup("");
+}
+
+// Size of a file the script wants to flash: either something it
+// extracted earlier in the plan, or a file already on the device.
+static long long image_size(const char* filename) {
+    int i;
+    for (i = extract_count-1; i >= 0; --i) {
+        if (strcmp(extracts[i].path, filename) == 0) {
+            return extracts[i].bytes;
+        }
+    }
+    struct stat st;
+    if (stat(filename, &st) == 0) return st.st_size;
+    return -1;
+}
+
+// write_raw_image(file, partition)
+// write_firmware_image(file, partition)
+static char* PlanWriteImageFn(const char* name, State* state,
+                              int argc, Expr* argv[]) {
+    if (argc != 2) {
+        return ErrorAbort(state, "%s() expects 2 args, got %d", name, argc);
+    }
+    char* filename;
+    char* partition;
+    if (ReadArgs(state, argv, 2, &filename, &partition) < 0) return NULL;
+
+    long long size = image_size(filename);
+    if (size < 0) {
+        fprintf(stderr, "%s: can't determine size of %s\n", name, filename);
+        size = 0;
+    }
+
+    PlanPartition* p = find_partition(partition);
+    free(filename);
+    free(partition);
+    if (p == NULL) return ErrorAbort(state, "%s: out of memory", name);
+
+    if (strcmp(name, "write_firmware_image") == 0) {
+        p->firmware_bytes += size;
+    } else {
+        p->raw_bytes += size;
+    }
+    return strdup("t");
+}
+
+// apply_patch(srcfile, tgtfile, tgtsha1, tgtsize, sha1:patch, ...)
+// apply_patch_check(file, sha1, ...)
+// apply_patch_space(bytes)
+//
+// Checks are assumed to pass; only actual patching costs time.
+static char* PlanApplyPatchFn(const char* name, State* state,
+                              int argc, Expr* argv[]) {
+    char** args = ReadVarArgs(state, argc, argv);
+    if (args == NULL) return NULL;
+
+    int i;
+    for (i = 0; i < argc; ++i) {
+        free(args[i]);
+    }
+    free(args);
+
+    if (strcmp(name, "apply_patch") == 0) ++patches;
+    return strdup("t");
+}
+
+// ui_print(msg, ...)
+static char* PlanUIPrintFn(const char* name, State* state,
+                           int argc, Expr* argv[]) {
+    char** args = ReadVarArgs(state, argc, argv);
+    if (args == NULL) return NULL;
+
+    int i;
+    for (i = 0; i < argc; ++i) {
+        free(args[i]);
+    }
+    free(args);
+    return strdup("");
+}
+
+void RegisterPlanFunctions() {
+    RegisterFunction("mount", PlanMountFn);
+    RegisterFunction("is_mounted", PlanIsMountedFn);
+    RegisterFunction("unmount", PlanUnmountFn);
+    RegisterFunction("format", PlanFormatFn);
+    RegisterFunction("show_progress", PlanShowProgressFn);
+    RegisterFunction("set_progress", PlanSetProgressFn);
+    RegisterFunction("delete", PlanDeleteFn);
+    RegisterFunction("delete_recursive", PlanDeleteFn);
+    RegisterFunction("package_extract_dir", PlanExtractDirFn);
+    RegisterFunction("package_extract_file", PlanExtractFileFn);
+    RegisterFunction("symlink", PlanSymlinkFn);
+    RegisterFunction("set_perm", PlanSetPermFn);
+    RegisterFunction("set_perm_recursive", PlanSetPermFn);
+
+    RegisterFunction("getprop", GetPropFn);
+    RegisterFunction("file_getprop", FileGetPropFn);
+    RegisterFunction("write_raw_image", PlanWriteImageFn);
+    RegisterFunction("write_firmware_image", PlanWriteImageFn);
+
+    RegisterFunction("apply_patch", PlanApplyPatchFn);
+    RegisterFunction("apply_patch_check", PlanApplyPatchFn);
+    RegisterFunction("apply_patch_space", PlanApplyPatchFn);
+
+    RegisterFunction("ui_print", PlanUIPrintFn);
+}
+
+int LoadPlanCalibration(const char* path) {
+    FILE* f = fopen(path, "r");
+    if (f == NULL) {
+        fprintf(stderr, "can't open calibration file %s\n", path);
+        return -1;
+    }
+
+    static const struct {
+        const char* key;
+        double* value;
+    } keys[] = {
+        { "extract_bps", &calibration.extract_bps },
+        { "flash_bps",   &calibration.flash_bps },
+        { "erase_sec",   &calibration.erase_sec },
+        { "file_sec",    &calibration.file_sec },
+        { "perm_sec",    &calibration.perm_sec },
+        { "patch_sec",   &calibration.patch_sec },
+    };
+
+    int result = 0;
+    char line[256];
+    while (fgets(line, sizeof(line), f)) {
+        char key[64];
+        double value;
+        if (line[0] == '#' || sscanf(line, "%63s", key) != 1) continue;
+        if (sscanf(line, "%63s %lf", key, &value) != 2 || value < 0) {
+            fprintf(stderr, "%s: bad line: %s", path, line);
+            result = -1;
+            continue;
+        }
+        unsigned int i;
+        for (i = 0; i < sizeof(keys) / sizeof(keys[0]); ++i) {
+            if (strcmp(key, keys[i].key) == 0) {
+                *keys[i].value = value;
+                break;
+            }
+        }
+        if (i == sizeof(keys) / sizeof(keys[0])) {
+            fprintf(stderr, "%s: unknown key \"%s\"\n", path, key);
+            result = -1;
+        }
+    }
+    fclose(f);
+
+    if (calibration.extract_bps <= 0 || calibration.flash_bps <= 0) {
+        fprintf(stderr, "%s: throughput must be positive\n", path);
+        result = -1;
+    }
+    return result;
+}
+
+void WritePlan(FILE* f) {
+    double total = 0;
+    long long total_bytes = 0;
+
+    fprintf(f, "%-16s %5s %7s %12s %12s %12s %8s\n",
+            "partition", "erase", "files", "extract", "raw", "firmware",
+            "est(s)");
+    int i;
+    for (i = 0; i < partition_count; ++i) {
+        const PlanPartition* p = partitions+i;
+        // Firmware images are handed to the bootloader, which writes
+        // them after the updater exits; they cost nothing here.
+        double t = p->erased * calibration.erase_sec +
+            p->files * calibration.file_sec +
+            p->extract_bytes / calibration.extract_bps +
+            p->raw_bytes / calibration.flash_bps;
+        fprintf(f, "%-16s %5d %7d %12lld %12lld %12lld %8.1f\n",
+                p->name, p->erased, p->files, p->extract_bytes,
+                p->raw_bytes, p->firmware_bytes, t);
+        total += t;
+        total_bytes += p->extract_bytes + p->raw_bytes;
+    }
+
+    double other = (symlinks + deletes) * calibration.file_sec +
+        perm_ops * calibration.perm_sec +
+        patches * calibration.patch_sec;
+    fprintf(f, "\n%d symlinks, %d deletes, %d permission ops, %d patches"
+            " (est %.1fs)\n", symlinks, deletes, perm_ops, patches, other);
+    total += other;
+
+    fprintf(f, "%lld bytes to write; estimated %.1fs", total_bytes, total);
+    if (script_seconds > 0) {
+        fprintf(f, " (script's progress bar allows %.1fs)", script_seconds);
+    }
+    fprintf(f, "\n");
+}
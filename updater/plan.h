@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2009 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _UPDATER_PLAN_H_
+#define _UPDATER_PLAN_H_
+
+#include <stdio.h>
+
+// Plan mode runs an updater-script against stand-ins for the install
+// functions that touch the device.  Nothing is mounted, erased or
+// written; instead each call is recorded (bytes each partition would
+// receive, files created, permission changes, partitions erased) and
+// the total is turned into a time estimate.  getprop() and
+// file_getprop() still read the real values, so the script's asserts
+// behave as they would during the install.
+
+// Throughput figures used for the estimate.  The defaults are rough
+// numbers for a G1-class device; better ones can be taken from a
+// --profile run (bytes moved divided by wall time for each function).
+typedef struct {
+    double extract_bps;   // inflating package files onto a filesystem
+    double flash_bps;     // writing a raw image to an MTD partition
+    double erase_sec;     // formatting one partition
+    double file_sec;      // creating (or deleting) one file or symlink
+    double perm_sec;      // one chown/chmod pair
+    double patch_sec;     // one apply_patch() call
+} PlanCalibration;
+
+// Register the plan versions of everything RegisterInstallFunctions()
+// provides.  Use one or the other, not both.
+void RegisterPlanFunctions();
+
+// Read "key value" lines (keys named as in PlanCalibration) from
+// 'path' over the defaults.  Returns 0 on success, -1 if the file
+// can't be read or contains an unknown key.
+int LoadPlanCalibration(const char* path);
+
+// Print what the script evaluated so far would have done.
+void WritePlan(FILE* f);
+
+#endif
@@ -14,42 +14,178 @@
  * limitations under the License.
  */
 
+#include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "edify/expr.h"
+#include "edify/program.h"
 #include "updater.h"
 #include "install.h"
+#include "plan.h"
+#include "mincrypt/sha.h"
 #include "minzip/Zip.h"
+#include "trace/trace.h"
 
 // Where in the package we expect to find the edify script to execute.
 // (Note it's "updateR-script", not the older "update-script".)
 #define SCRIPT_NAME "META-INF/com/google/android/updater-script"
 
-int main(int argc, char** argv) {
-    if (argc != 4) {
-        fprintf(stderr, "unexpected number of arguments (%d)\n", argc);
-        return 1;
+// Compiled scripts are cached here, named by the SHA-1 of the script
+// text, so that retrying the same package skips the parser.  Nothing
+// checks that a cached image really came from that script, so it must
+// live where only recovery can write: the ramdisk's /tmp, which is
+// gone after a reboot.  (Not /cache, which the main system can write.)
+#define SCRIPT_CACHE_DIR "/tmp"
+
+// A cache file is the digest of the script it was compiled from,
+// padded to keep the program image aligned, followed by the image.
+#define SCRIPT_CACHE_HEADER_SIZE ((SHA_DIGEST_SIZE + 3) & ~3)
+
+// If this is set in the environment (recovery sets it when run with
+// --profile), Evaluate() is instrumented and the per-call profile is
+// appended to the file it names.
+#define PROFILE_ENV "UPDATER_PROFILE"
+
+// If this is set in the environment (recovery sets it), spans for each
+// script command and for the extracting and flashing under it are
+// recorded and written to the file it names, for recovery to merge
+// into its own trace.
+#define TRACE_ENV "UPDATER_TRACE"
+
+static void script_cache_path(const uint8_t* digest, char* path, size_t len) {
+    char hex[SHA_DIGEST_SIZE*2 + 1];
+    int i;
+    for (i = 0; i < SHA_DIGEST_SIZE; ++i) {
+        sprintf(hex + i*2, "%02x", digest[i]);
+    }
+    snprintf(path, len, "%s/updater-script-%s.edc", SCRIPT_CACHE_DIR, hex);
+}
+
+// Map the compiled form of the script with the given digest, if
+// there is one, and build an Expr tree from it.  The mapping is never
+// released, since the tree's strings point into it.  Returns NULL if
+// there is no usable cached copy.
+static Expr* load_cached_script(const uint8_t* digest) {
+    char path[PATH_MAX];
+    script_cache_path(digest, path, sizeof(path));
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size <= SCRIPT_CACHE_HEADER_SIZE) {
+        close(fd);
+        return NULL;
+    }
+    void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return NULL;
+
+    Program program;
+    Expr* root = NULL;
+    if (memcmp(data, digest, SHA_DIGEST_SIZE) == 0 &&
+        LoadProgram((char*)data + SCRIPT_CACHE_HEADER_SIZE,
+                    st.st_size - SCRIPT_CACHE_HEADER_SIZE, &program) == 0) {
+        char* errmsg = NULL;
+        root = InstantiateProgram(&program, &errmsg);
+        if (root == NULL) {
+            fprintf(stderr, "can't use cached script %s: %s\n", path,
+                    errmsg == NULL ? "out of memory" : errmsg);
+            free(errmsg);
+        }
+    }
+    if (root == NULL) {
+        munmap(data, st.st_size);
+        unlink(path);
+        return NULL;
     }
+    fprintf(stderr, "using cached script %s\n", path);
+    return root;
+}
+
+// Write the compiled form of 'root' to the cache.  Failure is not an
+// error; the next run just parses the script again.
+static void save_cached_script(const uint8_t* digest, Expr* root) {
+    struct stat st;
+    if (stat(SCRIPT_CACHE_DIR, &st) < 0 || !S_ISDIR(st.st_mode)) return;
+
+    size_t size;
+    void* image = CompileProgram(root, &size);
+    if (image == NULL) return;
+
+    char path[PATH_MAX];
+    char temp[PATH_MAX];
+    script_cache_path(digest, path, sizeof(path));
+    snprintf(temp, sizeof(temp), "%s.tmp", path);
 
-    char* version = argv[1];
-    if ((version[0] != '1' && version[0] != '2') || version[1] != '\0') {
-        // We support version "1" or "2".
-        fprintf(stderr, "wrong updater binary API; expected 1 or 2, got %s\n",
-                argv[1]);
-        return 2;
+    char header[SCRIPT_CACHE_HEADER_SIZE];
+    memset(header, 0, sizeof(header));
+    memcpy(header, digest, SHA_DIGEST_SIZE);
+
+    // Write to a temporary name and rename it into place, so a run
+    // that is interrupted never leaves a truncated file behind.
+    FILE* f = fopen(temp, "wb");
+    if (f != NULL) {
+        int ok = fwrite(header, 1, sizeof(header), f) == sizeof(header) &&
+                 fwrite(image, 1, size, f) == size;
+        if (fclose(f) == 0 && ok && rename(temp, path) == 0) {
+            fprintf(stderr, "cached compiled script as %s\n", path);
+        } else {
+            unlink(temp);
+        }
     }
+    free(image);
+}
+
+int main(int argc, char** argv) {
+    // "updater --plan <package> [<calibration>]" evaluates the script
+    // without touching the device and prints what it would have done.
+    int plan = argc >= 3 && argc <= 4 && strcmp(argv[1], "--plan") == 0;
 
-    // Set up the pipe for sending commands back to the parent process.
+    FILE* cmd_pipe;
+    char* package_data;
+    if (plan) {
+        if (argc == 4 && LoadPlanCalibration(argv[3]) != 0) {
+            return 1;
+        }
+        cmd_pipe = stderr;
+        package_data = argv[2];
+    } else {
+        if (argc != 4) {
+            fprintf(stderr, "unexpected number of arguments (%d)\n", argc);
+            return 1;
+        }
+
+        char* version = argv[1];
+        if ((version[0] != '1' && version[0] != '2') || version[1] != '\0') {
+            // We support version "1" or "2".
+            fprintf(stderr,
+                    "wrong updater binary API; expected 1 or 2, got %s\n",
+                    argv[1]);
+            return 2;
+        }
+
+        // Set up the pipe for sending commands back to the parent process.
 
-    int fd = atoi(argv[2]);
-    FILE* cmd_pipe = fdopen(fd, "wb");
-    setlinebuf(cmd_pipe);
+        int fd = atoi(argv[2]);
+        cmd_pipe = fdopen(fd, "wb");
+        setlinebuf(cmd_pipe);
+        package_data = argv[3];
+    }
+
+    const char* trace_path = plan ? NULL : getenv(TRACE_ENV);
+    if (trace_path != NULL) {
+        trace_init(TRACE_DEFAULT_EVENTS);
+    }
 
     // Extract the script from the package.
 
-    char* package_data = argv[3];
     ZipArchive za;
     int err;
     err = mzOpenZipArchive(package_data, &za);
@@ -75,22 +211,43 @@ int main(int argc, char** argv) {
     // Configure edify's functions.
 
     RegisterBuiltins();
-    RegisterInstallFunctions();
+    if (plan) {
+        RegisterPlanFunctions();
+    } else {
+        RegisterInstallFunctions();
+    }
     FinishRegistration();
 
-    // Parse the script.
+    // Parse the script, unless a previous run left its compiled form
+    // in the cache.  The script text is still needed either way, for
+    // the source locations in error messages.  A plan run leaves the
+    // cache alone, like everything else on the device.
+
+    uint8_t digest[SHA_DIGEST_SIZE];
+    SHA_CTX sha;
+    SHA_init(&sha);
+    SHA_update(&sha, script, script_entry->uncompLen);
+    memcpy(digest, SHA_final(&sha), SHA_DIGEST_SIZE);
 
-    Expr* root;
-    int error_count = 0;
-    yy_scan_string(script);
-    int error = yyparse(&root, &error_count);
-    if (error != 0 || error_count > 0) {
-        fprintf(stderr, "%d parse errors\n", error_count);
-        return 6;
+    Expr* root = plan ? NULL : load_cached_script(digest);
+    if (root == NULL) {
+        int error_count = 0;
+        yy_scan_string(script);
+        int error = yyparse(&root, &error_count);
+        if (error != 0 || error_count > 0) {
+            fprintf(stderr, "%d parse errors\n", error_count);
+            return 6;
+        }
+        if (!plan) save_cached_script(digest, root);
     }
 
     // Evaluate the parsed script.
 
+    const char* profile_path = plan ? NULL : getenv(PROFILE_ENV);
+    if (profile_path != NULL) {
+        EnableProfiling();
+    }
+
     UpdaterInfo updater_info;
     updater_info.cmd_pipe = cmd_pipe;
     updater_info.package_zip = &za;
@@ -101,6 +258,28 @@ int main(int argc, char** argv) {
     state.errmsg = NULL;
 
     char* result = Evaluate(&state, root);
+
+    if (plan) {
+        // Show the plan even if the script aborted, up to the point
+        // where it did.
+        WritePlan(stdout);
+    }
+
+    if (profile_path != NULL) {
+        FILE* pf = fopen(profile_path, "a");
+        if (pf == NULL) {
+            fprintf(stderr, "can't write profile to %s\n", profile_path);
+        } else {
+            fprintf(pf, "# updater-script from %s\n", package_data);
+            WriteProfile(pf, script);
+            fclose(pf);
+        }
+    }
+
+    if (trace_path != NULL && trace_write(trace_path) != 0) {
+        fprintf(stderr, "can't write trace to %s\n", trace_path);
+    }
+
     if (result == NULL) {
         if (state.errmsg == NULL) {
             fprintf(stderr, "script aborted (no error message)\n");
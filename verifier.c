@@ -20,6 +20,7 @@
 #include "minzip/Zip.h"
 #include "mincrypt/rsa.h"
 #include "mincrypt/sha.h"
+#include "trace/trace.h"
 
 #include <netinet/in.h>  /* required for resolv.h */
 #include <resolv.h>      /* for base64 codec */
@@ -78,13 +79,16 @@ static bool updateHash(const unsigned char *data, int dataLen, void *cookie) {
 static bool digestEntry(const ZipArchive *pArchive, const ZipEntry *pEntry,
         unsigned *doneBytes, unsigned totalBytes,
         uint8_t digest[SHA_DIGEST_SIZE]) {
+    UnterminatedString name = mzGetZipEntryFileName(pEntry);
+    int span = trace_begin_n("verify_entry", name.str, name.len);
     struct DigestContext context;
     SHA_init(&context.digest);
     context.doneBytes = doneBytes;
     context.totalBytes = totalBytes;
-    if (!mzProcessZipEntryContents(pArchive, pEntry, updateHash, &context)) {
-        UnterminatedString fn = mzGetZipEntryFileName(pEntry);
-        LOGE("Can't digest %.*s\n", fn.len, fn.str);
+    bool ok = mzProcessZipEntryContents(pArchive, pEntry, updateHash, &context);
+    trace_end(span, ok ? mzGetZipEntryUncompLen(pEntry) : 0);
+    if (!ok) {
+        LOGE("Can't digest %.*s\n", name.len, name.str);
         return false;
     }
 
@@ -351,11 +355,18 @@ static bool verifyArchive(const ZipArchive *pArchive, const ZipEntry *mfEntry) {
 
 bool verify_jar_signature(const ZipArchive *pArchive,
         const RSAPublicKey *pKeys, int numKeys) {
+    int span = trace_begin("verify_signature", NULL);
     const ZipEntry *sfEntry = verifySignature(pArchive, pKeys, numKeys);
+    trace_end(span, 0);
     if (sfEntry == NULL) return false;
 
+    span = trace_begin("verify_manifest", NULL);
     const ZipEntry *mfEntry = verifyManifest(pArchive, sfEntry);
+    trace_end(span, 0);
     if (mfEntry == NULL) return false;
 
-    return verifyArchive(pArchive, mfEntry);
+    span = trace_begin("verify_archive", NULL);
+    bool ok = verifyArchive(pArchive, mfEntry);
+    trace_end(span, 0);
+    return ok;
 }